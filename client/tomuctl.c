@@ -0,0 +1,357 @@
+// tomuctl: tiny client for the tomu control sockets
+// only libc here, it must start fast (status bars run it a lot)
+
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../src/instance.h"
+#define STATUS_READER_ONLY
+#include "../src/status.h"
+
+#define MAX_INSTANCES 256
+
+static void usage(void)
+{
+  printf(
+    "Usage: tomuctl [-p PID | -a] COMMAND\n"
+    "       tomuctl list\n\n"
+
+    "   -p PID     : send to the tomu with this pid\n"
+    "   -a         : send to every running tomu\n"
+    "   (default)  : send to the newest tomu\n"
+
+    "\nCommands:\n"
+    " toggle pause resume stop next prev loop shuffle\n"
+    " vol+ vol- speed+ speed- fwd back fwd-min back-min status stats\n"
+    " mark-a mark-b ab-clear buffer\n"
+    " track N                : go to track N of the CUE sheet playing\n"
+    " chapter+ chapter-      : next/previous chapter\n"
+    " chapter N              : go to chapter N (from 1)\n"
+    " goto SECONDS           : seek from the start of the file\n"
+    " info                   : read the status page (no socket)\n"
+    " subscribe [EVENT,...]  : print events (track pause resume seek\n"
+    "                          underrun stall stall-end chapter position[:HZ],\n"
+    "                          default all)\n"
+  );
+}
+
+// drop what a dead instance left behind: its socket and its status page
+static void reap_instance(pid_t pid)
+{
+  char path[512];
+  if (instance_path(path, sizeof(path), pid, INSTANCE_SOCK_SUFFIX) == 0)
+    unlink(path);
+  if (instance_path(path, sizeof(path), pid, STATUS_SUFFIX) == 0)
+    unlink(path);
+}
+
+// connect to the socket of one instance, -1 if it is gone
+static int connect_pid(pid_t pid)
+{
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+
+  if (instance_path(addr.sun_path, sizeof(addr.sun_path), pid, INSTANCE_SOCK_SUFFIX) < 0)
+    return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    // nobody listens: the instance died without cleaning up
+    if (errno == ECONNREFUSED) {
+      if (kill(pid, 0) < 0 && errno == ESRCH) reap_instance(pid);
+      else unlink(addr.sun_path);
+    }
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// all live instances, newest (highest socket mtime) last
+static int discover(pid_t *pids, int max)
+{
+  char dir[256];
+  if (instance_dir(dir, sizeof(dir)) < 0) return 0;
+
+  DIR *d = opendir(dir);
+  if (!d) return 0;
+
+  time_t mtimes[MAX_INSTANCES];
+  int count = 0;
+  struct dirent *entry;
+
+  while ((entry = readdir(d)) != NULL && count < max) {
+    pid_t pid = instance_pid(entry->d_name, INSTANCE_SOCK_SUFFIX);
+    if (!pid) continue;
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+
+    // skip (and reap) sockets of instances which are not running
+    if (kill(pid, 0) < 0 && errno == ESRCH) {
+      reap_instance(pid);
+      continue;
+    }
+
+    struct stat st;
+    time_t mtime = stat(path, &st) == 0 ? st.st_mtime : 0;
+
+    // insertion sort, there are only a handful
+    int i = count++;
+    while (i > 0 && mtimes[i - 1] > mtime) {
+      mtimes[i] = mtimes[i - 1];
+      pids[i] = pids[i - 1];
+      i--;
+    }
+    mtimes[i] = mtime;
+    pids[i] = pid;
+  }
+  closedir(d);
+  return count;
+}
+
+// connect and send one command, the socket to read the answer from
+static int command_open(pid_t pid, const char *cmd)
+{
+  int fd = connect_pid(pid);
+  if (fd < 0) {
+    fprintf(stderr, "tomuctl: %d: not running\n", (int)pid);
+    return -1;
+  }
+
+  char line[256];
+  int len = snprintf(line, sizeof(line), "%s\n", cmd);
+  if (len < 0 || (size_t)len >= sizeof(line) || send(fd, line, len, MSG_NOSIGNAL) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// send one command and print what the instance answered
+static int send_command(pid_t pid, const char *cmd, int show_pid)
+{
+  int fd = command_open(pid, cmd);
+  if (fd < 0) return -1;
+
+  // wait a little for the answer, a busy player must not hang us
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  char reply[2400];
+  int n = 0;
+
+  if (poll(&pfd, 1, 1000) > 0)
+    n = recv(fd, reply, sizeof(reply) - 1, 0);
+
+  if (n <= 0) {
+    close(fd);
+    fprintf(stderr, "tomuctl: %d: no answer\n", (int)pid);
+    return -1;
+  }
+  reply[n] = '\0';
+
+  if (show_pid) printf("%d: %s", (int)pid, reply);
+  else printf("%s", reply);
+
+  int ok = strncmp(reply, "ok", 2) == 0;
+
+  // subscribers stay and print events until the player goes away
+  if (ok && !strncmp(cmd, "subscribe", 9)) {
+    fflush(stdout);
+    while ((n = recv(fd, reply, sizeof(reply), 0)) > 0) {
+      fwrite(reply, 1, n, stdout);
+      fflush(stdout);
+    }
+  }
+  close(fd);
+
+  return ok ? 0 : -1;
+}
+
+// -a subscribe: the events of every instance, read together. each line
+// gets the pid it is from, it ends when the last one goes away
+static int subscribe_all(const pid_t *pids, int count, const char *cmd)
+{
+  static char lines[MAX_INSTANCES][2400];
+  size_t have[MAX_INSTANCES];
+  int answered[MAX_INSTANCES];
+  pid_t from[MAX_INSTANCES];
+  struct pollfd pfds[MAX_INSTANCES];
+  int n = 0, left = 0, failed = 0;
+
+  for (int j = 0; j < count; j++) {
+    int fd = command_open(pids[j], cmd);
+    if (fd < 0) {
+      failed = 1;
+      continue;
+    }
+    pfds[n] = (struct pollfd){ .fd = fd, .events = POLLIN };
+    from[n] = pids[j];
+    have[n] = 0;
+    answered[n] = 0;
+    n++;
+    left++;
+  }
+
+  while (left > 0 && poll(pfds, n, -1) > 0) {
+    for (int j = 0; j < n; j++) {
+      if (pfds[j].fd < 0 || !pfds[j].revents) continue;
+
+      ssize_t got = recv(pfds[j].fd, lines[j] + have[j], sizeof(lines[j]) - have[j], 0);
+      int gone = got <= 0;
+      if (!gone) have[j] += got;
+
+      char *start = lines[j], *end;
+      while (!gone && (end = memchr(start, '\n', have[j] - (start - lines[j])))) {
+        *end = '\0';
+        printf("%d: %s\n", (int)from[j], start);
+
+        // the first line answers the subscribe: not "ok", nothing follows
+        if (!answered[j]++ && strncmp(start, "ok", 2)) {
+          failed = 1;
+          gone = 1;
+        }
+        start = end + 1;
+      }
+      have[j] -= start - lines[j];
+      memmove(lines[j], start, have[j]);
+
+      // a line longer than the buffer, or the end of one cut off, as it is
+      if (have[j] == sizeof(lines[j]) || (gone && have[j])) {
+        printf("%d: %.*s\n", (int)from[j], (int)have[j], lines[j]);
+        have[j] = 0;
+      }
+      fflush(stdout);
+
+      if (gone) {
+        if (!answered[j]) {
+          fprintf(stderr, "tomuctl: %d: no answer\n", (int)from[j]);
+          failed = 1;
+        }
+        close(pfds[j].fd);
+        pfds[j].fd = -1;
+        left--;
+      }
+    }
+  }
+  return failed ? -1 : 0;
+}
+
+// read the shared status page, the player is not involved at all
+static int print_info(pid_t pid, int show_pid)
+{
+  char path[512];
+  if (instance_path(path, sizeof(path), pid, STATUS_SUFFIX) < 0) return -1;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "tomuctl: %d: no status page\n", (int)pid);
+    return -1;
+  }
+
+  const Status_Page *page = mmap(NULL, sizeof(Status_Page), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (page == MAP_FAILED) return -1;
+
+  Status_Page st;
+  int ret = status_page_read(page, &st);
+  munmap((void*)page, sizeof(Status_Page));
+
+  if (ret < 0) {
+    fprintf(stderr, "tomuctl: %d: bad status page\n", (int)pid);
+    return -1;
+  }
+
+  if (show_pid) printf("%d: ", (int)pid);
+  printf("%s %.1f/%d %.2fx v:%.0f%% s:%d l:%d %s",
+    st.paused ? "paused" : "playing", st.position, st.duration,
+    st.speed, st.volume * 100.0f, st.shuffle, st.looping, st.file);
+  if (st.title[0])
+    printf(" | %s%s%s", st.artist, st.artist[0] ? " - " : "", st.title);
+  printf("\n");
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  pid_t target = 0;
+  int all = 0, i = 1;
+
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if (!strcmp(argv[i], "-a"))
+      all = 1;
+    else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+      // 0 would mean no target: a typo must not go to the newest one
+      char *end;
+      errno = 0;
+      long pid = strtol(argv[++i], &end, 10);
+      if (errno || end == argv[i] || *end || pid <= 0 || pid != (pid_t)pid) {
+        fprintf(stderr, "tomuctl: -p %s: not a pid\n", argv[i]);
+        usage();
+        return 2;
+      }
+      target = (pid_t)pid;
+    }
+    else {
+      usage();
+      return !strcmp(argv[i], "-h") || !strcmp(argv[i], "--help") ? 0 : 2;
+    }
+  }
+
+  if (i == argc) {
+    usage();
+    return 2;
+  }
+
+  // the rest is the command with its arguments
+  char cmd[200] = "";
+  for (; i < argc; i++) {
+    if (strlen(cmd) + strlen(argv[i]) + 2 > sizeof(cmd)) {
+      fprintf(stderr, "tomuctl: command too long\n");
+      return 2;
+    }
+    if (cmd[0]) strcat(cmd, " ");
+    strcat(cmd, argv[i]);
+  }
+
+  int info = !strcmp(cmd, "info");
+
+  if (target)
+    return (info ? print_info(target, 0) : send_command(target, cmd, 0)) < 0;
+
+  pid_t pids[MAX_INSTANCES];
+  int count = discover(pids, MAX_INSTANCES);
+
+  if (!strcmp(cmd, "list")) {
+    for (int j = 0; j < count; j++)
+      send_command(pids[j], "status", 1);
+    return 0;
+  }
+
+  if (count == 0) {
+    fprintf(stderr, "tomuctl: no tomu is running\n");
+    return 1;
+  }
+
+  if (!all)
+    return (info ? print_info(pids[count - 1], 0) : send_command(pids[count - 1], cmd, 0)) < 0;
+
+  if (!info && !strncmp(cmd, "subscribe", 9))
+    return subscribe_all(pids, count, cmd) < 0;
+
+  int failed = 0;
+  for (int j = 0; j < count; j++)
+    failed |= (info ? print_info(pids[j], 1) : send_command(pids[j], cmd, 1)) < 0;
+  return failed;
+}
@@ -30,6 +30,7 @@ stdenv.mkDerivation rec {
   installPhase = ''
     mkdir -p $out/bin
     install -m755 tomu $out/bin/tomu
+    install -m755 tomuctl $out/bin/tomuctl
 
     wrapProgram $out/bin/tomu \
       --set AUDIODEV pulse
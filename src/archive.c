@@ -0,0 +1,588 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libavformat/avformat.h>
+#include <libavutil/mem.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "archive.h"
+#include "stats.h"
+
+#define AVIO_BUFFER_SIZE (64 * 1024)
+#define INFLATE_CHUNK    (64 * 1024)   // compressed bytes read at once
+#define INDEX_CACHE      8             // archives whose index stays in memory
+
+#define ZIP_EOCD_MAX     (22 + 65535)  // the end record and the longest comment
+#define ZIP_CD_MAX       (256 << 20)   // a bigger central directory is garbage
+#define TAR_NAME_MAX     4096          // GNU long names and pax paths
+
+#define ZIP_STORED       0
+#define ZIP_DEFLATE      8
+
+typedef struct {
+  char *name;
+  uint64_t offset;   // zip: the local header (the data follows it), tar: the data
+  uint64_t size;     // what the entry holds
+  uint64_t csize;    // what it takes in the archive
+  int method;        // ZIP_STORED (all of a tar) or ZIP_DEFLATE
+
+} Archive_Entry;
+
+typedef struct {
+  // the file it was made from, a changed archive is indexed again
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+
+  int type;
+  Archive_Entry *entries;
+  int count, cap;
+  uint64_t used;     // LRU clock
+
+} Archive_Index;
+
+struct Archive_IO {
+  int fd;
+  uint64_t start;    // the entry data in the archive
+  uint64_t size, csize;
+  int method;
+  uint64_t pos;      // where the demuxer reads, in the entry
+
+  // ZIP_DEFLATE: compressed bytes [0, in_pos) went to the inflater
+  z_stream z;
+  uint64_t in_pos;
+  uint8_t *in;
+
+  AVIOContext *avio;
+};
+
+static Archive_Index *cache[INDEX_CACHE];
+static uint64_t cache_clock;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint16_t le16(const uint8_t *p) { return p[0] | p[1] << 8; }
+static uint32_t le32(const uint8_t *p) { return le16(p) | (uint32_t)le16(p + 2) << 16; }
+static uint64_t le64(const uint8_t *p) { return le32(p) | (uint64_t)le32(p + 4) << 32; }
+
+// pread all of len (short only at the end of the file), counted like fileio
+static ssize_t read_at(int fd, void *buf, size_t len, uint64_t off)
+{
+  size_t got = 0;
+
+  while (got < len) {
+    ssize_t n = pread(fd, (uint8_t*)buf + got, len - got, off + got);
+    stats_add(io_syscalls, 1);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -1;
+    if (n == 0) break;
+    got += n;
+  }
+  stats_add(io_bytes, got);
+  return got;
+}
+
+static int ends_with(const char *s, const char *suffix)
+{
+  size_t len = strlen(s), slen = strlen(suffix);
+  return len > slen && !strcasecmp(s + len - slen, suffix);
+}
+
+// by the magic bytes, the name only says which ones to look for
+static int type_of(int fd, const char *path)
+{
+  uint8_t head[512];
+  int zip = ends_with(path, ".zip"), tar = ends_with(path, ".tar");
+  if (!zip && !tar) return ARCHIVE_NONE;
+
+  ssize_t n = read_at(fd, head, sizeof(head), 0);
+  if (zip && n >= 4 && (!memcmp(head, "PK\3\4", 4) || !memcmp(head, "PK\5\6", 4)))
+    return ARCHIVE_ZIP;
+  if (tar && n == sizeof(head) && !memcmp(head + 257, "ustar", 5))
+    return ARCHIVE_TAR;
+  return ARCHIVE_NONE;
+}
+
+int archive_type(const char *path)
+{
+  if (!ends_with(path, ".zip") && !ends_with(path, ".tar")) return ARCHIVE_NONE;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return ARCHIVE_NONE;
+
+  int type = type_of(fd, path);
+  close(fd);
+  return type;
+}
+
+int archive_split(const char *path, char *archive, size_t len, const char **entry)
+{
+  for (const char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+    size_t plen = slash - path;
+    if (plen >= len) return 0;
+
+    memcpy(archive, path, plen);
+    archive[plen] = '\0';
+
+    struct stat st;
+    if (stat(archive, &st) < 0) return 0;
+    if (S_ISDIR(st.st_mode)) continue;
+
+    // the first file on the way must be the archive
+    if (!S_ISREG(st.st_mode) || !archive_type(archive)) return 0;
+    if (entry) *entry = slash + 1;
+    return 1;
+  }
+  return 0;
+}
+
+// ===================== index =====================
+
+static int index_add(Archive_Index *idx, char *name, uint64_t offset, uint64_t size, uint64_t csize, int method)
+{
+  if (!name) return -1;
+
+  if (idx->count == idx->cap) {
+    int cap = idx->cap ? idx->cap * 2 : 64;
+    Archive_Entry *entries = realloc(idx->entries, cap * sizeof(Archive_Entry));
+    if (!entries) {
+      free(name);
+      return -1;
+    }
+    idx->entries = entries;
+    idx->cap = cap;
+  }
+
+  idx->entries[idx->count++] = (Archive_Entry){
+    .name = name, .offset = offset, .size = size, .csize = csize, .method = method
+  };
+  return 0;
+}
+
+static void index_free(Archive_Index *idx)
+{
+  if (!idx) return;
+  for (int i = 0; i < idx->count; i++)
+    free(idx->entries[i].name);
+  free(idx->entries);
+  free(idx);
+}
+
+// the central directory, found through the end record (zip64 when it overflows)
+static int zip_index(int fd, uint64_t size, Archive_Index *idx)
+{
+  size_t tail = size < ZIP_EOCD_MAX ? size : ZIP_EOCD_MAX;
+  uint8_t *buf = malloc(tail);
+  if (!buf || read_at(fd, buf, tail, size - tail) != (ssize_t)tail) {
+    free(buf);
+    return -1;
+  }
+
+  ssize_t at = (ssize_t)tail - 22;
+  while (at >= 0 && le32(buf + at) != 0x06054b50) at--;
+  if (at < 0) {
+    free(buf);
+    return -1;
+  }
+
+  const uint8_t *eocd = buf + at;
+  uint64_t cd_size = le32(eocd + 12), cd_off = le32(eocd + 16);
+
+  if ((le16(eocd + 10) == 0xFFFF || cd_size == 0xFFFFFFFF || cd_off == 0xFFFFFFFF) &&
+      at >= 20 && le32(eocd - 20) == 0x07064b50) {
+    uint8_t rec[56];
+    if (read_at(fd, rec, sizeof(rec), le64(eocd - 20 + 8)) == sizeof(rec) && le32(rec) == 0x06064b50) {
+      cd_size = le64(rec + 40);
+      cd_off = le64(rec + 48);
+    }
+  }
+  free(buf);
+
+  if (cd_size > ZIP_CD_MAX || cd_off + cd_size > size) return -1;
+
+  uint8_t *cd = malloc(cd_size ? cd_size : 1);
+  if (!cd || read_at(fd, cd, cd_size, cd_off) != (ssize_t)cd_size) {
+    free(cd);
+    return -1;
+  }
+
+  const uint8_t *p = cd, *end = cd + cd_size;
+  while (p + 46 <= end && le32(p) == 0x02014b50) {
+    int flags = le16(p + 8), method = le16(p + 10);
+    uint64_t csize = le32(p + 20), usize = le32(p + 24), offset = le32(p + 42);
+    int name_len = le16(p + 28), extra_len = le16(p + 30), comment_len = le16(p + 32);
+    if (p + 46 + name_len + extra_len + comment_len > end) break;
+
+    // zip64: the fields which overflowed are in the extra block, in this order
+    const uint8_t *x = p + 46 + name_len, *x_end = x + extra_len;
+    while (x + 4 <= x_end) {
+      int id = le16(x), len = le16(x + 2);
+      if (x + 4 + len > x_end) break;
+      if (id == 0x0001) {
+        const uint8_t *v = x + 4, *v_end = v + len;
+        if (usize == 0xFFFFFFFF && v + 8 <= v_end) { usize = le64(v); v += 8; }
+        if (csize == 0xFFFFFFFF && v + 8 <= v_end) { csize = le64(v); v += 8; }
+        if (offset == 0xFFFFFFFF && v + 8 <= v_end) { offset = le64(v); v += 8; }
+      }
+      x += 4 + len;
+    }
+
+    // folders, encrypted entries and methods we can't read are not listed
+    const char *name = (const char*)p + 46;
+    int folder = name_len > 0 && name[name_len - 1] == '/';
+    if (!folder && !(flags & 1) && (method == ZIP_STORED || method == ZIP_DEFLATE) && offset < size)
+      index_add(idx, strndup(name, name_len), offset, usize, csize, method);
+
+    p += 46 + name_len + extra_len + comment_len;
+  }
+  free(cd);
+  return 0;
+}
+
+// octal, or base-256 (GNU) when the high bit of the first byte is set
+static uint64_t tar_number(const uint8_t *p, int len)
+{
+  uint64_t value = 0;
+
+  if (p[0] & 0x80) {
+    value = p[0] & 0x7f;
+    for (int i = 1; i < len; i++) value = value << 8 | p[i];
+    return value;
+  }
+
+  for (int i = 0; i < len && p[i]; i++)
+    if (p[i] >= '0' && p[i] <= '7') value = value * 8 + (p[i] - '0');
+  return value;
+}
+
+// the name a GNU 'L' or a pax 'x' header gives the next entry
+static char *tar_long_name(int fd, uint64_t off, uint64_t len, int pax)
+{
+  if (len == 0 || len > (pax ? 65536 : TAR_NAME_MAX)) return NULL;
+
+  char *data = malloc(len + 1);
+  if (!data || read_at(fd, data, len, off) != (ssize_t)len) {
+    free(data);
+    return NULL;
+  }
+  data[len] = '\0';
+  if (!pax) return data;
+
+  // pax records: "<len> <key>=<value>\n"
+  char *name = NULL;
+  for (char *rec = data; rec < data + len; ) {
+    char *end;
+    long rec_len = strtol(rec, &end, 10);
+    if (rec_len <= 0 || rec + rec_len > data + len || *end != ' ') break;
+
+    if (!strncmp(end + 1, "path=", 5)) {
+      char *value = end + 6;
+      name = strndup(value, rec + rec_len - 1 - value);
+      break;
+    }
+    rec += rec_len;
+  }
+  free(data);
+  return name;
+}
+
+// every header from the start, one read each
+static int tar_index(int fd, uint64_t size, Archive_Index *idx)
+{
+  uint8_t h[512];
+  uint64_t off = 0;
+  char *long_name = NULL;
+
+  while (off + 512 <= size && read_at(fd, h, 512, off) == 512 && h[0]) {
+    uint64_t len = tar_number(h + 124, 12);
+    uint64_t data = off + 512;
+    char type = h[156];
+
+    if (type == 'L' || type == 'x') {
+      free(long_name);
+      long_name = tar_long_name(fd, data, len, type == 'x');
+    }
+    else if (type == '0' || type == '\0' || type == '7') {
+      char *name = long_name;
+      long_name = NULL;
+
+      // ustar: a prefix for names longer than the 100 bytes of the header
+      if (!name) {
+        char prefix[156] = "", base[101];
+        if (!memcmp(h + 257, "ustar", 5)) memcpy(prefix, h + 345, 155);
+        memcpy(base, h, 100);
+        base[100] = '\0';
+
+        size_t n = strlen(prefix) + strlen(base) + 2;
+        if ((name = malloc(n)))
+          snprintf(name, n, "%s%s%s", prefix, prefix[0] ? "/" : "", base);
+      }
+      if (data + len <= size)
+        index_add(idx, name, data, len, len, ZIP_STORED);
+      else
+        free(name);
+    }
+    else {
+      // folders, links...: a long name was theirs
+      free(long_name);
+      long_name = NULL;
+    }
+
+    off = data + ((len + 511) & ~511ULL);
+  }
+  free(long_name);
+  return 0;
+}
+
+// the index of an archive, from the cache or made now. cache_lock is held
+// on return (also with NULL), index_unlock() when done with it
+static Archive_Index *index_lock(const char *path)
+{
+  pthread_mutex_lock(&cache_lock);
+
+  struct stat st;
+  if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) return NULL;
+
+  int slot = 0;
+  for (int i = 0; i < INDEX_CACHE; i++) {
+    Archive_Index *idx = cache[i];
+    if (idx && idx->dev == st.st_dev && idx->ino == st.st_ino && idx->size == st.st_size &&
+        idx->mtime.tv_sec == st.st_mtim.tv_sec && idx->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+      idx->used = ++cache_clock;
+      stats_add(archive_index_hits, 1);
+      return idx;
+    }
+
+    // a free slot, or the one used the longest ago
+    if (cache[slot] && (!idx || idx->used < cache[slot]->used)) slot = i;
+  }
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return NULL;
+
+  Archive_Index *idx = calloc(1, sizeof(Archive_Index));
+  int ret = -1;
+  if (idx) {
+    idx->type = type_of(fd, path);
+    if (idx->type == ARCHIVE_ZIP) ret = zip_index(fd, st.st_size, idx);
+    if (idx->type == ARCHIVE_TAR) ret = tar_index(fd, st.st_size, idx);
+  }
+  close(fd);
+
+  if (ret < 0) {
+    index_free(idx);
+    return NULL;
+  }
+  stats_add(archive_index_builds, 1);
+
+  idx->dev = st.st_dev;
+  idx->ino = st.st_ino;
+  idx->size = st.st_size;
+  idx->mtime = st.st_mtim;
+  idx->used = ++cache_clock;
+
+  index_free(cache[slot]);
+  cache[slot] = idx;
+  return idx;
+}
+
+static void index_unlock(void)
+{
+  pthread_mutex_unlock(&cache_lock);
+}
+
+char **archive_list(const char *path, int *count)
+{
+  char **names = NULL;
+  *count = 0;
+
+  Archive_Index *idx = index_lock(path);
+  if (idx && (names = malloc((idx->count ? idx->count : 1) * sizeof(char*)))) {
+    for (int i = 0; i < idx->count; i++)
+      if ((names[*count] = strdup(idx->entries[i].name))) (*count)++;
+  }
+  index_unlock();
+  return names;
+}
+
+// ===================== reading an entry =====================
+
+// inflate up to len bytes of the entry, at least one unless it is over
+static int entry_inflate(Archive_IO *io, uint8_t *buf, int len)
+{
+  io->z.next_out = buf;
+  io->z.avail_out = len;
+
+  while (io->z.avail_out == (uInt)len) {
+    if (io->z.avail_in == 0) {
+      uint64_t left = io->csize - io->in_pos;
+      if (left == 0) break;
+
+      ssize_t n = read_at(io->fd, io->in, left < INFLATE_CHUNK ? left : INFLATE_CHUNK, io->start + io->in_pos);
+      if (n <= 0) return AVERROR(EIO);
+      io->in_pos += n;
+      io->z.next_in = io->in;
+      io->z.avail_in = n;
+    }
+
+    int ret = inflate(&io->z, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) break;
+    if (ret != Z_OK && ret != Z_BUF_ERROR) return AVERROR_INVALIDDATA;
+  }
+
+  int got = len - io->z.avail_out;
+  if (got == 0) return AVERROR_EOF;
+  io->pos += got;
+  return got;
+}
+
+static int entry_read(void *opaque, uint8_t *buf, int len)
+{
+  Archive_IO *io = opaque;
+  if (io->pos >= io->size) return AVERROR_EOF;
+  if ((uint64_t)len > io->size - io->pos) len = io->size - io->pos;
+
+  if (io->method == ZIP_DEFLATE)
+    return entry_inflate(io, buf, len);
+
+  ssize_t n = read_at(io->fd, buf, len, io->start + io->pos);
+  if (n < 0) return AVERROR(errno);
+  if (n == 0) return AVERROR_EOF;
+  io->pos += n;
+  return n;
+}
+
+static int64_t entry_seek(void *opaque, int64_t offset, int whence)
+{
+  Archive_IO *io = opaque;
+
+  if (whence & AVSEEK_SIZE) return io->size;
+  whence &= ~AVSEEK_FORCE;
+
+  int64_t pos;
+  if (whence == SEEK_SET) pos = offset;
+  else if (whence == SEEK_CUR) pos = io->pos + offset;
+  else if (whence == SEEK_END) pos = io->size + offset;
+  else return AVERROR(EINVAL);
+
+  if (pos < 0) return AVERROR(EINVAL);
+  if ((uint64_t)pos > io->size) pos = io->size;
+
+  if (io->method == ZIP_STORED) {
+    io->pos = pos;
+    return pos;
+  }
+
+  // deflate only goes forward: back means inflating from the start again
+  if ((uint64_t)pos < io->pos) {
+    inflateReset(&io->z);
+    io->z.avail_in = 0;
+    io->in_pos = 0;
+    io->pos = 0;
+  }
+
+  uint8_t skip[4096];
+  while (io->pos < (uint64_t)pos) {
+    uint64_t left = pos - io->pos;
+    int ret = entry_inflate(io, skip, left < sizeof(skip) ? left : sizeof(skip));
+    if (ret < 0) return ret;
+  }
+  return pos;
+}
+
+AVIOContext *archive_open(const char *path, Archive_IO **out)
+{
+  *out = NULL;
+
+  char archive[PATH_MAX];
+  const char *name;
+  if (!archive_split(path, archive, sizeof(archive), &name)) return NULL;
+
+  // copy what we need, the index may be evicted once unlocked
+  Archive_Entry entry = {0};
+  int type = ARCHIVE_NONE;
+
+  Archive_Index *idx = index_lock(archive);
+  for (int i = 0; idx && i < idx->count; i++) {
+    if (!strcmp(idx->entries[i].name, name)) {
+      entry = idx->entries[i];
+      type = idx->type;
+      break;
+    }
+  }
+  index_unlock();
+  if (type == ARCHIVE_NONE) return NULL;
+
+  Archive_IO *io = calloc(1, sizeof(Archive_IO));
+  if (!io) return NULL;
+  io->fd = open(archive, O_RDONLY | O_CLOEXEC);
+  io->start = entry.offset;
+  io->size = entry.size;
+  io->csize = entry.csize;
+  io->method = entry.method;
+
+  if (io->fd < 0) {
+    free(io);
+    return NULL;
+  }
+
+  // zip: the data is after the local header, its name and extra can
+  // differ from the central directory ones
+  if (type == ARCHIVE_ZIP) {
+    uint8_t local[30];
+    if (read_at(io->fd, local, sizeof(local), entry.offset) != sizeof(local) || le32(local) != 0x04034b50) {
+      archive_close(io);
+      return NULL;
+    }
+    io->start = entry.offset + sizeof(local) + le16(local + 26) + le16(local + 28);
+  }
+
+  // raw deflate, no zlib header in a zip
+  if (io->method == ZIP_DEFLATE) {
+    io->in = malloc(INFLATE_CHUNK);
+    if (!io->in || inflateInit2(&io->z, -MAX_WBITS) != Z_OK) {
+      free(io->in);
+      io->in = NULL;
+      archive_close(io);
+      return NULL;
+    }
+  }
+
+  uint8_t *buffer = av_malloc(AVIO_BUFFER_SIZE);
+  io->avio = buffer ? avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 0, io, entry_read, NULL, entry_seek) : NULL;
+  if (!io->avio) {
+    av_free(buffer);
+    archive_close(io);
+    return NULL;
+  }
+
+  // a seek in a deflated entry inflates up to it: the demuxer may do it
+  // (probing), playback only rewinds through the history
+  io->avio->seekable = io->method == ZIP_STORED ? AVIO_SEEKABLE_NORMAL : 0;
+
+  *out = io;
+  return io->avio;
+}
+
+void archive_close(Archive_IO *io)
+{
+  if (!io) return;
+
+  if (io->avio) {
+    av_freep(&io->avio->buffer);
+    avio_context_free(&io->avio);
+  }
+  if (io->in) {
+    inflateEnd(&io->z);
+    free(io->in);
+  }
+  if (io->fd >= 0) close(io->fd);
+  free(io);
+}
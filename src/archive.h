@@ -0,0 +1,38 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <libavformat/avio.h>
+#include <stddef.h>
+
+// entries of zip and tar archives read in place, nothing is extracted.
+// an entry is named by a path going through the archive like a folder:
+//   music/bundle.zip/disc1/01.flac
+// stored entries (all of a tar, zip method 0) are read at their offset and
+// seek like a file; deflated zip entries are inflated as they are read,
+// a seek back starts inflating over. compressed tars (.tar.gz) can't be
+// read in place and are not archives here.
+// the index (zip central directory, tar headers) of the last archives is
+// kept in memory, the tracks of a bundle don't parse it again
+
+enum { ARCHIVE_NONE, ARCHIVE_ZIP, ARCHIVE_TAR };
+
+// ARCHIVE_* of a file (by its name, then its magic bytes)
+int archive_type(const char *path);
+
+// the archive part of an entry path: 1 and the archive path in `archive`
+// (entry, if not NULL, points at the name inside it), 0 when the path
+// doesn't go through an archive
+int archive_split(const char *path, char *archive, size_t len, const char **entry);
+
+// the file entries of an archive, in archive order. NULL when it can't
+// be read, the names and the array are the caller's to free
+char **archive_list(const char *path, int *count);
+
+typedef struct Archive_IO Archive_IO;
+
+// an AVIOContext reading the entry of an archive path, NULL when there is
+// no such entry (or its method is not stored/deflate, or it is encrypted)
+AVIOContext *archive_open(const char *path, Archive_IO **io);
+void archive_close(Archive_IO *io);
+
+#endif
@@ -8,13 +8,28 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "backend.h"
 #include "backend_utils.h"
+#include "command.h"
 #include "control.h"
+#include "events.h"
+#include "diskcache.h"
+#include "history.h"
+#include "pcmcache.h"
+#include "rt.h"
+#include "shmcache.h"
 #include "socket.h"
+#include "stats.h"
+#include "status.h"
+#include "storage.h"
 #include "utils.h"
 
 #include "../libs/miniaudio.h"
@@ -24,13 +39,47 @@
 #endif
 
 
+#define AUDIO_BUFFER_TICK -2
+
+// audio_buffer_read flags
+#define AUDIO_BUFFER_UNDERRUN  1
+#define AUDIO_BUFFER_PREROLL   2 // nothing read, the jitter buffer is filling
+#define AUDIO_BUFFER_EMPTY     4 // nothing read, the decoder is behind
+
+// --power-save: refill when a fifth of the buffer is left, the display
+// (and the status page) still moves once per second
+#define BURST_LOW_WATER   5
+#define BURST_TICK_MS     1000
+
+
 // WRITE AUDIO DATA TO BUFFER
-void audio_buffer_write(Audio_Buffer *buf, uint8_t *audio_data, int data_must_write)
+// returns -1 without writing when audio_buffer_interrupt() woke us up,
+// AUDIO_BUFFER_TICK when it waited tick_ms (burst mode)
+int audio_buffer_write(Audio_Buffer *buf, uint8_t *audio_data, int data_must_write)
 {
   pthread_mutex_lock(&buf->lock);
   
-  while (buf->filled + data_must_write > buf->capacity) {
-    pthread_cond_wait(&buf->space_free, &buf->lock);
+  while (buf->filled + data_must_write > buf->capacity || buf->draining) {
+    if (atomic_load(&buf->interrupted)) {
+      pthread_mutex_unlock(&buf->lock);
+      return -1;
+    }
+
+    // burst mode: full, don't come back before it is down to low_water
+    if (buf->low_water) buf->draining = 1;
+
+    buf->writer_waiting = 1;
+    int tick_ms = buf->tick_ms;
+    pthread_mutex_unlock(&buf->lock);
+    int timed_out = audio_buffer_space_wait(buf, tick_ms);
+    pthread_mutex_lock(&buf->lock);
+    buf->writer_waiting = 0;
+
+    if (timed_out) {
+      pthread_mutex_unlock(&buf->lock);
+      return AUDIO_BUFFER_TICK;
+    }
+    stats_add(decoder_wakeups, 1);
   }
   
   int space_until_end = buf->capacity - buf->write_pos;
@@ -47,18 +96,49 @@ void audio_buffer_write(Audio_Buffer *buf, uint8_t *audio_data, int data_must_wr
   buf->write_pos = (buf->write_pos + data_must_write) % buf->capacity;
   
   buf->filled += data_must_write;
+  buf->primed = 1;
+  buf->starved = 0;
   
-  pthread_cond_signal(&buf->data_ready);
   pthread_mutex_unlock(&buf->lock);
+  return 0;
 }
 
 // READ AUDIO DATA FROM BUFFER TO SPEAKER
-void audio_buffer_read(Audio_Buffer *buf, uint8_t *output, int bytes_needed)
+// returns AUDIO_BUFFER_UNDERRUN when the buffer just ran dry, with
+// AUDIO_BUFFER_PREROLL or AUDIO_BUFFER_EMPTY nothing was read (play
+// silence). it never waits for the writer, the lock is held for a copy
+int audio_buffer_read(Audio_Buffer *buf, uint8_t *output, int bytes_needed)
 {
   pthread_mutex_lock(&buf->lock);
+
+  // only count the first starving read after real audio, not the
+  // empty buffer at start or after a seek reset
+  int underrun = 0;
+  if (buf->filled < bytes_needed && buf->primed && !buf->starved) {
+    buf->starved = 1;
+    underrun = AUDIO_BUFFER_UNDERRUN;
+  }
+
+  // network jitter buffer: dry (or reset by a seek), fill it again before
+  // playing on, never block the callback on the network
+  if (buf->preroll && !buf->prerolling && buf->filled < bytes_needed) {
+    buf->prerolling = 1;
+    if (underrun) {
+      buf->rebuffers++;
+      stats_add(net_rebuffers, 1);
+    }
+  }
+  if (buf->prerolling) {
+    if (buf->filled < buf->preroll) {
+      pthread_mutex_unlock(&buf->lock);
+      return underrun | AUDIO_BUFFER_PREROLL;
+    }
+    buf->prerolling = 0;
+  }
   
-  while (buf->filled == 0) {
-    pthread_cond_wait(&buf->data_ready, &buf->lock);
+  if (buf->filled == 0) {
+    pthread_mutex_unlock(&buf->lock);
+    return underrun | AUDIO_BUFFER_EMPTY;
   }
   
   int bytes_to_read = bytes_needed;
@@ -81,8 +161,1074 @@ void audio_buffer_read(Audio_Buffer *buf, uint8_t *output, int bytes_needed)
   
   buf->filled -= bytes_to_read;
   
-  pthread_cond_signal(&buf->space_free);
+  // a draining writer only wants to hear about it at low_water
+  if (!buf->draining || buf->filled <= buf->low_water) {
+    buf->draining = 0;
+    audio_buffer_space_freed(buf);
+  }
   pthread_mutex_unlock(&buf->lock);
+  return underrun;
+}
+
+// key repeat comes every ~30-50ms: a seek within this window of the
+// previous one means the key is held down and we start scrubbing
+#define SCRUB_REPEAT_NS   (250 * 1000000LL)
+// no seek input for this long: the user let go, land precisely
+#define SCRUB_SETTLE_NS   (200 * 1000000LL)
+// one short audible grain per period while scrubbing
+#define SCRUB_GRAIN_MS    60
+#define SCRUB_PERIOD_NS   (150 * 1000000LL)
+// samples handed to the speaker at once when replaying the history
+#define REPLAY_CHUNK      4096
+
+// samples after A kept in memory to cover the seek at an A-B wrap
+#define AB_CHUNK_MS       1000
+
+// caught up with the session writing a shared entry: look again after this
+#define FOLLOW_WAIT_NS    (5 * 1000000LL)
+
+// a demuxer read is a stall when it takes half of the audio that was
+// buffered when it started, or this long when there was hardly any.
+// reads only count once the ring got to 1/STALL_ARM full after a start,
+// seek or reset: the first ones after it fill an empty ring
+#define STALL_MIN_NS      (50 * 1000000LL)
+#define STALL_ARM         4
+
+// conversion scratch made up front, bigger frames grow it
+#define SCRATCH_SAMPLES   8192
+
+// a live stream which ended is opened again this many times, the waits
+// between the tries double from NET_RETRY_NS
+#define NET_RETRIES       5
+#define NET_RETRY_NS      (1000 * 1000000LL)
+
+// back within this many seconds of a chapter start goes to the one before
+#define CHAPTER_RESTART_SEC 3
+
+// decoder_seek flags
+#define SEEK_PRECISE      1
+#define SEEK_KEEP_AUDIO   2
+
+static int64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t to_samples(DecoderContext *dec, double seconds)
+{
+  return (int64_t)(seconds * dec->streamCTX->inf->sample_rate);
+}
+
+static double to_seconds(DecoderContext *dec, int64_t samples)
+{
+  return (double)samples / dec->streamCTX->inf->sample_rate;
+}
+
+// what the converter holds is from before a seek (resampling keeps a few samples)
+static void decoder_reformat_reset(DecoderContext *dec)
+{
+  if (dec->swrCTX && swr_init(dec->swrCTX) < 0)
+    swr_free(&dec->swrCTX);
+}
+
+// the audio in the ring is stale: it goes, and the reads which fill it
+// again are not held to a stall deadline
+static void decoder_audio_reset(DecoderContext *dec)
+{
+  audio_buffer_reset(dec->streamCTX->buf);
+  dec->stall_armed = 0;
+}
+
+// seek the demuxer to position (samples), returns it clamped.
+// SEEK_PRECISE drops everything before the target, SEEK_KEEP_AUDIO
+// lets what is in the buffer play out (seamless loops)
+static int64_t decoder_seek(DecoderContext *dec, int64_t position, int flags)
+{
+  position = handle_audio_seek(dec->streamCTX, dec->duration_sec, position);
+  decoder_reformat_reset(dec);
+  if (dec->seek_index.on) {
+    AVStream *st = dec->streamCTX->inf->audioStream;
+    int64_t ts = av_rescale_q(position, (AVRational){1, dec->streamCTX->inf->sample_rate}, st->time_base);
+    seekindex_seek(&dec->seek_index, st->start_time != AV_NOPTS_VALUE ? ts + st->start_time : ts);
+  }
+  dec->total_samples_played = position;
+  dec->seek_exact = (flags & SEEK_PRECISE) ? position : -1;
+  dec->replay_pos = -1;
+  history_reset(&dec->history);
+
+  if (!(flags & SEEK_KEEP_AUDIO))
+    decoder_audio_reset(dec);
+
+  stats_add(seek_ops, 1);
+  if (!(flags & SEEK_PRECISE)) stats_add(seek_previews, 1);
+  return position;
+}
+
+// seek inside the audio we already played: no I/O, no codec flush,
+// 0 when the target is not in the history
+static int decoder_rewind(DecoderContext *dec, int64_t position)
+{
+  if (!history_has(&dec->history, position)) return 0;
+
+  dec->replay_pos = position;
+  dec->seek_exact = -1;
+  decoder_audio_reset(dec);
+
+  stats_add(rewinds, 1);
+  return 1;
+}
+
+// position the speaker is at: the decoder runs ahead by what is in the buffer
+static int64_t decoder_heard(DecoderContext *dec)
+{
+  Audio_Buffer *buf = dec->streamCTX->buf;
+  Audio_Info *inf = dec->streamCTX->inf;
+
+  pthread_mutex_lock(&buf->lock);
+  int64_t queued = buf->filled / (inf->ch * inf->sample_fmt_bytes);
+  pthread_mutex_unlock(&buf->lock);
+
+  int64_t heard = dec->total_samples_played - (int64_t)(queued * dec->last_speed);
+  return heard > 0 ? heard : 0;
+}
+
+// where an A-B loop wraps now, -1 when it doesn't (no region, not looping, no B)
+static int64_t decoder_ab_end(DecoderContext *dec)
+{
+  if (!dec->streamCTX->state->looping || dec->loop_a < 0) return -1;
+  return dec->loop_b;
+}
+
+// new A-B region, the chunk after A starts from the history when A is behind us
+static void decoder_ab_set(DecoderContext *dec, int64_t a, int64_t b)
+{
+  Audio_Info *inf = dec->streamCTX->inf;
+  int frame_bytes = inf->ch * inf->sample_fmt_bytes;
+
+  free(dec->ab_chunk);
+  dec->ab_chunk = NULL;
+  dec->ab_chunk_len = dec->ab_chunk_filled = 0;
+
+  dec->loop_a = a;
+  dec->loop_b = b;
+  if (a < 0) return;
+
+  // at most half the region: the decoder must still cross B after the chunk
+  int64_t len = (int64_t)inf->sample_rate * AB_CHUNK_MS / 1000;
+  if (b > 0 && len > (b - a) / 2) len = (b - a) / 2;
+  if (len <= 0 || !(dec->ab_chunk = malloc(len * frame_bytes))) return;
+  dec->ab_chunk_len = len;
+
+  const uint8_t *pcm;
+  int64_t n;
+  while (dec->ab_chunk_filled < len &&
+         (n = history_peek(&dec->history, a + dec->ab_chunk_filled, len - dec->ab_chunk_filled, &pcm)) > 0) {
+    memcpy(dec->ab_chunk + dec->ab_chunk_filled * frame_bytes, pcm, n * frame_bytes);
+    dec->ab_chunk_filled += n;
+  }
+}
+
+// decoded audio passing by A fills the rest of the chunk
+static void decoder_ab_capture(DecoderContext *dec, const uint8_t *pcm, int64_t samples, int64_t start)
+{
+  if (!dec->ab_chunk || dec->ab_chunk_filled == dec->ab_chunk_len) return;
+
+  int64_t want = dec->loop_a + dec->ab_chunk_filled;
+  if (want < start || want >= start + samples) return;
+
+  int64_t n = start + samples - want;
+  if (n > dec->ab_chunk_len - dec->ab_chunk_filled) n = dec->ab_chunk_len - dec->ab_chunk_filled;
+
+  int frame_bytes = dec->streamCTX->inf->ch * dec->streamCTX->inf->sample_fmt_bytes;
+  memcpy(dec->ab_chunk + dec->ab_chunk_filled * frame_bytes, pcm + (want - start) * frame_bytes, n * frame_bytes);
+  dec->ab_chunk_filled += n;
+}
+
+// the markers came from the keys/socket, they go where the user is now
+static void decoder_ab_marks(DecoderContext *dec, int marks)
+{
+  int64_t heard = decoder_heard(dec);
+  int64_t a = dec->loop_a, b = dec->loop_b;
+
+  if (marks & MARK_CLEAR) a = b = -1;
+
+  if (marks & MARK_A) {
+    a = heard;
+    if (b >= 0 && b <= a) b = -1;
+  }
+
+  if (marks & MARK_B) {
+    if (a < 0) a = 0;
+    if (heard <= a) return;
+    b = heard;
+  }
+
+  decoder_ab_set(dec, a, b);
+
+  // a whole region loops right away
+  if ((marks & MARK_B) && dec->loop_b > 0)
+    loop_set(dec->streamCTX->state, 1);
+}
+
+// LOOPSTART/LOOPEND (or LOOPLENGTH) in samples, as game music rips have them
+static int64_t ab_tag(DecoderContext *dec, const char *key)
+{
+  StreamContext *streamCTX = dec->streamCTX;
+  AVDictionaryEntry *tag = av_dict_get(streamCTX->inf->audioStream->metadata, key, NULL, 0);
+  if (!tag) tag = av_dict_get(streamCTX->fmtCTX->metadata, key, NULL, 0);
+  if (!tag) return -1;
+
+  char *end;
+  long long value = strtoll(tag->value, &end, 10);
+  return (end == tag->value || value < 0) ? -1 : value;
+}
+
+static void decoder_ab_tags(DecoderContext *dec)
+{
+  int64_t a = ab_tag(dec, "LOOPSTART");
+  if (a < 0) return;
+
+  int64_t b = ab_tag(dec, "LOOPEND");
+  int64_t length = ab_tag(dec, "LOOPLENGTH");
+  if (b < 0 && length > 0) b = a + length;
+  if (b >= 0 && b <= a) b = -1;
+
+  decoder_ab_set(dec, a, b);
+}
+
+// playing from memory: a seek is only a new read position, returns it clamped
+static int64_t decoder_cache_seek(DecoderContext *dec, int64_t position)
+{
+  StreamContext *streamCTX = dec->streamCTX;
+  if (position < 0) position = 0;
+
+  // past what the other session wrote so far: decode from there ourselves
+  if (dec->following && position > dec->loop_cache.samples) {
+    int64_t expected = streamCTX->shared->head->head.samples;
+    if (position > expected) position = expected;
+    dec->resume_pos = position;
+  }
+  else if (position > dec->loop_cache.samples)
+    position = dec->loop_cache.samples;
+
+  dec->cache_pos = position;
+  decoder_audio_reset(dec);
+  return position;
+}
+
+// a CUE sheet: which track is heard at position. going from one into the
+// next is only news (event, status, the playlist entry), the audio goes on
+static void decoder_track(DecoderContext *dec, int64_t position)
+{
+  PlayBackState *state = dec->streamCTX->state;
+  const Cue_Sheet *cue = state->cue;
+  int rate = dec->streamCTX->inf->sample_rate;
+
+  if (position >= dec->track_start && (dec->track_end < 0 || position < dec->track_end))
+    return;
+
+  int track = cue_track_at(cue, position, rate);
+  dec->track_start = cue_track_start(cue, track, rate);
+  dec->track_end = track + 1 < cue->count ? cue_track_start(cue, track + 1, rate) : -1;
+  if (track == state->track) return;
+  state->track = track;
+
+  // next/prev of the folder go on from this entry
+  for (int i = 0; DirFiles.files && i < DirFiles.totalFiles; i++)
+    if (cue_entry(cue, DirFiles.files[i]) == track) {
+      DirFiles.currentFile = i;
+      break;
+    }
+
+  char text[PATH_MAX + 16];
+  snprintf(text, sizeof(text), "%s#%02d", cue->path, cue->tracks[track].number);
+  event_emit(EVENT_TRACK, 0, text);
+  status_publish(state);
+}
+
+// next/prev/"track N" on a CUE sheet: a precise seek to the first sample
+// of the track. shuffle, or past either end, the folder picks the entry:
+// another track of the sheet is still only a seek. 1, the audio in hand is stale
+static int decoder_track_jump(DecoderContext *dec, const Command_Batch *batch)
+{
+  StreamContext *streamCTX = dec->streamCTX;
+  PlayBackState *state = streamCTX->state;
+  const Cue_Sheet *cue = state->cue;
+
+  int track = batch->track_to ? cue_track_find(cue, batch->track_to) : state->track;
+  if (track < 0) return !state->running;
+  track += batch->track;
+
+  if (!batch->track_to && ((DirFiles.shuffle && DirFiles.files) || track < 0 || track >= cue->count)) {
+    int file = playlist_peek(batch->track > 0 ? 1 : -1);
+    int other = file >= 0 ? cue_entry(cue, DirFiles.files[file]) : -1;
+    if (other < 0) {
+      if (file >= 0) DirFiles.currentFile = file;
+      change_Audio(state);
+      return 1;
+    }
+    track = other;
+  }
+
+  int64_t position = cue_track_start(cue, track, streamCTX->inf->sample_rate);
+  dec->scrubbing = 0;
+  if (dec->cache_pos >= 0)
+    decoder_cache_seek(dec, position);
+  else if (!decoder_rewind(dec, position))
+    decoder_seek(dec, position, SEEK_PRECISE);
+
+  stats_add(cue_jumps, 1);
+  return 1;
+}
+
+// the chapter sample is in, -1 before the first one
+static int chapter_at(const PlayBackState *state, int64_t sample)
+{
+  int chapter = -1;
+  while (chapter + 1 < state->chapter_count && state->chapters[chapter + 1].start <= sample)
+    chapter++;
+  return chapter;
+}
+
+// the chapter heard now, for the status line and the clients
+static void decoder_chapter(DecoderContext *dec, int64_t position)
+{
+  PlayBackState *state = dec->streamCTX->state;
+
+  if (position >= dec->chapter_start && (dec->chapter_end < 0 || position < dec->chapter_end))
+    return;
+
+  int chapter = chapter_at(state, position);
+  dec->chapter_start = chapter >= 0 ? state->chapters[chapter].start : 0;
+  dec->chapter_end = chapter + 1 < state->chapter_count ? state->chapters[chapter + 1].start : -1;
+  if (chapter == state->chapter) return;
+
+  state->chapter = chapter;
+  if (chapter >= 0)
+    event_emit(EVENT_CHAPTER, chapter + 1, state->chapters[chapter].title);
+  status_publish(state);
+}
+
+// next/prev chapter from the one heard now (or "chapter N"), made an
+// absolute seek to its start. a few seconds into a chapter, back restarts
+// it (as players do)
+static void decoder_chapter_step(DecoderContext *dec, Command_Batch *batch)
+{
+  PlayBackState *state = dec->streamCTX->state;
+  if (!state->chapters) return;
+
+  int64_t heard = decoder_heard(dec);
+  int chapter = batch->chapter_to ? batch->chapter_to - 1 : chapter_at(state, heard);
+  if (!batch->chapter_to && batch->chapter < 0 && chapter >= 0 &&
+      heard - state->chapters[chapter].start > to_samples(dec, CHAPTER_RESTART_SEC))
+    chapter++;
+
+  chapter += batch->chapter;
+  if (chapter < 0) chapter = 0;
+  if (chapter >= state->chapter_count) return;
+
+  batch->seek = 1;
+  batch->seek_abs = 1;
+  batch->seek_us = av_rescale(state->chapters[chapter].start, 1000000, dec->streamCTX->inf->sample_rate);
+  stats_add(chapter_jumps, 1);
+}
+
+// apply the queued commands, 1 when the audio in hand is stale
+// (we seeked or playback stopped)
+static int decoder_commands(DecoderContext *dec)
+{
+  StreamContext *streamCTX = dec->streamCTX;
+  PlayBackState *state = streamCTX->state;
+  Command_Batch batch;
+
+  commands_drain(state, &batch);
+  if (batch.commands) status_publish(state);
+  if (batch.marks) decoder_ab_marks(dec, batch.marks);
+  if (batch.track || batch.track_to) return decoder_track_jump(dec, &batch);
+  if (batch.chapter || batch.chapter_to) decoder_chapter_step(dec, &batch);
+
+  if (!batch.seek) return !state->running;
+
+  double offset = (double)batch.seek_us / 1000000;
+  // from what the speaker plays, the decoder is ahead by the buffer (seconds
+  // in burst mode). an absolute seek (goto, chapters) is from the start
+  double current = batch.seek_abs ? 0 : to_seconds(dec, decoder_heard(dec));
+
+  // +5s then -5s is no seek at all
+  int none = !batch.seek_abs && batch.seek_us == 0;
+
+  // looping from memory: every seek is only a new read position
+  if (dec->cache_pos >= 0) {
+    if (none) return !state->running;
+
+    int64_t position = decoder_cache_seek(dec, to_samples(dec, current + offset));
+    event_emit(EVENT_SEEK, to_seconds(dec, position), NULL);
+    return 1;
+  }
+
+  // a pipe or a live stream: only back into what we played, no scrubbing
+  if (!dec->seekable) {
+    int64_t target = to_samples(dec, current + offset);
+    if (none || !decoder_rewind(dec, target < 0 ? 0 : target))
+      return !state->running;
+    event_emit(EVENT_SEEK, to_seconds(dec, dec->replay_pos), NULL);
+    return 1;
+  }
+
+  int64_t now = now_ns();
+  int repeat = now - dec->last_seek_input < SCRUB_REPEAT_NS;
+  dec->last_seek_input = now;
+
+  // still scrubbing: only move the target, decoder_scrub() does the rest
+  if (dec->scrubbing) {
+    dec->scrub_target = batch.seek_abs ? offset : dec->scrub_target + offset;
+    if (dec->scrub_target < 0) dec->scrub_target = 0;
+    if (dec->scrub_target > dec->duration_sec) dec->scrub_target = dec->duration_sec;
+    return 1;
+  }
+
+  if (none) return !state->running;
+
+  // a single press seeks right away, a held key starts scrubbing
+  if (!batch.seek_abs && (repeat || batch.seek > 1)) {
+    dec->scrubbing = 1;
+    dec->scrub_target = current + offset;
+    dec->scrub_cursor = current;
+    dec->scrub_start = now;
+    dec->next_grain = now;
+    return 1;
+  }
+
+  int64_t target = to_samples(dec, current + offset);
+  if (target < 0) target = 0;
+
+  if (!decoder_rewind(dec, target))
+    target = decoder_seek(dec, target, SEEK_PRECISE);
+  event_emit(EVENT_SEEK, to_seconds(dec, target), NULL);
+  return 1;
+}
+
+// the storage stalled us for took ns: count it, say it, and keep more
+// audio buffered from now on (this file and the next ones on the device)
+static void decoder_stall(DecoderContext *dec, int64_t took, int64_t buffered)
+{
+  StreamContext *streamCTX = dec->streamCTX;
+  Audio_Info *inf = streamCTX->inf;
+  int64_t ms = took / 1000000;
+
+  stats_add(stalls, 1);
+  stats_add(stall_ms, ms);
+  stats_max(stall_max_ms, ms);
+  event_emit(EVENT_STALL_END, (double)took / 1000000000LL, NULL);
+
+  int prebuffer_ms = storage_stalled(streamCTX->dev, ms);
+  int frame_bytes = inf->ch * inf->sample_fmt_bytes;
+  int capacity = (int64_t)prebuffer_ms * inf->sample_rate / 1000 * frame_bytes;
+
+  warn("\nstall: a read blocked %lldms with %lldms of audio buffered, prebuffer %dms",
+       (long long)ms, (long long)(buffered / 1000000), prebuffer_ms);
+  audio_buffer_grow(streamCTX->buf, capacity);
+}
+
+// av_read_frame against a deadline: half of the buffered audio. the
+// callback watches the deadline while we are blocked in here (files and archives)
+static int decoder_read(DecoderContext *dec, AVPacket *packet)
+{
+  StreamContext *streamCTX = dec->streamCTX;
+  PlayBackState *state = streamCTX->state;
+  Audio_Info *inf = streamCTX->inf;
+
+  // a pipe waits for its writer, the network has the jitter buffer
+  if (streamCTX->source == SOURCE_PIPE || streamCTX->source == SOURCE_NET)
+    return av_read_frame(streamCTX->fmtCTX, packet);
+
+  pthread_mutex_lock(&streamCTX->buf->lock);
+  int64_t filled = streamCTX->buf->filled;
+  int64_t capacity = streamCTX->buf->capacity;
+  pthread_mutex_unlock(&streamCTX->buf->lock);
+
+  // still filling after a start or a seek: no deadline yet
+  if (!dec->stall_armed) {
+    if (filled * STALL_ARM < capacity)
+      return av_read_frame(streamCTX->fmtCTX, packet);
+    dec->stall_armed = 1;
+  }
+
+  int64_t buffered = filled * 1000000000LL / ((int64_t)inf->sample_rate * inf->ch * inf->sample_fmt_bytes);
+  int64_t allowed = buffered / 2 > STALL_MIN_NS ? buffered / 2 : STALL_MIN_NS;
+
+  int64_t start = now_ns();
+  atomic_store_explicit(&state->read_deadline, start + allowed, memory_order_relaxed);
+  int ret = av_read_frame(streamCTX->fmtCTX, packet);
+  atomic_store_explicit(&state->read_deadline, 0, memory_order_relaxed);
+
+  int64_t took = now_ns() - start;
+  if (took >= allowed)
+    decoder_stall(dec, took, buffered);
+  atomic_store_explicit(&state->stalling, 0, memory_order_relaxed);
+  return ret;
+}
+
+// progress line, position for the clients and the status page. in burst
+// mode the decoder is seconds ahead: show what the speaker plays
+static void decoder_progress(DecoderContext *dec)
+{
+  PlayBackState *state = dec->streamCTX->state;
+  int64_t position = Options.burst_sec > 0 || state->cue || state->chapters ?
+                     decoder_heard(dec) : dec->total_samples_played;
+  double current_time = to_seconds(dec, position);
+  int duration = dec->duration_sec;
+
+  if (state->chapters)
+    decoder_chapter(dec, position);
+
+  // a CUE sheet: the times of the track heard now
+  if (state->cue) {
+    decoder_track(dec, position);
+    int64_t end = dec->track_end >= 0 ? dec->track_end : to_samples(dec, dec->duration_sec);
+    current_time = to_seconds(dec, position - dec->track_start);
+    duration = to_seconds(dec, end - dec->track_start);
+  }
+
+  audio_buffer_publish(dec->streamCTX->buf);
+  progress(state, current_time, duration);
+  playback_publish(state, current_time, duration);
+  status_publish(state);
+}
+
+// write to the buffer, keep serving commands while it is full
+static int decoder_write(DecoderContext *dec, uint8_t *data, int bytes)
+{
+  int ret;
+  while ((ret = audio_buffer_write(dec->streamCTX->buf, data, bytes)) < 0) {
+    // burst mode: we sleep between bursts, the display still moves
+    if (ret == AUDIO_BUFFER_TICK)
+      decoder_progress(dec);
+    else if (decoder_commands(dec))
+      return -1;
+  }
+  return 0;
+}
+
+// sleep while paused, commands still get applied (seek while paused)
+static void decoder_pause(DecoderContext *dec)
+{
+  PlayBackState *state = dec->streamCTX->state;
+
+  pthread_mutex_lock(&state->lock);
+  while (state->paused && state->running && !dec->scrubbing) {
+    if (commands_pending(state)) {
+      pthread_mutex_unlock(&state->lock);
+      decoder_commands(dec);
+      pthread_mutex_lock(&state->lock);
+      continue;
+    }
+    pthread_cond_wait(&state->wait_cond, &state->lock);
+  }
+  pthread_mutex_unlock(&state->lock);
+}
+
+// a reused buffer of at least bytes, so frames don't malloc. it only
+// grows, keeping what it holds
+static uint8_t *decoder_scratch(uint8_t **scratch, int *len, int bytes)
+{
+  if (bytes <= *len) return *scratch;
+
+  int size = *len ? *len : 4096;
+  while (size < bytes) size *= 2;
+
+  uint8_t *grown = rt_alloc(size);
+  if (grown && *len) memcpy(grown, *scratch, *len);
+
+  rt_free(*scratch);
+  *scratch = grown;
+  *len = *scratch ? size : 0;
+  return *scratch;
+}
+
+// speed conversion and the write to the buffer of native rate,
+// interleaved PCM. -1 when a command made it stale while we waited for room
+static int decoder_output(DecoderContext *dec, const uint8_t *pcm, int samples)
+{
+  StreamContext *streamCTX = dec->streamCTX;
+  Audio_Info *inf = streamCTX->inf;
+  PlayBackState *state = streamCTX->state;
+
+  // show progress Display
+  decoder_progress(dec);
+  dec->total_samples_played += samples;
+
+  // Handle speed change
+  float speed = atomic_load_explicit(&state->speed, memory_order_relaxed);
+  if (speed != dec->last_speed) {
+    dec->last_speed = speed;
+    
+    // Free old speed resampler if exists
+    if (dec->speed_swrCTX) {
+      swr_free(&dec->speed_swrCTX);
+      dec->speed_swrCTX = NULL;
+    }
+    
+    // Create new speed resampler if speed ≠ 1.0
+    if (speed != 1.0f) {
+      setup_speed_resampler(streamCTX, inf, speed, &dec->speed_swrCTX);
+    }
+  }
+
+  if (!dec->speed_swrCTX)
+    return decoder_write(dec, (uint8_t*)pcm, samples * inf->ch * inf->sample_fmt_bytes);
+
+  // Speed conversion
+  int out_samples = samples / dec->last_speed;
+  int output_bytes = out_samples * inf->ch * inf->sample_fmt_bytes;
+  uint8_t *output_data = decoder_scratch(&dec->speed_scratch, &dec->speed_scratch_len, output_bytes);
+  if (!output_data) return 0;
+
+  uint8_t *data_out[1] = {output_data};
+  const uint8_t *data_in[1] = {pcm};
+  int converted = swr_convert(dec->speed_swrCTX, data_out, out_samples, data_in, samples);
+
+  if (converted > 0 && decoder_write(dec, output_data, converted * inf->ch * inf->sample_fmt_bytes) < 0)
+    return -1;
+  return 0;
+}
+
+// at B (or the end of the file): back to A without a gap. the chunk
+// after A is played while the demuxer goes on right after it,
+// -1 when a command made the rest stale
+static int decoder_ab_wrap(DecoderContext *dec)
+{
+  int64_t a = dec->loop_a;
+  stats_add(ab_wraps, 1);
+
+  // no chunk (A was never decoded), the seek has the rest of the buffer to land
+  if (!dec->ab_chunk || dec->ab_chunk_filled < dec->ab_chunk_len) {
+    decoder_seek(dec, a, SEEK_PRECISE | SEEK_KEEP_AUDIO);
+    return 0;
+  }
+
+  decoder_seek(dec, a + dec->ab_chunk_len, SEEK_PRECISE | SEEK_KEEP_AUDIO);
+  dec->total_samples_played = a;
+  return decoder_output(dec, dec->ab_chunk, dec->ab_chunk_len);
+}
+
+// frames came in another format: what the old converter still holds
+// goes to the start of the scratch (the samples are returned), a new one
+// converts from the frame's format. the device and the ring go on with inf
+static int decoder_reformat(DecoderContext *dec, AVFrame *frame)
+{
+  Audio_Info *inf = dec->streamCTX->inf;
+  int frame_bytes = inf->ch * inf->sample_fmt_bytes;
+  int tail = 0;
+
+  if (dec->swrCTX) {
+    int pending = swr_get_out_samples(dec->swrCTX, 0);
+    uint8_t *out = pending > 0 ? decoder_scratch(&dec->scratch, &dec->scratch_len, pending * frame_bytes) : NULL;
+    if (out) {
+      uint8_t *data[1] = {out};
+      tail = FFMAX(swr_convert(dec->swrCTX, data, pending, NULL, 0), 0);
+    }
+    swr_free(&dec->swrCTX);
+  }
+
+  // the first frame only sets it up
+  if (dec->in.fmt != AV_SAMPLE_FMT_NONE)
+    stats_add(format_changes, 1);
+
+  frame_format_store(&dec->in, frame);
+  dec->in_drop = setup_frame_resampler(&dec->in, inf, &dec->swrCTX) < 0;
+  if (dec->in_drop)
+    warn("\nffmpeg: can't convert %s %d Hz %d ch, skipping it",
+         av_get_sample_fmt_name(dec->in.fmt), dec->in.rate, dec->in.channels);
+  return tail;
+}
+
+// convert one decoded frame to interleaved PCM, keep it for rewinds and
+// play it. -1 when a command made it stale while we waited for room
+static int decoder_frame(DecoderContext *dec, AVFrame *frame)
+{
+  StreamContext *streamCTX = dec->streamCTX;
+  Audio_Info *inf = streamCTX->inf;
+  int frame_bytes = inf->ch * inf->sample_fmt_bytes;
+
+  // precise seek: the demuxer went back to a keyframe, drop what comes before
+  // the target (samples at inf's rate, the frame may come in another one)
+  if (dec->seek_exact >= 0) {
+    int64_t start = frame_start_sample(inf, frame);
+    int64_t length = av_rescale(frame->nb_samples, inf->sample_rate, frame->sample_rate);
+
+    if (start >= 0) {
+      if (start + length <= dec->seek_exact)
+        return 0;
+
+      if (start < dec->seek_exact)
+        frame_trim_front(frame, av_rescale(dec->seek_exact - start, frame->sample_rate, inf->sample_rate),
+                         frame_channels(frame));
+      else
+        dec->total_samples_played = start;
+    }
+    dec->seek_exact = -1;
+  }
+
+  // chained ogg, radio streams, mkv: the format may change from a frame to the next
+  int tail = 0;
+  if (frame_format_changed(&dec->in, frame))
+    tail = decoder_reformat(dec, frame);
+  if (dec->in_drop)
+    return 0;
+
+  uint8_t *output_data = NULL;
+  int samples = frame->nb_samples;
+
+  if (dec->swrCTX) {
+    // sample format, layout and rate conversion, after the old converter's tail
+    int room = swr_get_out_samples(dec->swrCTX, frame->nb_samples);
+    output_data = room >= 0 ? decoder_scratch(&dec->scratch, &dec->scratch_len, (tail + room) * frame_bytes) : NULL;
+
+    if (output_data) {
+      uint8_t *data[1] = {output_data + tail * frame_bytes};
+      samples = swr_convert(dec->swrCTX, data, room,
+                            (const uint8_t**)frame->extended_data, frame->nb_samples);
+    }
+    if (!output_data || samples < 0 || samples + tail == 0)
+      return 0;
+    samples += tail;
+
+  } else if (tail > 0) {
+    // back to the format of inf: the tail, then the frame as it is
+    output_data = decoder_scratch(&dec->scratch, &dec->scratch_len, (tail + samples) * frame_bytes);
+    if (!output_data)
+      return 0;
+    memcpy(output_data + tail * frame_bytes, frame->data[0], samples * frame_bytes);
+    samples += tail;
+
+  } else {
+    // Direct write (no conversion needed)
+    output_data = frame->data[0];
+  }
+
+  // while a rewind replays, the decoder is only finishing the packet it
+  // was in: keep it so the replay runs into it without a gap
+  int64_t start = dec->replay_pos >= 0 ? dec->history.end : dec->total_samples_played;
+
+  // A-B loop: play up to B exactly, then wrap
+  int64_t end = decoder_ab_end(dec);
+  int wrap = dec->replay_pos < 0 && end > 0 && start < end && start + samples >= end;
+  if (wrap) samples = end - start;
+
+  dec->decoded_samples += samples;
+  history_append(&dec->history, output_data, samples, start);
+  pcm_cache_append(&dec->loop_cache, output_data, samples, start);
+  diskcache_writer_append(&dec->cache_writer, output_data, samples, start);
+  shmcache_writer_append(&dec->shm_writer, output_data, samples, start);
+  decoder_ab_capture(dec, output_data, samples, start);
+
+  int stale = 0;
+  if (dec->replay_pos < 0)
+    stale = decoder_output(dec, output_data, samples) < 0;
+
+  // the rest of the packet is after B
+  if (wrap && !stale) {
+    decoder_ab_wrap(dec);
+    stale = 1;
+  }
+  return stale ? -1 : 0;
+}
+
+// decode one audio packet, -1 when the rest of it is stale
+static int decoder_packet(DecoderContext *dec, AVPacket *packet, AVFrame *frame)
+{
+  AVCodecContext *codecCTX = dec->streamCTX->codecCTX;
+
+  // send packet to decoder
+  if ( avcodec_send_packet(codecCTX, packet) < 0 )
+    return 0;
+
+  // Receive decoded frames (after a rewind the rest only goes to the history)
+  int stale = 0;
+  while (avcodec_receive_frame(codecCTX, frame) >= 0) {
+    if (!stale || dec->replay_pos >= 0)
+      stale |= decoder_frame(dec, frame) < 0;
+    av_frame_unref(frame);
+  }
+  return stale ? -1 : 0;
+}
+
+// play from the history up to where the demuxer is, then decoding goes on
+static void decoder_replay(DecoderContext *dec)
+{
+  PlayBackState *state = dec->streamCTX->state;
+
+  while (dec->replay_pos >= 0 && state->running && !dec->scrubbing) {
+    const uint8_t *pcm;
+    int64_t samples = history_peek(&dec->history, dec->replay_pos, REPLAY_CHUNK, &pcm);
+
+    // caught up: the codec continues right after the last stored sample
+    if (samples == 0) {
+      dec->replay_pos = -1;
+      break;
+    }
+
+    // A-B loop: the replay can run into B too
+    int64_t end = decoder_ab_end(dec);
+    int wrap = end > 0 && dec->replay_pos < end && dec->replay_pos + samples >= end;
+    if (wrap) samples = end - dec->replay_pos;
+
+    dec->total_samples_played = dec->replay_pos;
+    dec->replay_pos += samples;
+
+    // a command moved us (another rewind or a real seek)
+    if (decoder_output(dec, pcm, samples) < 0)
+      return;
+
+    if (wrap) {
+      decoder_ab_wrap(dec);
+      return;
+    }
+
+    if (commands_pending(state))
+      decoder_commands(dec);
+
+    if (state->paused)
+      decoder_pause(dec);
+  }
+}
+
+// looping: keep the first pass if the whole file fits the loop cache
+static void decoder_cache_begin(DecoderContext *dec)
+{
+  StreamContext *streamCTX = dec->streamCTX;
+  Audio_Info *inf = streamCTX->inf;
+
+  if (!streamCTX->state->looping) return;
+
+  int64_t expected = 0;
+  if (streamCTX->fmtCTX->duration > 0)
+    expected = av_rescale(streamCTX->fmtCTX->duration, inf->sample_rate, AV_TIME_BASE);
+
+  pcm_cache_begin(&dec->loop_cache, (size_t)Options.loop_cache_mb << 20,
+                  expected, inf->ch * inf->sample_fmt_bytes);
+}
+
+// sleep until deadline (monotonic ns) or until a command comes in
+static void decoder_wait(DecoderContext *dec, int64_t deadline)
+{
+  PlayBackState *state = dec->streamCTX->state;
+  int64_t left = deadline - now_ns();
+  if (left <= 0) return;
+
+  // the condition runs on the realtime clock
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += left / 1000000000LL;
+  ts.tv_nsec += left % 1000000000LL;
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&state->lock);
+  if (state->running && !commands_pending(state))
+    pthread_cond_timedwait(&state->wait_cond, &state->lock, &ts);
+  pthread_mutex_unlock(&state->lock);
+}
+
+// following a shared entry: take what the writer added since the last look.
+// 1 there is something to play, 0 not yet (we waited a little),
+// -1 the writer is gone before the end
+static int decoder_follow(DecoderContext *dec)
+{
+  Shm_Entry *shared = dec->streamCTX->shared;
+  PlayBackState *state = dec->streamCTX->state;
+
+  // complete first: ready may not have the last samples yet when we look
+  int complete = shmcache_complete(shared);
+  dec->loop_cache.samples = shmcache_ready(shared);
+
+  if (complete) {
+    dec->following = 0;
+    dec->duration_sec = dec->loop_cache.samples / dec->streamCTX->inf->sample_rate;
+    return 1;
+  }
+
+  if (dec->cache_pos < dec->loop_cache.samples) return 1;
+
+  if (!shmcache_alive(shared)) {
+    dec->resume_pos = dec->cache_pos;
+    return -1;
+  }
+
+  decoder_wait(dec, now_ns() + FOLLOW_WAIT_NS);
+  if (commands_pending(state))
+    decoder_commands(dec);
+  return 0;
+}
+
+// the whole file is in memory (loop cache, a disk cache hit or a shared
+// entry): play it from there (from sample `from`), no demuxing or decoding.
+// returns when playback stops, at the end when we are not looping, or when
+// a followed writer is gone
+static void decoder_cache_play(DecoderContext *dec, int64_t from)
+{
+  PlayBackState *state = dec->streamCTX->state;
+
+  dec->cache_pos = from;
+
+  while (state->running && dec->resume_pos < 0) {
+    if (dec->following) {
+      int ready = decoder_follow(dec);
+      if (ready < 0) break;
+      if (ready == 0) continue;
+    }
+
+    // an A-B region ends at B, unless we are already past it
+    int64_t end = decoder_ab_end(dec);
+    if (end <= dec->cache_pos || end > dec->loop_cache.samples)
+      end = dec->loop_cache.samples;
+
+    const uint8_t *pcm;
+    int64_t max = end - dec->cache_pos < REPLAY_CHUNK ? end - dec->cache_pos : REPLAY_CHUNK;
+    int64_t samples = pcm_cache_peek(&dec->loop_cache, dec->cache_pos, max, &pcm);
+
+    // the end: wrap to the first sample (or A), the ring never sees a gap
+    if (samples == 0) {
+      if (!state->looping) break;
+      dec->cache_pos = dec->loop_a >= 0 ? dec->loop_a : 0;
+      if (dec->loop_a >= 0) stats_add(ab_wraps, 1);
+      stats_add(loop_cache_passes, 1);
+      continue;
+    }
+
+    dec->total_samples_played = dec->cache_pos;
+    dec->cache_pos += samples;
+
+    // stale: a seek moved cache_pos
+    decoder_output(dec, pcm, samples);
+
+    if (commands_pending(state))
+      decoder_commands(dec);
+
+    if (state->paused)
+      decoder_pause(dec);
+  }
+  dec->cache_pos = -1;
+}
+
+// one preview: keyframe seek a step closer to the target and play a short grain.
+// the step grows the longer the key is held: 4x, 8x, then 16x real time
+static void decoder_grain(DecoderContext *dec, AVPacket *packet, AVFrame *frame, int64_t now)
+{
+  StreamContext *streamCTX = dec->streamCTX;
+  Audio_Info *inf = streamCTX->inf;
+
+  int64_t held = (now - dec->scrub_start) / (500 * 1000000LL);
+  int rate = 4 << (held < 2 ? held : 2);
+  double step = rate * (double)SCRUB_PERIOD_NS / 1000000000LL;
+
+  if (dec->scrub_target > dec->scrub_cursor)
+    dec->scrub_cursor = fmin(dec->scrub_cursor + step, dec->scrub_target);
+  else
+    dec->scrub_cursor = fmax(dec->scrub_cursor - step, dec->scrub_target);
+
+  decoder_seek(dec, to_samples(dec, dec->scrub_cursor), 0);
+
+  int64_t end = dec->total_samples_played + (int64_t)inf->sample_rate * SCRUB_GRAIN_MS / 1000;
+  while (dec->total_samples_played < end && streamCTX->state->running &&
+         av_read_frame(streamCTX->fmtCTX, packet) >= 0) {
+    int stale = 0;
+    if (packet->stream_index == inf->audioStream_index)
+      stale = decoder_packet(dec, packet, frame) < 0;
+    av_packet_unref(packet);
+    if (stale) break;
+  }
+}
+
+// a seek key is held down: previews until the input settles, then one precise seek
+static void decoder_scrub(DecoderContext *dec, AVPacket *packet, AVFrame *frame)
+{
+  PlayBackState *state = dec->streamCTX->state;
+
+  while (dec->scrubbing && state->running) {
+    if (commands_pending(state))
+      decoder_commands(dec);
+
+    int64_t now = now_ns();
+    int64_t settle = dec->last_seek_input + SCRUB_SETTLE_NS;
+
+    if (now >= settle) {
+      int64_t target = to_samples(dec, dec->scrub_target);
+      if (!decoder_rewind(dec, target))
+        target = decoder_seek(dec, target, SEEK_PRECISE);
+      event_emit(EVENT_SEEK, to_seconds(dec, target), NULL);
+      break;
+    }
+
+    int moving = dec->scrub_cursor != dec->scrub_target;
+    if (moving && now >= dec->next_grain) {
+      decoder_grain(dec, packet, frame, now);
+      dec->next_grain = now + SCRUB_PERIOD_NS;
+    }
+
+    decoder_wait(dec, moving && dec->next_grain < settle ? dec->next_grain : settle);
+  }
+  dec->scrubbing = 0;
+}
+
+void get_audio_info(const char *filename, StreamContext *streamCTX);
+static const char *open_audio(const char *filename, StreamContext *streamCTX);
+
+// seconds, 0 when it has no end we know of (pipes, live streams)
+static int stream_duration(AVFormatContext *fmtCTX)
+{
+  return fmtCTX->duration > 0 ? fmtCTX->duration / 1000000 : 0;
+}
+
+// a live stream ended or broke after ffmpeg gave up on it: open it again,
+// it goes on from "now". 0 when we are back, -1 when it stays gone
+static int decoder_reconnect(DecoderContext *dec)
+{
+  StreamContext *streamCTX = dec->streamCTX;
+  PlayBackState *state = streamCTX->state;
+  Audio_Info was = *streamCTX->inf;
+
+  if (streamCTX->fmtCTX->pb)
+    stats_add(io_bytes, streamCTX->fmtCTX->pb->bytes_read);
+  cleanUP(streamCTX->fmtCTX, streamCTX->codecCTX);
+  streamCTX->fmtCTX = NULL;
+  streamCTX->codecCTX = NULL;
+
+  for (int i = 0; i < NET_RETRIES && state->running; i++) {
+    if (i > 0) {
+      decoder_wait(dec, now_ns() + (NET_RETRY_NS << (i - 1)));
+      if (!state->running) break;
+    }
+    warn("\nstream: ended, connecting again (%d/%d)", i + 1, NET_RETRIES);
+
+    const char *err = open_audio(state->filename, streamCTX);
+
+    // the device plays the format we started with, a new one is
+    // converted to it from the first frame (decoder_frame)
+    if (!err) {
+      Audio_Info *inf = streamCTX->inf;
+      AVStream *stream = inf->audioStream;
+      int index = inf->audioStream_index;
+      *inf = was;
+      inf->audioStream = stream;
+      inf->audioStream_index = index;
+
+      stats_add(net_reconnects, 1);
+      return 0;
+    }
+
+    warn("%s", err);
+    cleanUP(streamCTX->fmtCTX, streamCTX->codecCTX);
+    streamCTX->fmtCTX = NULL;
+    streamCTX->codecCTX = NULL;
+    *streamCTX->inf = was; // the callback still goes by it
+  }
+  return -1;
 }
 
 // decoder thread
@@ -93,158 +1239,201 @@ void *run_decoder(void *arg)
   AVCodecContext *codecCTX = streamCTX->codecCTX;
   Audio_Info *inf = streamCTX->inf;
   PlayBackState *state = streamCTX->state;
+  Cache_Hit *cached = streamCTX->cached;
+  Shm_Entry *shared = streamCTX->shared;
+  int frame_bytes = inf->ch * inf->sample_fmt_bytes;
 
-  SwrContext *swrCTX = NULL;        // resampler for sample format changes
-  SwrContext *speed_swrCTX = NULL;  // Separate resampler for playback speed changes
+  DecoderContext decoderCTX = {
+    .streamCTX = streamCTX,
+    .last_speed = state->speed,
+    .total_samples_played = 0,
+    .duration_sec = cached ? cached->head.samples / inf->sample_rate :
+                    shared ? shared->head->head.samples / inf->sample_rate : stream_duration(fmtCTX),
+    .in = { .fmt = AV_SAMPLE_FMT_NONE },   // the first frame sets up the converter
+    .seek_exact = -1,
+    .replay_pos = -1,
+    .cache_pos = -1,
+    .loop_a = -1,
+    .loop_b = -1,
+    .resume_pos = -1,
+    .track_start = 0,
+    .track_end = 0,
+    .chapter_start = 0,
+    .chapter_end = 0,
+  };
+  DecoderContext *dec = &decoderCTX;
+  AVPacket *packet = NULL;
+  AVFrame *frame = NULL;
+  int at_eof; // the demuxer ran out while we were still playing
 
-  // Setup format converter (planar->interleaved if needed)
-  if ( av_sample_fmt_is_planar(codecCTX->sample_fmt) ){
-    setup_sample_fmt_resampler(streamCTX, inf, &swrCTX);
-    
-    if (swrCTX) {
-      if ( swr_init(swrCTX) < 0 )
-        swr_free(&swrCTX);
-    }
+  // a track of a CUE sheet: its INDEX 01 is where we start
+  int64_t start = state->cue ? cue_track_start(state->cue, state->track, inf->sample_rate) : 0;
+
+  // --rt: before anything is allocated, so the scratch below gets locked too
+  rt_promote("decoder");
+  decoder_scratch(&dec->scratch, &dec->scratch_len, SCRATCH_SAMPLES * frame_bytes);
+  decoder_scratch(&dec->speed_scratch, &dec->speed_scratch_len, SCRATCH_SAMPLES * frame_bytes);
+
+  // decoded before: the whole file plays from the mapped disk cache entry
+  if (cached) {
+    pcm_cache_wrap(&dec->loop_cache, cached->pcm, cached->head.samples, frame_bytes);
+    decoder_ab_set(dec, cached->head.loop_a, cached->head.loop_b);
+    decoder_cache_play(dec, start);
+    goto end;
+  }
+
+  // another session decodes (or decoded) it: play its pages, maybe while it writes them
+  if (shared) {
+    pcm_cache_wrap(&dec->loop_cache, shared->pcm, shmcache_ready(shared), frame_bytes);
+    dec->following = !shmcache_complete(shared);
+    if (dec->following) stats_add(shm_follows, 1);
+    decoder_ab_set(dec, shared->head->head.loop_a, shared->head->head.loop_b);
+    decoder_cache_play(dec, start);
+    if (dec->resume_pos < 0) goto end;
+
+    // the writer is gone, or we seeked past it: decode the rest ourselves
+    pcm_cache_free(&dec->loop_cache);
+    get_audio_info(state->filename, streamCTX);
+    fmtCTX = streamCTX->fmtCTX;
+    codecCTX = streamCTX->codecCTX;
+    dec->duration_sec = stream_duration(fmtCTX);
   }
 
-  AVPacket *packet = av_packet_alloc();
-  AVFrame *frame = av_frame_alloc();
+  // only a source with an end we know can be seeked in (Range requests over http)
+  dec->seekable = (!fmtCTX->pb || (fmtCTX->pb->seekable & AVIO_SEEKABLE_NORMAL)) && dec->duration_sec > 0;
+  dec->live = streamCTX->source == SOURCE_NET && !dec->seekable;
+
+  // long files without a good index of their own: the one we kept last time
+  if (streamCTX->source == SOURCE_FILE)
+    seekindex_open(&dec->seek_index, state->filename, fmtCTX, inf->audioStream_index, dec->duration_sec);
+
+  // rewind history, Options.rewind_sec of what we played
+  if (history_init(&dec->history, Options.rewind_sec, inf->sample_rate, frame_bytes) < 0)
+    warn("rewind: no memory for %d seconds of history", Options.rewind_sec);
+
+  // a pass from start to end goes to the disk cache, for the next time,
+  // and to shared memory for the other sessions playing it meanwhile
+  if (!shared) {
+    decoder_ab_tags(dec);
+    decoder_cache_begin(dec);
+  }
+
+  // (files only, a stream has nothing to key the entry on)
+  if (!shared && streamCTX->source == SOURCE_FILE) {
+    int64_t expected = fmtCTX->duration > 0 ? av_rescale(fmtCTX->duration, inf->sample_rate, AV_TIME_BASE) : 0;
+    diskcache_writer_begin(&dec->cache_writer, state->filename, inf->sample_rate, inf->ch,
+                           inf->sample_fmt, frame_bytes, expected, dec->loop_a, dec->loop_b);
+    shmcache_writer_begin(&dec->shm_writer, state->filename, inf->sample_rate, inf->ch,
+                          inf->sample_fmt, frame_bytes, expected, dec->loop_a, dec->loop_b);
+  }
+
+  packet = av_packet_alloc();
+  frame = av_frame_alloc();
 
   if ( !packet || !frame ) {
     printf("ERROR: Failed to allocate packet/frame\n");
-    if (swrCTX) swr_free(&swrCTX);
-    if (speed_swrCTX) swr_free(&speed_swrCTX);
-    return NULL;
+    goto end;
   }
 
-  int64_t total_samples_played = 0;
-  int duration_sec = fmtCTX->duration / 1000000;
-  float last_speed = state->speed;
+  // go on from where the shared audio stopped (or from the CUE track)
+  if (dec->resume_pos >= 0)
+    decoder_seek(dec, dec->resume_pos, SEEK_PRECISE | SEEK_KEEP_AUDIO);
+  else if (start > 0)
+    decoder_seek(dec, start, SEEK_PRECISE);
 
 decode:
-  while (av_read_frame(fmtCTX, packet) >= 0) {
-
-    // only procces audio packets
-    if ( packet->stream_index == inf->audioStream_index ) {
-
-      // send packet to decoder
-      if ( avcodec_send_packet(codecCTX, packet) < 0 ) continue;
-
-      // Receive decoded frame
-      while (avcodec_receive_frame(codecCTX, frame) >= 0) {
-        // show progress Display
-        double current_time = (double)total_samples_played / inf->sample_rate;
-        progress(state, current_time, duration_sec);
-        total_samples_played += frame->nb_samples;
-
-        pthread_mutex_lock(&state->lock);
-        
-          // Handle seek request
-          if (state->seek_request) {
-            handle_audio_seek(streamCTX, &duration_sec, &total_samples_played);
-            av_packet_unref(packet);
-            av_frame_unref(frame);
-            pthread_mutex_unlock(&state->lock);
-            goto decode;
-          }
-        
-        // Handle speed change
-        if (state->speed != last_speed) {
-          last_speed = state->speed;
-          
-          // Free old speed resampler if exists
-          if (speed_swrCTX) {
-            swr_free(&speed_swrCTX);
-            speed_swrCTX = NULL;
-          }
-          
-          // Create new speed resampler if speed ≠ 1.0
-          if (state->speed != 1.0f) {
-            setup_speed_resampler(streamCTX, inf, frame, &speed_swrCTX);
-          }
-        }
-        pthread_mutex_unlock(&state->lock);
-
-        // Process audio based on conversion needs
-        uint8_t *output_data = NULL;
-        int output_bytes = 0;
-        
-        if (speed_swrCTX) {
-          // Speed conversion (with optional format conversion)
-          int out_samples = frame->nb_samples / state->speed;
-          
-          output_bytes = out_samples * inf->ch * inf->sample_fmt_bytes;
-          output_data = malloc(output_bytes);
-          
-          if (output_data) {
-            uint8_t *data_out[1] = {output_data};
-            int samples = swr_convert(speed_swrCTX, data_out, out_samples,
-                                     (const uint8_t**)frame->data, frame->nb_samples);
-            
-            if (samples > 0) {
-              output_bytes = samples * inf->ch * inf->sample_fmt_bytes;
-            } else {
-              free(output_data);
-              output_data = NULL;
-            }
-          }
-          
-        } else if (swrCTX) {
-          // Format conversion only (planar->interleaved)
-          output_bytes = frame->nb_samples * inf->ch * inf->sample_fmt_bytes;
-          output_data = malloc(output_bytes);
-          
-          if (output_data) {
-            uint8_t *data[1] = {output_data};
-            int samples = swr_convert(swrCTX, data, frame->nb_samples,
-                                     (const uint8_t**)frame->data, frame->nb_samples);
-            
-            if (samples > 0) {
-              output_bytes = samples * inf->ch * inf->sample_fmt_bytes;
-            } else {
-              free(output_data);
-              output_data = NULL;
-            }
-          }
-          
-        } else {
-          // Direct write (no conversion needed)
-          output_bytes = frame->nb_samples * inf->ch * inf->sample_fmt_bytes;
-          output_data = frame->data[0];
-        }
-        
-        // Write to buffer
-        if (output_data) {
-          audio_buffer_write(streamCTX->buf, output_data, output_bytes);
-          
-          // Free if we allocated memory (for speed_swrCTX or swrCTX paths)
-          if (output_data != frame->data[0]) {
-            free(output_data);
-          }
-        }
-        
-        av_frame_unref(frame);
-      }
+  at_eof = 0;
+  while (state->running) {
+
+    if (dec->scrubbing) {
+      decoder_scrub(dec, packet, frame);
+      continue;
+    }
+
+    if (dec->replay_pos >= 0) {
+      decoder_replay(dec);
+      continue;
     }
+
+    int ret = decoder_read(dec, packet);
+    if (ret < 0) {
+      at_eof = ret == AVERROR_EOF && state->running;
+      break;
+    }
+
+    if (packet->stream_index == inf->audioStream_index)
+      seekindex_learn(&dec->seek_index, fmtCTX, packet);
+
+    // controls queued something (seek, speed, volume, next/prev, loop, stop)
+    if (commands_pending(state) && decoder_commands(dec)) {
+      av_packet_unref(packet);
+      continue;
+    }
+
+    // only procces audio packets (a stale rest is dropped, the seek is done)
+    if ( packet->stream_index == inf->audioStream_index )
+      decoder_packet(dec, packet, frame);
     av_packet_unref(packet);
 
-    // Check pause state
-    pthread_mutex_lock(&state->lock);
-    while (state->paused)
-      pthread_cond_wait(&state->wait_cond, &state->lock);
-    pthread_mutex_unlock(&state->lock);
+    // Check pause state (the lock is only taken to sleep)
+    if (state->paused)
+      decoder_pause(dec);
+  }
+
+  // the first pass, if it went from start to end without a seek. a skip,
+  // a stop or a read error leaves only a part of it: that is dropped
+  if (at_eof) {
+    diskcache_writer_finish(&dec->cache_writer, dec->total_samples_played);
+    shmcache_writer_finish(&dec->shm_writer, dec->total_samples_played);
+  }
+  else {
+    diskcache_writer_abort(&dec->cache_writer);
+    shmcache_writer_abort(&dec->shm_writer);
+  }
+
+  // the first loop pass is all in the cache: the next ones play from memory
+  if (state->looping && state->running && pcm_cache_finish(&dec->loop_cache, dec->total_samples_played)) {
+    stats_add(loop_cache_passes, 1);
+    decoder_cache_play(dec, 0);
+  }
+
+  // commands that came in at the end (seek back from the last seconds)
+  if (state->running && commands_pending(state) && decoder_commands(dec))
+    goto decode;
+
+  // a live stream broke: open it again
+  if (dec->live && state->running && decoder_reconnect(dec) == 0) {
+    fmtCTX = streamCTX->fmtCTX;
+    codecCTX = streamCTX->codecCTX;
+    goto decode;
+  }
 
-    if (!state->running) break;
+  // Handle looping (an A-B region without B loops from the end to A)
+  if (state->looping && state->running && dec->seekable && dec->loop_a >= 0) {
+    decoder_ab_wrap(dec);
+    goto decode;
   }
 
-  // Handle looping
-  if (state->looping && state->running) {
+  if (state->looping && state->running && dec->seekable) {
     av_seek_frame(fmtCTX, -1, 0, AVSEEK_FLAG_BACKWARD);
     avcodec_flush_buffers(codecCTX);
-    total_samples_played = 0;
+    decoder_reformat_reset(dec);
+    seekindex_seek(&dec->seek_index, 0);
+    dec->total_samples_played = 0;
+    history_reset(&dec->history);
+    decoder_cache_begin(dec);
     goto decode;
   }
 
+  // the stream ended: what the jitter buffer holds plays out first
+  if (state->running && streamCTX->buf->preroll) {
+    while (audio_buffer_drain(streamCTX->buf) > 0 && state->running) {
+      if (decoder_commands(dec)) goto decode;
+      if (state->paused) decoder_pause(dec);
+    }
+  }
+
+end:
   printf("\n");
 
   // Cleanup
@@ -252,9 +1441,23 @@ decode:
   state->running = 0;
   pthread_cond_broadcast(&state->wait_cond);
   pthread_mutex_unlock(&state->lock);
+  status_publish(state);
   
-  if (swrCTX) swr_free(&swrCTX);
-  if (speed_swrCTX) swr_free(&speed_swrCTX);
+  if (streamCTX->fmtCTX)
+    seekindex_close(&dec->seek_index, state->filename, streamCTX->fmtCTX, inf->audioStream_index);
+  if (dec->swrCTX) swr_free(&dec->swrCTX);
+  frame_format_free(&dec->in);
+  if (dec->speed_swrCTX) swr_free(&dec->speed_swrCTX);
+  history_destroy(&dec->history);
+  pcm_cache_free(&dec->loop_cache);
+  free(dec->ab_chunk);
+  diskcache_writer_abort(&dec->cache_writer);
+  shmcache_writer_abort(&dec->shm_writer);
+  shmcache_release(&dec->shm_writer);
+  rt_free(dec->scratch);
+  rt_free(dec->speed_scratch);
+  rt_thread_stats();
+  stats_add(decoded_ms, dec->decoded_samples * 1000 / inf->sample_rate);
   av_frame_free(&frame);
   av_packet_free(&packet);
   return NULL;
@@ -267,42 +1470,89 @@ void ma_dataCallback(ma_device *ma_config, void *output, const void *input, ma_u
   Audio_Info *inf = streamCTX->inf;
   PlayBackState *state = streamCTX->state;
   
-  // Read audio data
   int bytes = frameCount * inf->ch * inf->sample_fmt_bytes;
-  audio_buffer_read(streamCTX->buf, output, bytes);
+  // this is the real-time path: only atomics here, never the state lock.
+  // the buffer lock is only shared with the decoder (control threads and
+  // the socket go by atomics), and is held for a copy, never a wait
 
-  // check if paused
-  pthread_mutex_lock(&state->lock);
+  // paused: play silence and leave the buffer as it is
+  if (atomic_load_explicit(&state->paused, memory_order_relaxed)) {
+    ma_silence_pcm_frames(output, frameCount, inf->ma_fmt, inf->ch);
+    return;
+  }
 
-    while (state->paused)
-      pthread_cond_wait(&state->wait_cond, &state->lock);
+  // Read audio data
+  int ret = audio_buffer_read(streamCTX->buf, output, bytes);
+  if (ret & AUDIO_BUFFER_UNDERRUN)
+    event_emit_rt(EVENT_UNDERRUN, atomic_load_explicit(&state->position, memory_order_relaxed));
 
-  // Apply volume
-  if (state->volume != 1.00f)
-    ma_apply_volume_factor_pcm_frames(output, frameCount, inf->ma_fmt, inf->ch, state->volume);
+  // the jitter buffer is pre-rolling, or the decoder hasn't caught up
+  if (ret & (AUDIO_BUFFER_PREROLL | AUDIO_BUFFER_EMPTY)) {
+    ma_silence_pcm_frames(output, frameCount, inf->ma_fmt, inf->ch);
+    return;
+  }
 
-  pthread_mutex_unlock(&state->lock);
+  // the decoder is stuck in a read past its deadline: tell before we run dry
+  int64_t deadline = atomic_load_explicit(&state->read_deadline, memory_order_relaxed);
+  if (deadline && now_ns() > deadline && !atomic_exchange_explicit(&state->stalling, 1, memory_order_relaxed))
+    event_emit_rt(EVENT_STALL, atomic_load_explicit(&state->position, memory_order_relaxed));
+
+  // Apply volume
+  float volume = atomic_load_explicit(&state->volume, memory_order_relaxed);
+  if (volume != 1.00f)
+    ma_apply_volume_factor_pcm_frames(output, frameCount, inf->ma_fmt, inf->ch, volume);
 }
 
 void store_information(StreamContext *streamCTX, int audioStream_index, enum AVSampleFormat output_sample_fmt );
 
-// reads the file and creates a Stream Context
-void get_audio_info(const char *filename, StreamContext *streamCTX)
+// ffmpeg polls it while it waits for input
+static int open_interrupted(void *opaque)
+{
+  PlayBackState *state = opaque;
+  return !atomic_load_explicit(&state->running, memory_order_relaxed);
+}
+
+// opens the source and its decoder into streamCTX: NULL, or what failed
+// (the caller cleans up what is there)
+static const char *open_audio(const char *filename, StreamContext *streamCTX)
 {
-  // Read File
-  if ( avformat_open_input(&streamCTX->fmtCTX, filename, NULL, NULL) < 0 )
-    die("ffmpeg: file type is not supported");
+  // --preload: the demuxer reads the file from memory, an archive entry is read in place
+  AVIOContext *pb = NULL;
+  if (streamCTX->source == SOURCE_FILE)
+    pb = fileio_open(filename, &streamCTX->io);
+  else if (streamCTX->source == SOURCE_ARCHIVE && !(pb = archive_open(filename, &streamCTX->archive)))
+    return "archive: can't read this entry";
+
+  streamCTX->fmtCTX = avformat_alloc_context();
+  if (!streamCTX->fmtCTX) return "ffmpeg: failed allocate format context!";
+  if (pb) {
+    streamCTX->fmtCTX->pb = pb;
+    streamCTX->fmtCTX->flags |= AVFMT_FLAG_CUSTOM_IO;
+  }
+
+  // a stop gets through a network read that waits for the server
+  streamCTX->fmtCTX->interrupt_callback = (AVIOInterruptCB){ open_interrupted, streamCTX->state };
+
+  // Read File (network sources get their reconnect options)
+  AVDictionary *opts = source_options(streamCTX->source);
+  int ret = avformat_open_input(&streamCTX->fmtCTX, source_url(filename), NULL, &opts);
+  av_dict_free(&opts);
+
+  if ( ret < 0 )
+    return streamCTX->source == SOURCE_NET ? "ffmpeg: can't connect" : "ffmpeg: file type is not supported";
 
   // Read stream information from the file (codec, format, duration, etc.)
   if ( avformat_find_stream_info(streamCTX->fmtCTX, NULL) < 0 )
-    die("ffmpeg: cannot find any streams");
+    return "ffmpeg: cannot find any streams";
 
   // try get audio stream index from container
   int audioStream_index = -1;
   audioStream_index = get_stream(streamCTX->fmtCTX, AVMEDIA_TYPE_AUDIO);
 
   if ( audioStream_index == -1 )
-    die("file: can't find AudioStream");
+    return "file: can't find AudioStream";
+
+  discard_other_streams(streamCTX->fmtCTX, audioStream_index);
 
   // get the information about audio stream
   const AVCodecParameters *codecPAR = streamCTX->fmtCTX->streams[audioStream_index]->codecpar;
@@ -312,14 +1562,14 @@ void get_audio_info(const char *filename, StreamContext *streamCTX)
   streamCTX->codecCTX = avcodec_alloc_context3(codecID);
 
   if ( !streamCTX->codecCTX )
-    die("ffmpeg: failed allocate codec!");
+    return "ffmpeg: failed allocate codec!";
 
   // Copy information codec to decoder
   avcodec_parameters_to_context(streamCTX->codecCTX, codecPAR);
 
   // initialize decoder with actual codec
   if (avcodec_open2(streamCTX->codecCTX, codecID, NULL) < 0)
-    die("ffmpeg: failed init decoder!");
+    return "ffmpeg: failed init decoder!";
 
   // Speakers need INTERLEAVED format! We must convert PLANAR to INTERLEAVED. (see diagram doc for understand)
   enum AVSampleFormat input_sample_fmt = streamCTX->codecCTX->sample_fmt;
@@ -332,6 +1582,14 @@ void get_audio_info(const char *filename, StreamContext *streamCTX)
 
   // Store audio info
   store_information(streamCTX, audioStream_index, output_sample_fmt);
+  return NULL;
+}
+
+// reads the file and creates a Stream Context
+void get_audio_info(const char *filename, StreamContext *streamCTX)
+{
+  const char *err = open_audio(filename, streamCTX);
+  if (err) die("%s", err);
 }
 
 
@@ -348,44 +1606,141 @@ int playback_run(const char *filename, uint loop)
   streamCTX.state = &state;
   streamCTX.fmtCTX = NULL;
   streamCTX.codecCTX = NULL;
+  state.running = 1; // the opens below are interrupted when it goes down
 
   av_log_set_level(AV_LOG_QUIET); // ignore warning
 
-  // 2. get file information
-  get_audio_info(filename, &streamCTX);
+  // a track of a CUE sheet: the sheet's file is what we open (once, for
+  // all its tracks), the decoder starts at the track
+  const char *audio = filename;
+  Cue_Sheet *cue = NULL;
+  char sheet[PATH_MAX];
+  int number;
+  if (cue_split(filename, sheet, sizeof(sheet), &number)) {
+    if (!(cue = malloc(sizeof(Cue_Sheet))) || cue_load(sheet, cue) < 0 ||
+        (state.track = cue_track_find(cue, number)) < 0)
+      die("%s: no such track in the sheet", filename);
+    state.cue = cue;
+    audio = cue->file;
+  }
 
+  // stdin, a FIFO, a URL or in an archive? (what we can't tell ffmpeg tells)
+  streamCTX.source = source_kind(audio);
+  if (streamCTX.source < 0) streamCTX.source = SOURCE_FILE;
+  int file = streamCTX.source == SOURCE_FILE;
 
-  // 3. initialize a buffer, size = 500ms
-  int capacity = (inf.sample_rate) * (inf.ch) * (inf.sample_fmt_bytes) * 0.5;
+  // 2. get file information (another session has it decoded in shared
+  // memory? played before? then the disk cache has it decoded)
+  Shm_Entry shared;
+  Cache_Hit hit;
+  if (file && shmcache_lookup(audio, &shared)) {
+    streamCTX.shared = &shared;
+    store_cached_information(&inf, &shared.head->head);
+  }
+  else if (file && diskcache_lookup(audio, &hit)) {
+    streamCTX.cached = &hit;
+    store_cached_information(&inf, &hit.head);
+  }
+  else
+    get_audio_info(audio, &streamCTX);
+
+  // chapters of the container (a cache hit has no demuxer to ask)
+  Chapter *chapters = NULL;
+  if (streamCTX.fmtCTX)
+    chapters = chapters_read(streamCTX.fmtCTX, inf.sample_rate, &state.chapter_count);
+  state.chapters = chapters;
+  state.chapter = -1;
+
+  // an entry of the folder's library: its tags go to the status page, and
+  // the index learns the file when it didn't know it (or it changed)
+  Library *lib = DirFiles.library;
+  size_t root = lib ? strlen(lib->root) : 0;
+  if (lib && !strncmp(filename, lib->root, root) && filename[root] == '/')
+    state.info = library_find(lib, filename + root + 1);
+  if (state.info && streamCTX.fmtCTX)
+    library_learn(lib, state.info, streamCTX.fmtCTX, inf.audioStream_index);
+
+
+  // 3. initialize a buffer, size = 500ms (--power-save: seconds, refilled in bursts),
+  // more when the storage of the file stalled us before. a network source
+  // pre-rolls --net-buffer seconds and has room for as much again
+  struct stat st;
+  char archive[PATH_MAX];
+  const char *on_disk = streamCTX.source == SOURCE_ARCHIVE &&
+                        archive_split(audio, archive, sizeof(archive), NULL) ? archive : audio;
+  streamCTX.dev = (file || on_disk != audio) && stat(on_disk, &st) == 0 ? st.st_dev : 0;
+
+  double buffer_sec = Options.burst_sec > 0 ? Options.burst_sec : 0.5;
+  if (storage_prebuffer_ms(streamCTX.dev) / 1000.0 > buffer_sec)
+    buffer_sec = storage_prebuffer_ms(streamCTX.dev) / 1000.0;
+
+  int net_buffer_sec = streamCTX.source == SOURCE_NET ? Options.net_buffer_sec : 0;
+  if (2 * net_buffer_sec > buffer_sec)
+    buffer_sec = 2 * net_buffer_sec;
+
+  int byte_rate = (inf.sample_rate) * (inf.ch) * (inf.sample_fmt_bytes);
+  int capacity = byte_rate * buffer_sec;
   streamCTX.buf = audio_buffer_init(capacity); // initialize buffer
+  streamCTX.buf->byte_rate = byte_rate;
+  if (Options.burst_sec > 0)
+    audio_buffer_burst(streamCTX.buf, capacity / BURST_LOW_WATER, BURST_TICK_MS);
+  if (net_buffer_sec > 0)
+    audio_buffer_preroll(streamCTX.buf, byte_rate * net_buffer_sec);
+  state.buf = streamCTX.buf;
 
   // 4. init miniaudio device (for sending PCM samples to speaker)
   ma_device device;
   ma_device_config ma_config = init_miniaudioConfig(&inf, &streamCTX);
 
+  // --rt: the device thread of miniaudio asks for real-time priority too
+  ma_context context;
+  ma_context *contextp = NULL;
+  if (Options.rt) {
+    ma_context_config context_config = ma_context_config_init();
+    context_config.threadPriority = ma_thread_priority_realtime;
+    if (ma_context_init(NULL, 0, &context_config, &context) == MA_SUCCESS)
+      contextp = &context;
+  }
+
   // 4.1 initialize the device output
-  if (ma_device_init(NULL, &ma_config, &device) != MA_SUCCESS ){
+  if (ma_device_init(contextp, &ma_config, &device) != MA_SUCCESS ){
     audio_buffer_destroy(streamCTX.buf);
     pthread_mutex_destroy(&state.lock);
     pthread_cond_destroy(&state.wait_cond);
     cleanUP(streamCTX.fmtCTX, streamCTX.codecCTX);
+    if (streamCTX.cached) diskcache_release(streamCTX.cached);
+    if (streamCTX.shared) shmcache_release(streamCTX.shared);
     die("miniaudio: something happend when initialize device output");
   }
 
   // 5. Display Outputs
   // progress output inside decoder must be there
   init_playbackstatus(&state, loop);
-  if (streamCTX.fmtCTX->metadata)
+  state.filename = audio;
+  if (streamCTX.fmtCTX && streamCTX.fmtCTX->metadata)
     print_metadata(streamCTX.fmtCTX->metadata);
+  else if (library_tags(state.info)) {
+    // a cache hit opens nothing, the index has the tags
+    const Library_Tags *tags = library_tags(state.info);
+    printf("File tags:\n");
+    if (tags->title) printf("  title : %s\n", tags->title);
+    if (tags->artist) printf("  artist : %s\n", tags->artist);
+    if (tags->album) printf("  album : %s\n", tags->album);
+  }
 
-  printf("Playing: %s\n",  filename);
+  event_emit(EVENT_TRACK, 0, filename);
+  status_publish(&state);
+
+  printf("Playing: %s%s\n",  filename, streamCTX.cached ? " (cached)" : streamCTX.shared ? " (shared)" : "");
+  if (cue)
+    printf("%s%s%s, %d tracks\n", cue->performer, cue->performer[0] ? " - " : "", cue->title, cue->count);
   printf("%.2dHz, %dch, %s\n", inf.sample_rate, inf.ch, av_get_sample_fmt_name(inf.sample_fmt));
 
   // 6 start threads
-  pthread_t control_thread, sock_thread, decoder_thread;
+  pthread_t control_thread, decoder_thread;
 
   pthread_create(&control_thread, NULL, handle_input, &state); // terminal controls
-  pthread_create(&sock_thread, NULL, run_socket, &state); // socket controls
+  socket_attach(&state); // socket controls (the socket thread is per session)
   pthread_create(&decoder_thread, NULL, run_decoder, &streamCTX); // decoder ._. 
   
   // Start audio playback device
@@ -394,14 +1749,28 @@ int playback_run(const char *filename, uint loop)
   // wait for all threads to finish.. (if only we could allow the main thread to have coffee during this..)
   pthread_join(decoder_thread, NULL);
   pthread_join(control_thread, NULL);
-  pthread_join(sock_thread, NULL);
+  socket_detach();
 
   // 7. clean up
   ma_device_stop(&device);
   ma_device_uninit(&device);
+  if (contextp) ma_context_uninit(contextp);
   audio_buffer_destroy(streamCTX.buf);
   pthread_mutex_destroy(&state.lock);
   pthread_cond_destroy(&state.wait_cond);
+  commands_destroy(&state);
+
+  // what the file cost in I/O (a cache hit opens nothing, File_IO counts its own)
+  if (!streamCTX.io && !streamCTX.archive && streamCTX.fmtCTX && streamCTX.fmtCTX->pb) {
+    stats_add(io_bytes, streamCTX.fmtCTX->pb->bytes_read);
+    stats_add(io_seeks, streamCTX.fmtCTX->pb->seek_count);
+  }
   cleanUP(streamCTX.fmtCTX, streamCTX.codecCTX);
+  fileio_close(streamCTX.io);
+  archive_close(streamCTX.archive);
+  if (streamCTX.cached) diskcache_release(streamCTX.cached);
+  if (streamCTX.shared) shmcache_release(streamCTX.shared);
+  free(cue);
+  free(chapters);
   return 0;
 }
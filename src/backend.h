@@ -5,41 +5,114 @@
 #include <libavcodec/avcodec.h>
 #include <libavutil/avutil.h>
 #include <libswresample/swresample.h>
+#include <semaphore.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include "../libs/miniaudio.h"
+#include "archive.h"
+#include "cue.h"
+#include "diskcache.h"
+#include "fileio.h"
+#include "history.h"
+#include "library.h"
+#include "pcmcache.h"
+#include "seekindex.h"
+#include "shmcache.h"
+#include "source.h"
+#include "mpsc.h"
 
 #if LIBSWRESAMPLE_VERSION_MAJOR <= 3
   #define LEGACY_LIBSWRSAMPLE
 #endif
 
+// position and duration change together, they are published as one
+// snapshot (seqlock) so readers never see a half written pair
+typedef struct {
+  double position;      // seconds
+  int duration;
+
+} PlayBack_Snapshot;
+
+// a chapter of the file (audiobooks, mixes), from the container
+typedef struct {
+  int64_t start;        // samples
+  char title[128];
+
+} Chapter;
+
 // struct handle Playback
+// hot scalars are atomics: the audio callback, the decoder, the controls
+// and the socket read them without taking the lock. The lock is only for
+// sleeping on wait_cond (pause).
 typedef struct {
-  int running;
-  int paused;
-  float volume;
-  float speed;
-  uint looping;
-  uint shuffle;
-  int seek_request; // Flag: 1 = seek needed
-  //
-  int64_t seek_target; // Where seek to (in microseconds)
+  atomic_int running;
+  atomic_int paused;
+  _Atomic float volume;
+  _Atomic float speed;
+  atomic_uint looping;
+  atomic_uint shuffle;
+  const char *filename; // what is playing (for socket clients)
+  const Cue_Sheet *cue; // playing the tracks of a CUE sheet (NULL: not)
+  atomic_int track;     // of the sheet, the one heard now (index in cue->tracks)
+  Library_Track *info;  // the folder's library index has it (NULL: not), tags for the status page
+  const Chapter *chapters; // NULL: the file has none
+  int chapter_count;
+  atomic_int chapter;   // the one heard now, -1 before the first
+
+  Mpsc_Queue commands;  // controls -> decoder (see command.h)
+  struct Audio_Buffer *buf; // to wake the decoder when it waits for room
+
+  // a demuxer read still blocked at read_deadline (monotonic ns, 0 no
+  // read) is a stall: the callback reports it before the buffer runs dry
+  atomic_llong read_deadline;
+  atomic_int stalling;
+
+  atomic_uint snapshot_seq; // seqlock, the decoder is the only writer
+  PlayBack_Snapshot snapshot;
+  _Atomic double position; // snapshot.position for the audio callback, no seqlock retry there
+
   pthread_mutex_t lock;
   pthread_cond_t wait_cond;
 
 } PlayBackState;
 
-typedef struct {
+typedef struct Audio_Buffer {
   uint8_t *pcm_data;           // Audio data storage
   int capacity;                // Total size in bytes
   int write_pos;               // Where to write next
   int read_pos;                // Where to read next  
   int filled;                  // How many bytes are stored now
+  int primed;                  // Got audio since init/reset
+  int starved;                 // Ran dry, underrun already reported
+  atomic_int interrupted;      // Writer woken up for a command (set without the lock)
+  int writer_waiting;          // the writer sleeps on space_free
+  int low_water;               // burst mode: once full, refill at this level (0 = as room frees)
+  int draining;                // the writer waits for low_water
+  int tick_ms;                 // burst mode: the waiting writer returns this often (0 never)
+  int preroll;                 // network jitter buffer: bytes that must be in before playing (0 off)
+  int prerolling;              // the reader plays silence until preroll is reached
+  int rebuffers;               // times it ran dry and pre-rolled again
+  int byte_rate;               // bytes per second of audio (health report)
+
+  // the health the decoder saw last, for threads which must not take the
+  // lock the callback takes (socket "buffer")
+  atomic_int seen_buffered_ms, seen_capacity_ms, seen_preroll_ms;
+  atomic_int seen_prerolling, seen_rebuffers;
   pthread_mutex_t lock;        // Protect from multiple threads
-  pthread_cond_t data_ready;   // Signal when data available
-  pthread_cond_t space_free;   // Signal when space available
+  sem_t space_free;            // posted when space is available, or for a command
 
 } Audio_Buffer;
 
+// what is in the buffer now, in ms of audio (socket "buffer", progress line)
+typedef struct {
+  int buffered_ms;
+  int capacity_ms;
+  int preroll_ms;
+  int prerolling;
+  int rebuffers;
+
+} Buffer_Health;
+
 // struct for base information of audio file (codec)
 typedef struct {
   int audioStream_index;
@@ -57,6 +130,21 @@ typedef struct {
 
 } Audio_Info;
 
+// what decoded frames come in. a stream may change it on the way (chained
+// ogg, a radio switching programmes, mkv segments), Audio_Info stays what
+// the device and the ring were made for
+typedef struct {
+  enum AVSampleFormat fmt;       // AV_SAMPLE_FMT_NONE: no frame yet
+  int rate;
+  int channels;
+  #ifdef LEGACY_LIBSWRSAMPLE
+    uint64_t layout;
+  #else
+    AVChannelLayout layout;
+  #endif
+
+} Frame_Format;
+
 
 // struct for point context used in another functions (needed)
 typedef struct {
@@ -65,18 +153,89 @@ typedef struct {
   AVFormatContext *fmtCTX;
   AVCodecContext *codecCTX;
   PlayBackState *state;
+  Cache_Hit *cached;             // decoded before: no fmtCTX/codecCTX, PCM from the disk cache
+  Shm_Entry *shared;             // decoded (or decoding) in another session: PCM from shared memory
+  File_IO *io;                   // we read the file for the demuxer (--preload), NULL: ffmpeg does
+  Archive_IO *archive;           // an entry of a zip/tar, we read it for the demuxer
+  dev_t dev;                     // the storage it is on (stall history)
+  int source;                    // SOURCE_* (source.h)
 
 } StreamContext;
 
+// decoder thread working set (run_decoder)
+typedef struct {
+  StreamContext *streamCTX;
+  SwrContext *swrCTX;            // frames (in) to the format of inf, NULL when they are it
+  Frame_Format in;
+  int in_drop;                   // no converter for in: its frames are dropped
+  SwrContext *speed_swrCTX;      // Separate resampler for playback speed changes
+  float last_speed;
+  int64_t total_samples_played;
+  int64_t decoded_samples;       // what the codec made (stats)
+  int duration_sec;
+  int64_t seek_exact;            // precise seek: drop the samples before this one (-1 none)
+  Pcm_History history;           // what we played, for rewinds
+  int64_t replay_pos;            // replaying the history from here (-1 decoding)
+  Pcm_Cache loop_cache;          // the whole file, when looping and it fits
+  int64_t cache_pos;             // looping from the cache from here (-1 decoding)
+
+  // A-B loop in samples (-1 unset, no B: the end of the file). the chunk
+  // holds the first samples after A, it plays while the demuxer seeks
+  int64_t loop_a, loop_b;
+  uint8_t *ab_chunk;
+  int64_t ab_chunk_len, ab_chunk_filled;
+
+  Cache_Writer cache_writer;     // this pass, for the disk cache
+  Shm_Entry shm_writer;          // this pass, for the other sessions
+
+  // reused output of the format and speed conversions (locked with --rt)
+  uint8_t *scratch, *speed_scratch;
+  int scratch_len, speed_scratch_len;
+
+  // playing a shared entry the other session is still writing. when it
+  // goes away (or we seek past it) we open the file and decode from resume_pos
+  int following;
+  int64_t resume_pos;
+
+  // pipes and live streams only go forward: rewinds from the history, no
+  // seeks, no loops. a live stream which ends is opened again (live)
+  int seekable;
+  int live;
+
+  // the ring held STALL_ARM of its audio since the start or the last
+  // reset: from then on a slow read is a stall, before it the ring fills
+  int stall_armed;
+
+  // a CUE sheet: the track heard now is [track_start, track_end) in
+  // samples (track_end -1: the end of the file)
+  int64_t track_start, track_end;
+
+  // the same for the chapter heard now, and the seek index of long files
+  int64_t chapter_start, chapter_end;
+  Seek_Index seek_index;
+
+  // scrubbing: a seek key is held down, seeks add up into scrub_target
+  // while short previews play around scrub_cursor (times in monotonic ns)
+  int scrubbing;
+  double scrub_target;
+  double scrub_cursor;
+  int64_t scrub_start;
+  int64_t last_seek_input;
+  int64_t next_grain;
+
+} DecoderContext;
+
 // struct for data of the files in dir
+// files/totalFiles are set before playing, the rest changes from controls
 typedef struct {
   int totalFiles;
-  int currentFile;
-  uint shuffle;
+  atomic_int currentFile;
+  atomic_uint shuffle;
   // this for cleaning (needed)
-  bool DirLoopStop;
+  atomic_bool DirLoopStop;
   char** files;
   char* path;
+  Library *library;     // index of the folder (NULL: an archive or a sheet played)
 } dirFiles;
 extern dirFiles DirFiles;
 
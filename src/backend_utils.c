@@ -1,12 +1,21 @@
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <errno.h>
 #include <stdio.h>
-#include <dirent.h>
+#include <limits.h>
 #include <string.h>
 #include "../libs/miniaudio.h"
 
+#include "archive.h"
 #include "backend.h"
 #include "backend_utils.h"
+#include "command.h"
+#include "cue.h"
+#include "events.h"
+#include "library.h"
+#include "rt.h"
+#include "seqlock.h"
+#include "utils.h"
 
 // function take from planar_value to get interleaved_value
 enum AVSampleFormat get_interleaved(enum AVSampleFormat value)
@@ -47,6 +56,21 @@ int get_stream(AVFormatContext *fmtCTX, int type)
   return -1;
 }
 
+// we only play one audio stream: the demuxer drops the packets of the others
+// (video of a movie, other languages, subtitles) and for most formats doesn't
+// even read them. cover art was loaded with the header, give its memory back
+void discard_other_streams(AVFormatContext *fmtCTX, int keep)
+{
+  for (int i = 0; i < fmtCTX->nb_streams; i++) {
+    AVStream *stream = fmtCTX->streams[i];
+    if (i == keep) continue;
+
+    stream->discard = AVDISCARD_ALL;
+    if (stream->disposition & AV_DISPOSITION_ATTACHED_PIC)
+      av_packet_unref(&stream->attached_pic);
+  }
+}
+
 // store information Audio file to Audio_Info structure
 void store_information(StreamContext *streamCTX, int audioStream_index, enum AVSampleFormat output_sample_fmt )
 {
@@ -68,37 +92,125 @@ void store_information(StreamContext *streamCTX, int audioStream_index, enum AVS
   inf->ma_fmt = get_ma_format(output_sample_fmt);
 }
 
+// a disk cache hit: no stream and no codec, the header says it all
+void store_cached_information(Audio_Info *inf, const Disk_Cache_Header *head)
+{
+  inf->ch = head->channels;
+  #ifdef LEGACY_LIBSWRSAMPLE
+    inf->ch_layout = av_get_default_channel_layout(head->channels);
+  #else
+    av_channel_layout_default(&inf->ch_layout, head->channels);
+  #endif
+
+  inf->audioStream_index = -1;
+  inf->audioStream = NULL;
+  inf->sample_rate = head->sample_rate;
+  inf->sample_fmt = head->sample_fmt;
+  inf->sample_fmt_bytes = av_get_bytes_per_sample(inf->sample_fmt);
+  inf->ma_fmt = get_ma_format(inf->sample_fmt);
+}
+
+int frame_channels(const AVFrame *frame)
+{
+  #ifdef LEGACY_LIBSWRSAMPLE
+    return frame->channels;
+  #else
+    return frame->ch_layout.nb_channels;
+  #endif
+}
+
+#ifdef LEGACY_LIBSWRSAMPLE
+// decoders may leave the layout unset, swr wants one
+static uint64_t frame_layout(const AVFrame *frame)
+{
+  return frame->channel_layout ? frame->channel_layout : (uint64_t)av_get_default_channel_layout(frame->channels);
+}
+#endif
+
+// 1 when a frame is not in the format f
+int frame_format_changed(const Frame_Format *f, const AVFrame *frame)
+{
+  if (frame->format != f->fmt || frame->sample_rate != f->rate || frame_channels(frame) != f->channels)
+    return 1;
 
-// Setup SWR context convert
-int setup_sample_fmt_resampler(StreamContext *streamCTX, Audio_Info *inf, SwrContext **swrCTX)
+  #ifdef LEGACY_LIBSWRSAMPLE
+    return frame_layout(frame) != f->layout;
+  #else
+    return av_channel_layout_compare(&frame->ch_layout, &f->layout) != 0;
+  #endif
+}
+
+void frame_format_store(Frame_Format *f, const AVFrame *frame)
 {
+  f->fmt = frame->format;
+  f->rate = frame->sample_rate;
+  f->channels = frame_channels(frame);
+  #ifdef LEGACY_LIBSWRSAMPLE
+    f->layout = frame_layout(frame);
+  #else
+    av_channel_layout_uninit(&f->layout);
+    av_channel_layout_copy(&f->layout, &frame->ch_layout);
+  #endif
+}
+
+void frame_format_free(Frame_Format *f)
+{
+  #ifndef LEGACY_LIBSWRSAMPLE
+    av_channel_layout_uninit(&f->layout);
+  #endif
+  f->fmt = AV_SAMPLE_FMT_NONE;
+}
+
+// converter from frames in the format in to the one of inf (sample
+// format, interleaving, rate and layout). *swrCTX stays NULL when they
+// are in it already, -1 when it can't be made
+int setup_frame_resampler(const Frame_Format *in, Audio_Info *inf, SwrContext **swrCTX)
+{
+  *swrCTX = NULL;
+
+  #ifdef LEGACY_LIBSWRSAMPLE
+    uint64_t layout = inf->ch_layout ? (uint64_t)inf->ch_layout : (uint64_t)av_get_default_channel_layout(inf->ch);
+    int same_layout = in->layout == layout;
+  #else
+    int same_layout = av_channel_layout_compare(&in->layout, &inf->ch_layout) == 0;
+  #endif
+
+  if (in->fmt == inf->sample_fmt && in->rate == inf->sample_rate && in->channels == inf->ch && same_layout)
+    return 0;
+
   #ifdef LEGACY_LIBSWRSAMPLE
-    *swrCTX = swr_alloc_set_opts(*swrCTX,
-      inf->ch_layout, inf->sample_fmt, inf->sample_rate, // output
-      inf->ch_layout, streamCTX->codecCTX->sample_fmt, inf->sample_rate, // input
+    *swrCTX = swr_alloc_set_opts(NULL,
+      layout, inf->sample_fmt, inf->sample_rate, // output
+      in->layout, in->fmt, in->rate, // input
       0, NULL
     );
   #else
     swr_alloc_set_opts2(swrCTX,
       &inf->ch_layout, inf->sample_fmt, inf->sample_rate, // output
-      &inf->ch_layout, streamCTX->codecCTX->sample_fmt, inf->sample_rate, // input
+      &in->layout, in->fmt, in->rate, // input
       0, NULL
     );
   #endif
 
-  return 1;
+  if (!*swrCTX || swr_init(*swrCTX) < 0) {
+    swr_free(swrCTX);
+    return -1;
+  }
+  return 0;
 }
 
-void setup_speed_resampler(StreamContext *streamCTX, Audio_Info *inf, AVFrame *frame, SwrContext **speed_swrCTX)
+// input is what decoder_frame hands over: interleaved, output format
+void setup_speed_resampler(StreamContext *streamCTX, Audio_Info *inf, float speed, SwrContext **speed_swrCTX)
 {
-  // int new_rate = (int)(inf->sample_rate * streamCTX->state->speed);
-  int new_rate = (int)(inf->sample_rate / streamCTX->state->speed);
-  enum AVSampleFormat input_fmt = frame->format;
+  // int new_rate = (int)(inf->sample_rate * speed);
+  int new_rate = (int)(inf->sample_rate / speed);
+  enum AVSampleFormat input_fmt = inf->sample_fmt;
   enum AVSampleFormat output_fmt = inf->sample_fmt;
   #ifdef LEGACY_LIBSWRSAMPLE
-    uint64_t ch_layout_in = streamCTX->codecCTX->channel_layout;
+    // no codec when playing from the disk cache
+    uint64_t ch_layout_in = streamCTX->codecCTX ? streamCTX->codecCTX->channel_layout : 0;
     if (ch_layout_in == 0) {
-      ch_layout_in = av_get_default_channel_layout(streamCTX->codecCTX->channels);
+      ch_layout_in = av_get_default_channel_layout(inf->ch);
     }
     
     *speed_swrCTX = swr_alloc_set_opts(NULL,
@@ -132,13 +244,70 @@ void init_playbackstatus(PlayBackState *state, uint loop)
   state->speed = 1.00f;
   state->looping = loop;
 
-  state->seek_request = 0;
-  state->seek_target = 0;
+  commands_init(state);
+
+  atomic_init(&state->snapshot_seq, 0);
+  state->snapshot = (PlayBack_Snapshot){0};
+  atomic_init(&state->position, 0);
 
   pthread_mutex_init(&state->lock, NULL);
   pthread_cond_init(&state->wait_cond, NULL);
 }
 
+// decoder only: publish where playback is
+void playback_publish(PlayBackState *state, double position, int duration)
+{
+  seqlock_write_begin(&state->snapshot_seq);
+    state->snapshot.position = position;
+    state->snapshot.duration = duration;
+  seqlock_write_end(&state->snapshot_seq);
+  atomic_store_explicit(&state->position, position, memory_order_relaxed);
+}
+
+// any thread, lock free (retries while the decoder is mid write)
+PlayBack_Snapshot playback_snapshot(PlayBackState *state)
+{
+  PlayBack_Snapshot snap;
+  unsigned seq;
+
+  do {
+    seq = seqlock_read_begin(&state->snapshot_seq);
+    snap = state->snapshot;
+  } while (seqlock_read_retry(&state->snapshot_seq, seq));
+
+  return snap;
+}
+
+// the chapters of the container in samples, in order. NULL when it has
+// none (or no memory), the caller frees them
+Chapter *chapters_read(AVFormatContext *fmtCTX, int sample_rate, int *count)
+{
+  *count = 0;
+  if (fmtCTX->nb_chapters == 0) return NULL;
+
+  Chapter *chapters = calloc(fmtCTX->nb_chapters, sizeof(Chapter));
+  if (!chapters) return NULL;
+
+  int64_t start_time = fmtCTX->start_time != AV_NOPTS_VALUE ? fmtCTX->start_time : 0;
+  for (unsigned i = 0; i < fmtCTX->nb_chapters; i++) {
+    AVChapter *ch = fmtCTX->chapters[i];
+    Chapter *c = &chapters[*count];
+
+    c->start = av_rescale_q(ch->start, ch->time_base, (AVRational){1, sample_rate}) -
+               av_rescale(start_time, sample_rate, AV_TIME_BASE);
+    if (c->start < 0) c->start = 0;
+
+    // the demuxers give them in order, a broken file may not
+    if (*count > 0 && c->start <= chapters[*count - 1].start) continue;
+
+    AVDictionaryEntry *title = av_dict_get(ch->metadata, "title", NULL, 0);
+    if (title) snprintf(c->title, sizeof(c->title), "%s", title->value);
+    else snprintf(c->title, sizeof(c->title), "Chapter %d", *count + 1);
+    (*count)++;
+  }
+  return chapters;
+}
+
 void print_metadata(AVDictionary *metadata)
 {
   AVDictionaryEntry *tag = NULL;
@@ -160,25 +329,187 @@ ma_device_config init_miniaudioConfig(Audio_Info *inf, StreamContext *streamCTX)
   ma_config.dataCallback = ma_dataCallback;
   ma_config.pUserData = streamCTX;
 
+  // --power-save: fewer, longer periods, the device thread wakes less
+  if (Options.burst_sec > 0) {
+    ma_config.performanceProfile = ma_performance_profile_conservative;
+    ma_config.periodSizeInMilliseconds = 100;
+  }
+
   return ma_config;
 }
 
 Audio_Buffer *audio_buffer_init(int capacity)
 {
-  Audio_Buffer *buf = malloc(sizeof(Audio_Buffer));
+  // the callback reads both, no page faults there
+  Audio_Buffer *buf = rt_alloc(sizeof(Audio_Buffer));
 
-  buf->pcm_data = malloc(capacity);
+  buf->pcm_data = rt_alloc(capacity);
   buf->capacity = capacity;
   buf->write_pos = 0;     // Start writing at beginning
   buf->read_pos = 0;      // Start reading from beginning
   buf->filled = 0;        // Buffer starts empty
+  buf->primed = 0;
+  buf->starved = 0;
+  atomic_init(&buf->interrupted, 0);
+  buf->writer_waiting = 0;
+  buf->low_water = 0;
+  buf->draining = 0;
+  buf->tick_ms = 0;
+  buf->preroll = 0;
+  buf->prerolling = 0;
+  buf->rebuffers = 0;
+  buf->byte_rate = 0;
+  atomic_init(&buf->seen_buffered_ms, 0);
+  atomic_init(&buf->seen_capacity_ms, 0);
+  atomic_init(&buf->seen_preroll_ms, 0);
+  atomic_init(&buf->seen_prerolling, 0);
+  atomic_init(&buf->seen_rebuffers, 0);
 
   pthread_mutex_init(&buf->lock, NULL);
-  pthread_cond_init(&buf->data_ready, NULL);
-  pthread_cond_init(&buf->space_free, NULL);
+  sem_init(&buf->space_free, 0, 0);
   return buf;
 }
 
+// the reader made room, the lock is held: wake the writer when it sleeps
+void audio_buffer_space_freed(Audio_Buffer *buf)
+{
+  if (!buf->writer_waiting) return;
+  buf->writer_waiting = 0;
+  sem_post(&buf->space_free);
+}
+
+// the writer sleeps for room, without the lock: the reader and the
+// commands post it and never wait on each other. timeout_ms 0 waits
+// until then. 1 when the time ran out
+int audio_buffer_space_wait(Audio_Buffer *buf, int timeout_ms)
+{
+  int ret;
+  if (timeout_ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+    while ((ret = sem_timedwait(&buf->space_free, &ts)) < 0 && errno == EINTR);
+  }
+  else
+    while ((ret = sem_wait(&buf->space_free)) < 0 && errno == EINTR);
+  return ret < 0 && errno == ETIMEDOUT;
+}
+
+// --power-save: the writer fills it up, then sleeps until the reader took
+// it down to low_water, so the decoder wakes once per burst instead of
+// every callback. it still comes back every tick_ms (progress display)
+void audio_buffer_burst(Audio_Buffer *buf, int low_water, int tick_ms)
+{
+  pthread_mutex_lock(&buf->lock);
+  buf->low_water = low_water;
+  buf->tick_ms = tick_ms;
+  pthread_mutex_unlock(&buf->lock);
+}
+
+// network sources: the reader plays silence until bytes are buffered, at
+// the start, after a seek and every time it runs dry. 0 turns it off
+void audio_buffer_preroll(Audio_Buffer *buf, int bytes)
+{
+  pthread_mutex_lock(&buf->lock);
+  if (bytes > buf->capacity) bytes = buf->capacity;
+  buf->preroll = bytes;
+  buf->prerolling = bytes > 0;
+  pthread_mutex_unlock(&buf->lock);
+}
+
+// the input ended: the pre-roll no longer holds the tail back, wait until
+// the reader took it all. returns what is left when a command interrupted us
+int audio_buffer_drain(Audio_Buffer *buf)
+{
+  pthread_mutex_lock(&buf->lock);
+  buf->preroll = 0;
+  buf->prerolling = 0;
+  while (buf->filled > 0 && !atomic_load(&buf->interrupted)) {
+    buf->writer_waiting = 1;
+    pthread_mutex_unlock(&buf->lock);
+    audio_buffer_space_wait(buf, 0);
+    pthread_mutex_lock(&buf->lock);
+  }
+  atomic_store(&buf->interrupted, 0);
+  int left = buf->filled;
+  pthread_mutex_unlock(&buf->lock);
+  return left;
+}
+
+Buffer_Health audio_buffer_health(Audio_Buffer *buf)
+{
+  Buffer_Health health = {0};
+
+  pthread_mutex_lock(&buf->lock);
+  if (buf->byte_rate > 0) {
+    health.buffered_ms = (int64_t)buf->filled * 1000 / buf->byte_rate;
+    health.capacity_ms = (int64_t)buf->capacity * 1000 / buf->byte_rate;
+    health.preroll_ms = (int64_t)buf->preroll * 1000 / buf->byte_rate;
+  }
+  health.prerolling = buf->prerolling;
+  health.rebuffers = buf->rebuffers;
+  pthread_mutex_unlock(&buf->lock);
+
+  return health;
+}
+
+// decoder: the health as it is now, for audio_buffer_seen
+void audio_buffer_publish(Audio_Buffer *buf)
+{
+  Buffer_Health health = audio_buffer_health(buf);
+  atomic_store_explicit(&buf->seen_buffered_ms, health.buffered_ms, memory_order_relaxed);
+  atomic_store_explicit(&buf->seen_capacity_ms, health.capacity_ms, memory_order_relaxed);
+  atomic_store_explicit(&buf->seen_preroll_ms, health.preroll_ms, memory_order_relaxed);
+  atomic_store_explicit(&buf->seen_prerolling, health.prerolling, memory_order_relaxed);
+  atomic_store_explicit(&buf->seen_rebuffers, health.rebuffers, memory_order_relaxed);
+}
+
+// any thread: what the decoder published last, no lock
+Buffer_Health audio_buffer_seen(Audio_Buffer *buf)
+{
+  return (Buffer_Health){
+    .buffered_ms = atomic_load_explicit(&buf->seen_buffered_ms, memory_order_relaxed),
+    .capacity_ms = atomic_load_explicit(&buf->seen_capacity_ms, memory_order_relaxed),
+    .preroll_ms = atomic_load_explicit(&buf->seen_preroll_ms, memory_order_relaxed),
+    .prerolling = atomic_load_explicit(&buf->seen_prerolling, memory_order_relaxed),
+    .rebuffers = atomic_load_explicit(&buf->seen_rebuffers, memory_order_relaxed),
+  };
+}
+
+// make room for more audio, what is queued stays. -1 without memory
+int audio_buffer_grow(Audio_Buffer *buf, int capacity)
+{
+  if (capacity <= buf->capacity) return 0;
+
+  uint8_t *data = rt_alloc(capacity);
+  if (!data) return -1;
+
+  pthread_mutex_lock(&buf->lock);
+
+    // unwrap the queued bytes to the start of the new ring
+    int first = buf->capacity - buf->read_pos;
+    if (first > buf->filled) first = buf->filled;
+    memcpy(data, buf->pcm_data + buf->read_pos, first);
+    memcpy(data + first, buf->pcm_data, buf->filled - first);
+
+    uint8_t *old = buf->pcm_data;
+    buf->pcm_data = data;
+    buf->capacity = capacity;
+    buf->read_pos = 0;
+    buf->write_pos = buf->filled % capacity;
+    audio_buffer_space_freed(buf);
+
+  pthread_mutex_unlock(&buf->lock);
+
+  rt_free(old);
+  return 0;
+}
+
 // Reset audio buffer to empty state (used after seeking to discard old audio)
 void audio_buffer_reset(Audio_Buffer *buf)
 {
@@ -187,65 +518,132 @@ void audio_buffer_reset(Audio_Buffer *buf)
     buf->filled = 0;
     buf->read_pos = 0;
     buf->write_pos = 0;
-    pthread_cond_broadcast(&buf->space_free);
+    buf->primed = 0;
+    buf->draining = 0;
+    audio_buffer_space_freed(buf);
 
   pthread_mutex_unlock(&buf->lock);
 }
 
+// Wake the writer if it waits for room (a command came in), it
+// gets -1 from audio_buffer_write and nothing is written. the flag stays
+// until the commands are drained: a writer about to wait still sees it.
+// control threads: never the lock the callback takes, a post can't be
+// lost between the writer's look at the flag and its sleep
+void audio_buffer_interrupt(Audio_Buffer *buf)
+{
+  // once per drain: a post nobody waited for ends one later wait early
+  if (!atomic_exchange(&buf->interrupted, 1))
+    sem_post(&buf->space_free);
+}
+
+// the writer took the commands the interrupt was for
+void audio_buffer_interrupt_done(Audio_Buffer *buf)
+{
+  atomic_store(&buf->interrupted, 0);
+}
+
 void audio_buffer_destroy(Audio_Buffer *buf)
 {
   if (buf ){
-    free(buf->pcm_data);
+    rt_free(buf->pcm_data);
     pthread_mutex_destroy(&buf->lock);
-    pthread_cond_destroy(&buf->data_ready);
-    pthread_cond_destroy(&buf->space_free);
-    free (buf);
+    sem_destroy(&buf->space_free);
+    rt_free(buf);
   }
 }
 
-void handle_audio_seek(StreamContext *streamCTX, int *duration_time, int64_t *total_samples_played)
+// seek the demuxer to the keyframe at or before target (in samples),
+// returns the clamped target. the decoder decides if it trims up to it
+// and if the audio already in the buffer goes away
+int64_t handle_audio_seek(StreamContext *streamCTX, int duration_time, int64_t target)
 {
   Audio_Info *inf = streamCTX->inf;
-  PlayBackState *state = streamCTX->state;
   AVFormatContext *fmtCTX = streamCTX->fmtCTX;
   AVCodecContext *codecCTX = streamCTX->codecCTX;
 
-
-  // Get current position in seconds
-  double current_sec = (double)*total_samples_played / inf->sample_rate;
-  
-  // Calculate new position (seek_target is in microseconds, convert to seconds)
-  double new_position_seconds = current_sec + ((double)state->seek_target / 1000000);
-  
   // Clamp to valid range (0 to duration)
-  if (new_position_seconds < 0) new_position_seconds = 0;
-  if (new_position_seconds > *duration_time) new_position_seconds = *duration_time;
+  int64_t last = (int64_t)duration_time * inf->sample_rate;
+  if (target < 0) target = 0;
+  if (target > last) target = last;
   
   // Convert to stream timebase for av_seek_frame
-  // av_q2d converts AVRational to double: numerator / denominator
-  int64_t target_pts = (int64_t)(new_position_seconds / av_q2d(inf->audioStream->time_base));
+  int64_t target_pts = av_rescale_q(target, (AVRational){1, inf->sample_rate}, inf->audioStream->time_base);
+  if (inf->audioStream->start_time != AV_NOPTS_VALUE)
+    target_pts += inf->audioStream->start_time;
   
   // Perform the seek (ffmpeg wants stream timebase units, not microseconds!)
   av_seek_frame(fmtCTX, inf->audioStream_index, target_pts, AVSEEK_FLAG_BACKWARD);
   avcodec_flush_buffers(codecCTX);
 
-  // Update sample counter
-  *total_samples_played = (int64_t)(new_position_seconds * inf->sample_rate);
+  return target;
+}
 
-  // clear buffer (discard old audio)
-  audio_buffer_reset(streamCTX->buf);
+// first sample of a decoded frame from its timestamp, -1 when it has none
+int64_t frame_start_sample(Audio_Info *inf, AVFrame *frame)
+{
+  int64_t ts = frame->best_effort_timestamp;
+  if (ts == AV_NOPTS_VALUE) return -1;
 
-  // reset seek flag
-  state->seek_request = 0;
-  state->seek_target = 0;
-  return;
+  AVStream *stream = inf->audioStream;
+  if (stream->start_time != AV_NOPTS_VALUE) ts -= stream->start_time;
+  if (ts < 0) return 0;
+
+  return av_rescale_q(ts, stream->time_base, (AVRational){1, inf->sample_rate});
+}
+
+// drop the first samples of a frame in place (only the pointers move,
+// the frame buffers are still freed by av_frame_unref)
+void frame_trim_front(AVFrame *frame, int samples, int channels)
+{
+  if (samples <= 0) return;
+  if (samples > frame->nb_samples) samples = frame->nb_samples;
+
+  int planar = av_sample_fmt_is_planar(frame->format);
+  int bytes = samples * av_get_bytes_per_sample(frame->format) * (planar ? 1 : channels);
+  int planes = planar ? channels : 1;
+
+  for (int i = 0; i < planes; i++) {
+    if (i < AV_NUM_DATA_POINTERS) frame->data[i] += bytes;
+    if (frame->extended_data && frame->extended_data != frame->data)
+      frame->extended_data[i] += bytes;
+  }
+  frame->nb_samples -= samples;
 }
 
 inline void progress(PlayBackState *state, double current_time, int duration_time)
 {
   int bar_width = 30;
 
-  int pos = (current_time / duration_time) * bar_width;
+  // a pipe or a live stream has no end to show
+  int live = duration_time <= 0;
+  int pos = live ? -1 : (current_time / duration_time) * bar_width;
+
+  // network sources: what the jitter buffer holds
+  char health_text[32] = "";
+  if (state->buf && state->buf->byte_rate && state->buf->preroll) {
+    Buffer_Health health = audio_buffer_seen(state->buf); // decoder_progress published it
+    if (health.prerolling)
+      snprintf(health_text, sizeof(health_text), " | buffering %d%%",
+               health.preroll_ms ? health.buffered_ms * 100 / health.preroll_ms : 0);
+    else
+      snprintf(health_text, sizeof(health_text), " | buf %.1fs", health.buffered_ms / 1000.0);
+  }
+
+  // a CUE sheet: the track heard now
+  char track_text[160] = "";
+  if (state->cue) {
+    const Cue_Track *track = &state->cue->tracks[state->track];
+    snprintf(track_text, sizeof(track_text), " | %02d/%02d %s", track->number,
+             state->cue->tracks[state->cue->count - 1].number, track->title);
+  }
+
+  // the chapter heard now
+  char chapter_text[160] = "";
+  int chapter = state->chapter;
+  if (state->chapters && chapter >= 0)
+    snprintf(chapter_text, sizeof(chapter_text), " | ch %d/%d %s", chapter + 1,
+             state->chapter_count, state->chapters[chapter].title);
 
   printf("\0337");
   printf("\033[0J");
@@ -262,52 +660,170 @@ inline void progress(PlayBackState *state, double current_time, int duration_tim
       printf(".");
   }
 
-    printf("] %d:%02d:%02d / %d:%02d:%02d (%.00f%%) | %.2fx v: %.0f%%, s:%d, l:%d\r",
+  if (live)
+    printf("] %d:%02d:%02d / live | %.2fx v: %.0f%%, s:%d, l:%d%s%s%s\r",
+    get_hour(current_time), get_min(current_time), get_sec(current_time),
+    state->speed, state->volume * 100.0f, DirFiles.shuffle, state->looping, health_text, track_text, chapter_text
+  );
+  else
+    printf("] %d:%02d:%02d / %d:%02d:%02d (%.00f%%) | %.2fx v: %.0f%%, s:%d, l:%d%s%s%s\r",
     get_hour(current_time), get_min(current_time), get_sec(current_time), 
     get_hour(duration_time), get_min(duration_time), get_sec(duration_time),
     (current_time / duration_time) * 100.0, state->speed,
-    state->volume * 100.0f, DirFiles.shuffle, state->looping
+    state->volume * 100.0f, DirFiles.shuffle, state->looping, health_text, track_text, chapter_text
   );
   printf("\0338");
 
   fflush(stdout);
 }
 
-// Read all the files in dir and return them 
+// append a name to the listing, -1 when out of memory (name is freed)
+static int dir_add(char ***files, int *capacity, char *name)
+{
+  // Grow array if needed
+  if (DirFiles.totalFiles == *capacity) {
+    char **tmp = realloc(*files, *capacity * 2 * sizeof(char *));
+    if (!tmp) {
+      free(name);
+      return -1;
+    }
+    *files = tmp;
+    *capacity *= 2;
+  }
+  if (!name) return -1;
+  (*files)[DirFiles.totalFiles++] = name;
+  return 0;
+}
+
+// the entries of an archive, as "<prefix>/<entry>" (or "<entry>" without prefix)
+static int dir_add_archive(char ***files, int *capacity, const char *archive, const char *prefix)
+{
+  int count;
+  char **names = archive_list(archive, &count);
+  if (!names) return 0;
+
+  int ret = 0;
+  for (int i = 0; i < count; i++) {
+    if (ret == 0) {
+      char *name = names[i];
+      if (prefix) {
+        size_t len = strlen(prefix) + strlen(names[i]) + 2;
+        if ((name = malloc(len))) snprintf(name, len, "%s/%s", prefix, names[i]);
+        free(names[i]);
+      }
+      ret = dir_add(files, capacity, name);
+    }
+    else free(names[i]);
+  }
+  free(names);
+  return ret;
+}
+
+// the tracks of a CUE sheet, "album.cue#01"... (they are next to it, name
+// is the sheet from the folder played: its subfolder goes in front)
+static int dir_add_cue(char ***files, int *capacity, const char *sheet, const char *name, char *file, size_t len)
+{
+  int count;
+  char **names = cue_list(sheet, &count, file, len);
+  if (!names) return 0;
+
+  const char *slash = name ? strrchr(name, '/') : NULL;
+  int dir = slash ? slash - name + 1 : 0;
+
+  int ret = 0;
+  for (int i = 0; i < count; i++) {
+    char *track = names[i];
+    if (ret == 0 && dir) {
+      size_t size = dir + strlen(names[i]) + 1;
+      if ((track = malloc(size))) snprintf(track, size, "%.*s%s", dir, name, names[i]);
+      free(names[i]);
+    }
+    if (ret == 0) ret = dir_add(files, capacity, track);
+    else free(track);
+  }
+  free(names);
+  return ret;
+}
+
+// the playable files under path, subfolders too (library.h), sorted
+// (a zip/tar in it, or path itself being one, lists its entries; a CUE
+// sheet lists its tracks instead of the file they are cut from)
 char** extractDir(const char* path){
   // why do i realloc ? because i want O(n) 
   // its better than count then add all the files it will be O(n^2)
 
-  // TODO make it only extract audio files
-  // TODO if there isn't any file close the program 
-
-  DIR *dir = opendir(path);
   int capacity = 10;
   char **files = malloc(capacity * sizeof(char*));
+  if (!files) return NULL;
 
-  struct dirent* entry;
-  while ((entry = readdir(dir)) != NULL) {
-
-    if (strcmp(entry->d_name, ".") == 0 ||
-      strcmp(entry->d_name, "..") == 0)
-      continue;
-
-    // Grow array if needed
-    if (DirFiles.totalFiles == capacity) {
-      capacity *= 2;
-      char **tmp = realloc(files, capacity * sizeof(char *));
-      if (!tmp) {
-        // cleanup on failure
-        for (int i = 0; i < DirFiles.totalFiles; i++)
-          free(files[i]);
-        free(files);
-        closedir(dir);
-        return NULL;
-      }
-      files = tmp;
+  if (archive_type(path) != ARCHIVE_NONE) {
+    if (dir_add_archive(&files, &capacity, path, NULL) < 0) goto fail;
+    return files;
+  }
+
+  if (cue_is_sheet(path)) {
+    if (dir_add_cue(&files, &capacity, path, NULL, NULL, 0) < 0) goto fail;
+    return files;
+  }
 
+  // what is under it: the library index of the folder, brought up to date
+  Library *lib = library_open(path);
+  if (!lib) goto fail;
+  DirFiles.library = lib;
+
+  // the files the sheets in here cut into tracks
+  char (*cut)[PATH_MAX] = NULL;
+  int cuts = 0;
+
+  int ret = 0;
+  for (int i = 0; i < lib->count && ret == 0; i++) {
+    Library_Track *t = &lib->tracks[i];
+
+    // an archive is a folder of its own
+    char full[PATH_MAX];
+    snprintf(full, sizeof(full), "%s/%s", path, t->name);
+    if (t->kind == SCAN_CUE) {
+      void *tmp = realloc(cut, (cuts + 1) * sizeof(*cut));
+      ret = -1;
+      if (tmp) {
+        cut = tmp;
+        cut[cuts][0] = '\0';
+        ret = dir_add_cue(&files, &capacity, full, t->name, cut[cuts], sizeof(cut[cuts]));
+        if (cut[cuts][0]) cuts++;
+      }
     }
-    files[DirFiles.totalFiles++] = strdup(entry->d_name);
+    else if (t->kind == SCAN_ARCHIVE)
+      ret = dir_add_archive(&files, &capacity, full, t->name);
+    else
+      ret = dir_add(&files, &capacity, strdup(t->name));
   }
+
+  if (ret < 0) {
+    free(cut);
+    goto fail;
+  }
+
+  // their tracks play it, not the whole file
+  int kept = 0;
+  for (int i = 0; i < DirFiles.totalFiles; i++) {
+    char full[PATH_MAX];
+    snprintf(full, sizeof(full), "%s/%s", path, files[i]);
+    int is_cut = 0;
+    for (int c = 0; c < cuts && !is_cut; c++)
+      is_cut = !strcmp(full, cut[c]);
+
+    if (is_cut) free(files[i]);
+    else files[kept++] = files[i];
+  }
+  DirFiles.totalFiles = kept;
+  free(cut);
   return files;
+
+fail:
+  // cleanup on failure
+  for (int i = 0; i < DirFiles.totalFiles; i++)
+    free(files[i]);
+  free(files);
+  DirFiles.totalFiles = 0;
+  return NULL;
 }
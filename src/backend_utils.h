@@ -12,19 +12,42 @@ enum AVSampleFormat get_interleaved(enum AVSampleFormat value);
 ma_format get_ma_format(enum AVSampleFormat value);
 
 int get_stream(AVFormatContext *fmtCTX, int type);
+void discard_other_streams(AVFormatContext *fmtCTX, int keep);
 void store_information(StreamContext *streamCTX, int audioStream_index, enum AVSampleFormat output_sample_fmt);
+void store_cached_information(Audio_Info *inf, const Disk_Cache_Header *head);
 
-int setup_sample_fmt_resampler(StreamContext *streamCTX, Audio_Info *inf, SwrContext **swrCTX);
-void setup_speed_resampler(StreamContext *streamCTX, Audio_Info *inf, AVFrame *frame, SwrContext **speed_swrCTX);
+int frame_channels(const AVFrame *frame);
+int frame_format_changed(const Frame_Format *f, const AVFrame *frame);
+void frame_format_store(Frame_Format *f, const AVFrame *frame);
+void frame_format_free(Frame_Format *f);
+int setup_frame_resampler(const Frame_Format *in, Audio_Info *inf, SwrContext **swrCTX);
+void setup_speed_resampler(StreamContext *streamCTX, Audio_Info *inf, float speed, SwrContext **speed_swrCTX);
 
 ma_device_config init_miniaudioConfig(Audio_Info *inf, StreamContext *streamCTX);
 
 Audio_Buffer *audio_buffer_init(int capacity);
+void audio_buffer_burst(Audio_Buffer *buf, int low_water, int tick_ms);
+int audio_buffer_grow(Audio_Buffer *buf, int capacity);
+void audio_buffer_preroll(Audio_Buffer *buf, int bytes);
+int audio_buffer_drain(Audio_Buffer *buf);
+Buffer_Health audio_buffer_health(Audio_Buffer *buf);
+void audio_buffer_publish(Audio_Buffer *buf);
+Buffer_Health audio_buffer_seen(Audio_Buffer *buf);
+void audio_buffer_reset(Audio_Buffer *buf);
+void audio_buffer_space_freed(Audio_Buffer *buf);
+int audio_buffer_space_wait(Audio_Buffer *buf, int timeout_ms);
+void audio_buffer_interrupt(Audio_Buffer *buf);
+void audio_buffer_interrupt_done(Audio_Buffer *buf);
 void audio_buffer_destroy(Audio_Buffer *buf);
 
 void init_playbackstatus(PlayBackState *state, uint loop);
+void playback_publish(PlayBackState *state, double position, int duration);
+PlayBack_Snapshot playback_snapshot(PlayBackState *state);
 
-void handle_audio_seek(StreamContext *streamCTX, int *duration_time, int64_t *total_samples_played);
+int64_t handle_audio_seek(StreamContext *streamCTX, int duration_time, int64_t target);
+int64_t frame_start_sample(Audio_Info *inf, AVFrame *frame);
+void frame_trim_front(AVFrame *frame, int samples, int channels);
+Chapter *chapters_read(AVFormatContext *fmtCTX, int sample_rate, int *count);
 void print_metadata(AVDictionary *metadata);
 void progress(PlayBackState *state, double current_time, int duration_time);
 
@@ -0,0 +1,162 @@
+#include <pthread.h>
+#include <sched.h>
+
+#include "backend.h"
+#include "backend_utils.h"
+#include "command.h"
+#include "control.h"
+#include "mpsc.h"
+#include "stats.h"
+#include "status.h"
+
+int commands_init(PlayBackState *state)
+{
+  return mpsc_queue_init(&state->commands, 64, sizeof(Command));
+}
+
+void commands_destroy(PlayBackState *state)
+{
+  mpsc_queue_destroy(&state->commands);
+}
+
+// add to an atomic float and keep it in [min, max]
+static void atomic_add_clamp(_Atomic float *value, float delta, float min, float max)
+{
+  float old = atomic_load(value), new;
+  do {
+    new = old + delta;
+    if (new > max) new = max;
+    if (new < min) new = min;
+  } while (!atomic_compare_exchange_weak(value, &old, new));
+}
+
+// wake the decoder wherever it sleeps
+static void commands_wake(PlayBackState *state)
+{
+  // waiting for room in the buffer
+  if (state->buf)
+    audio_buffer_interrupt(state->buf);
+
+  // sleeping while paused
+  pthread_mutex_lock(&state->lock);
+    pthread_cond_broadcast(&state->wait_cond);
+  pthread_mutex_unlock(&state->lock);
+}
+
+// control threads: queue it and wake the decoder. volume, speed and stop
+// are atomics the callback and the decoder read, they don't wait for the
+// decoder to come back from a slow read
+void command_push(PlayBackState *state, Command cmd)
+{
+  switch (cmd.type) {
+    case CMD_SPEED:
+      atomic_add_clamp(&state->speed, cmd.delta, 0.25f, 2.00f);
+      status_publish(state);
+      return;
+
+    case CMD_VOLUME:
+      atomic_add_clamp(&state->volume, cmd.delta, 0.00f, 1.26f);
+      status_publish(state);
+      return;
+
+    // the decoder sees running go down (and network reads are interrupted)
+    case CMD_STOP:
+      playback_stop_now(state);
+      commands_wake(state);
+      return;
+
+    default:
+      break;
+  }
+
+  // a full queue means the decoder is busy for a moment: wait, never drop.
+  // if playback already ended nobody will ever drain it.
+  while (!mpsc_queue_push(&state->commands, &cmd)) {
+    if (!state->running) return;
+    sched_yield();
+  }
+
+  commands_wake(state);
+}
+
+int commands_pending(PlayBackState *state)
+{
+  return !mpsc_queue_empty(&state->commands);
+}
+
+// decoder thread only: apply everything queued, in order.
+// seeks are coalesced into one target the decoder seeks to once.
+void commands_drain(PlayBackState *state, Command_Batch *batch)
+{
+  *batch = (Command_Batch){0};
+  Command cmd;
+
+  // what woke the writer is taken now, a later wait must not end early
+  if (state->buf)
+    audio_buffer_interrupt_done(state->buf);
+
+  while (mpsc_queue_pop(&state->commands, &cmd)) {
+    batch->commands++;
+
+    switch (cmd.type) {
+      case CMD_SEEK:
+        batch->seek++;
+        batch->seek_us += cmd.offset_us;
+        stats_add(seek_keys, 1);
+        break;
+
+      // an absolute seek drops the relative ones before it
+      case CMD_GOTO:
+        batch->seek++;
+        batch->seek_abs = 1;
+        batch->seek_us = cmd.offset_us;
+        batch->chapter = batch->chapter_to = 0;
+        stats_add(seek_keys, 1);
+        break;
+
+      case CMD_CHAPTER:
+        batch->chapter += cmd.flag;
+        break;
+
+      case CMD_CHAPTER_TO:
+        batch->chapter_to = cmd.flag;
+        batch->chapter = 0;
+        break;
+
+      case CMD_LOOP:
+        loop_set(state, cmd.flag < 0 ? !state->looping : cmd.flag);
+        break;
+
+      // the tracks of a CUE sheet are all in the file we have open
+      case CMD_NEXT:
+        if (state->cue) batch->track++;
+        else select_next_audio(state);
+        break;
+
+      case CMD_PREV:
+        if (state->cue) batch->track--;
+        else select_prev_audio(state);
+        break;
+
+      case CMD_TRACK:
+        if (state->cue) {
+          batch->track_to = cmd.flag;
+          batch->track = 0;
+        }
+        break;
+
+      // applied in command_push, never queued
+      case CMD_SPEED:
+      case CMD_VOLUME:
+      case CMD_STOP:
+        break;
+
+      case CMD_MARK:
+        if (cmd.flag == MARK_CLEAR)
+          batch->marks = MARK_CLEAR;
+        else
+          batch->marks |= cmd.flag;
+        break;
+    }
+  }
+}
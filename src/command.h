@@ -0,0 +1,61 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stdint.h>
+#include "backend.h"
+
+// controls (keys, socket) never touch the decoder state directly:
+// they queue a command and the decoder applies it between packets,
+// while paused, or when it waits for room in the buffer. speed, volume
+// and stop are applied right away (atomics), the decoder is only woken.
+typedef enum {
+  CMD_SEEK,     // offset_us, relative
+  CMD_SPEED,    // delta
+  CMD_VOLUME,   // delta
+  CMD_NEXT,
+  CMD_PREV,
+  CMD_LOOP,     // flag: 1 on, 0 off, -1 toggle
+  CMD_STOP,
+  CMD_MARK,     // flag: MARK_A, MARK_B or MARK_CLEAR
+  CMD_TRACK,    // flag: TRACK number of the CUE sheet playing
+  CMD_CHAPTER,  // flag: chapters to go on (-1 back)
+  CMD_CHAPTER_TO, // flag: chapter number, from 1
+  CMD_GOTO,     // offset_us, from the start of the file
+
+} Command_Type;
+
+// A-B loop markers, set where the user hears the music now
+#define MARK_A      1
+#define MARK_B      2
+#define MARK_CLEAR  4
+
+typedef struct {
+  Command_Type type;
+  int64_t offset_us;
+  float delta;
+  int flag;
+
+} Command;
+
+// what the decoder has to do itself after a drain
+typedef struct {
+  int seek;            // how many seeks came in (even if they cancel out)
+  int64_t seek_us;     // all seeks summed into one target
+  int seek_abs;        // a CMD_GOTO came in: seek_us is from the start, not from here
+  int commands;        // how many were drained
+  int marks;           // MARK_* that came in, a clear drops the marks before it
+  int track;           // a CUE sheet: next/prev summed (+1 a track on), the decoder jumps
+  int track_to;        // a CUE sheet: CMD_TRACK, 0 none
+  int chapter;         // CMD_CHAPTER summed, from chapter_to when there is one
+  int chapter_to;      // CMD_CHAPTER_TO, 0 none (the decoder makes them a CMD_GOTO)
+
+} Command_Batch;
+
+int commands_init(PlayBackState *state);
+void commands_destroy(PlayBackState *state);
+
+void command_push(PlayBackState *state, Command cmd);
+int commands_pending(PlayBackState *state);
+void commands_drain(PlayBackState *state, Command_Batch *batch);
+
+#endif
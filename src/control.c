@@ -1,3 +1,4 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <sys/poll.h>
 #include <termios.h>
@@ -10,12 +11,18 @@
 #include <poll.h>
 
 #include "backend.h"
+#include "backend_utils.h"
+#include "command.h"
 #include "control.h"
+#include "events.h"
+#include "status.h"
 #include "utils.h"
 
+// draws of shuffle_pick before it settles for the same album
+#define SHUFFLE_DRAWS 8
+
 struct keybinding { const char *key; void (*handler)(PlayBackState*); };
 
-#define CTRL_KEY(key) (const char[]){key - 'a' + 1 , '\0'} // remove this when you move the code to socket function
 
 static const struct keybinding keybindings[] = {
     {" "     ,       playback_toggle},
@@ -31,36 +38,95 @@ static const struct keybinding keybindings[] = {
     {"l"     ,       loop_toggle},
     {"s"     ,       shuffle_toggle},
     {">"     ,       playback_next_audio},
-    {"<"     ,       playback_prev_audio}
+    {"<"     ,       playback_prev_audio},
+    {"."     ,       chapter_next},
+    {","     ,       chapter_prev},
+    {"a"     ,       ab_mark_a},
+    {"b"     ,       ab_mark_b},
+    {"c"     ,       ab_clear}
 };
 
 
 static const int kbds_len = sizeof(keybindings) / sizeof(struct keybinding);
 
+// same actions by name, for the control socket (tomuctl)
+static const struct keybinding commands[] = {
+    {"toggle"   ,    playback_toggle},
+    {"pause"    ,    playback_pause},
+    {"resume"   ,    playback_resume},
+    {"stop"     ,    playback_stop},
+    {"quit"     ,    playback_stop},
+    {"vol+"     ,    volume_increase},
+    {"vol-"     ,    volume_decrease},
+    {"fwd"      ,    seek_forward_sec},
+    {"back"     ,    seek_backward_sec},
+    {"fwd-min"  ,    seek_forward_min},
+    {"back-min" ,    seek_backward_min},
+    {"speed+"   ,    playback_speed_increase},
+    {"speed-"   ,    playback_speed_decrease},
+    {"loop"     ,    loop_toggle},
+    {"shuffle"  ,    shuffle_toggle},
+    {"next"     ,    playback_next_audio},
+    {"prev"     ,    playback_prev_audio},
+    {"chapter+" ,    chapter_next},
+    {"chapter-" ,    chapter_prev},
+    {"mark-a"   ,    ab_mark_a},
+    {"mark-b"   ,    ab_mark_b},
+    {"ab-clear" ,    ab_clear}
+};
+
+static const int cmds_len = sizeof(commands) / sizeof(struct keybinding);
+
+// run the action bound to a key or a command name, -1 if there is none
+int control_dispatch(PlayBackState *state, const char *key)
+{
+  // a hashmap should be used here but allocating mem here is overkill
+  for (uint i = 0; i < kbds_len; i++) {
+    if (strcmp(key, keybindings[i].key) == 0) {
+      keybindings[i].handler(state);
+      status_publish(state);
+      return 0;
+    }
+  }
+
+  for (uint i = 0; i < cmds_len; i++) {
+    if (strcmp(key, commands[i].key) == 0) {
+      commands[i].handler(state);
+      status_publish(state);
+      return 0;
+    }
+  }
+  return -1;
+}
+
 // For interactive player
 void *handle_input(void *arg){
   PlayBackState *state = (PlayBackState*)arg;
 
   struct termios old, raw;
 
-  tcgetattr(STDIN_FILENO, &old);
+  // the audio may come through stdin ("-"): the keys come from the
+  // terminal then, without one only the socket controls us
+  int fd = isatty(STDIN_FILENO) ? STDIN_FILENO : open("/dev/tty", O_RDONLY | O_CLOEXEC);
+
+  tcgetattr(fd, &old);
   raw = old;
 
   raw.c_lflag &= ~(ICANON | ECHO);
 
-  tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+  tcsetattr(fd, TCSANOW, &raw);
 
   printf("\033[?25l"); // hide cursor
   fflush(stdout);
 
   struct pollfd pfd = {
-    .fd = STDIN_FILENO,
+    .fd = fd, // poll skips it when it is -1
     .events = POLLIN
   };
 
   while (state->running){
-    // wait 80ms for input
-    int ret = poll(&pfd, 1, 80);
+    // wait 80ms for input (power save: longer, a new file waits for us a little)
+    int ret = poll(&pfd, 1, Options.burst_sec > 0 ? 250 : 80);
 
     if (!state->running) break;
 
@@ -68,7 +134,7 @@ void *handle_input(void *arg){
         char key_buf[4] = {0}; // for escape sequences
 
         // key press
-        int n = read(STDIN_FILENO, key_buf, 1);
+        int n = read(fd, key_buf, 1);
         // n shouldn't be zero since we polled successfully
         if (n < 0) { perror("read"); break; }; 
 
@@ -82,7 +148,7 @@ void *handle_input(void *arg){
                 break;
             } // fuck off on errors
             if (ret == 1 && (pfd.revents & POLLIN)) {
-                int n = read(STDIN_FILENO, key_buf + 1, sizeof(key_buf) - 1);
+                int n = read(fd, key_buf + 1, sizeof(key_buf) - 1);
                 if (n < 0) {
                     perror("read escape sequence");
                     break;
@@ -91,11 +157,7 @@ void *handle_input(void *arg){
         }
 
         // now we just find the proper keybinding..
-        // a hashmap should be used here but allocating mem here is overkill
-        for (uint i = 0; i < kbds_len; i++) {
-            if (strcmp(key_buf, keybindings[i].key) == 0) keybindings[i].handler(state); 
-
-        }
+        control_dispatch(state, key_buf);
 
         if (!state->running) break; // leave if there's nothing playing
     }
@@ -111,7 +173,8 @@ void *handle_input(void *arg){
   printf("\033[?25h\r"); // show cursor
   fflush(stdout);
 
-  tcsetattr(STDIN_FILENO, TCSANOW, &old);
+  tcsetattr(fd, TCSANOW, &old);
+  if (fd > STDIN_FILENO) close(fd);
   return NULL;
 }
 
@@ -129,81 +192,53 @@ inline void playback_toggle(PlayBackState *state) {
 }
 
 inline void playback_pause(PlayBackState *state){
-  pthread_mutex_lock(&state->lock);
-    state->paused = 1;
-  pthread_mutex_unlock(&state->lock);
+  state->paused = 1;
+  event_emit(EVENT_PAUSE, playback_snapshot(state).position, NULL);
 }
 
+// the decoder sleeps on wait_cond while paused, wake it under the lock
 inline void playback_resume(PlayBackState *state){
   pthread_mutex_lock(&state->lock);
     state->paused = 0;
     pthread_cond_broadcast(&state->wait_cond);
   pthread_mutex_unlock(&state->lock);
+  event_emit(EVENT_RESUME, playback_snapshot(state).position, NULL);
 }
 
-// Stops playback and wakes any waiting threads
+// Stops playback right away, the decoder is woken (see command_push)
 inline void playback_stop(PlayBackState *state){
-  pthread_mutex_lock(&state->lock);
-    state->paused = 0;
-    state->running = 0;
-    // state->shuffle = 0;
-    // state->looping = 0;
-    pthread_cond_broadcast(&state->wait_cond);
-  pthread_mutex_unlock(&state->lock);
-  KeepPlayingDirectory = false;
+  command_push(state, (Command){ .type = CMD_STOP });
 }
 
 // =================================================================
 
 // control audio seek
+// seeks are queued, never dropped: the decoder sums all of them
+// that came in since it last looked and seeks once
 
 // Requests a seek forward by 5 seconds
 void seek_forward_sec(PlayBackState *state)
 {
-  pthread_mutex_lock(&state->lock);
-    if (!state->seek_request){
-      state->seek_request = 1;
-      state->seek_target = +5000000; // +5 sec in microseconds
-      pthread_cond_broadcast(&state->wait_cond);
-    }
-  pthread_mutex_unlock(&state->lock);
+  command_push(state, (Command){ .type = CMD_SEEK, .offset_us = +5000000 }); // +5 sec in microseconds
 }
 
 
 // Requests a seek forward by 1 min
 void seek_forward_min(PlayBackState *state)
 {
-  pthread_mutex_lock(&state->lock);
-    if (!state->seek_request){
-      state->seek_request = 1;
-      state->seek_target = +60000000; // +60 sec in microseconds
-      pthread_cond_broadcast(&state->wait_cond);
-    }
-  pthread_mutex_unlock(&state->lock);
+  command_push(state, (Command){ .type = CMD_SEEK, .offset_us = +60000000 }); // +60 sec in microseconds
 }
 
 // Requests a seek backward by 5 seconds
 void seek_backward_sec(PlayBackState *state)
 {
-  pthread_mutex_lock(&state->lock);
-    if (!state->seek_request){
-      state->seek_request = 1;
-      state->seek_target = -5000000; // -5 sec in microseconds
-      pthread_cond_broadcast(&state->wait_cond);
-    }
-  pthread_mutex_unlock(&state->lock);
+  command_push(state, (Command){ .type = CMD_SEEK, .offset_us = -5000000 }); // -5 sec in microseconds
 }
 
 // Requests a seek backward by 1 min
 void seek_backward_min(PlayBackState *state)
 {
-  pthread_mutex_lock(&state->lock);
-    if (!state->seek_request){
-      state->seek_request = 1;
-      state->seek_target = -60000000; // -60 sec in microseconds
-      pthread_cond_broadcast(&state->wait_cond);
-    }
-  pthread_mutex_unlock(&state->lock);
+  command_push(state, (Command){ .type = CMD_SEEK, .offset_us = -60000000 }); // -60 sec in microseconds
 }
 
 // =================================================================
@@ -212,18 +247,12 @@ void seek_backward_min(PlayBackState *state)
 
 void playback_speed_increase(PlayBackState *state)
 {
-  pthread_mutex_lock(&state->lock);
-    state->speed += 0.05f;
-    if (state->speed > 2.00f) state->speed = 2.00f;
-  pthread_mutex_unlock(&state->lock);
+  command_push(state, (Command){ .type = CMD_SPEED, .delta = +0.05f });
 }
 
 void playback_speed_decrease(PlayBackState *state)
 {
-  pthread_mutex_lock(&state->lock);
-    state->speed -= 0.05f;
-    if (state->speed < 0.25f) state->speed = 0.25f;
-  pthread_mutex_unlock(&state->lock);
+  command_push(state, (Command){ .type = CMD_SPEED, .delta = -0.05f });
 }
 
 // =================================================================
@@ -231,48 +260,38 @@ void playback_speed_decrease(PlayBackState *state)
 // control volume playback
 
 inline void volume_increase(PlayBackState *state){
-  pthread_mutex_lock(&state->lock);
-    state->volume += 0.02f;
-    if (state->volume > 1.26f) state->volume = 1.26f;
-  pthread_mutex_unlock(&state->lock);
+  command_push(state, (Command){ .type = CMD_VOLUME, .delta = +0.02f });
 }
 
 inline void volume_decrease(PlayBackState *state){
-  pthread_mutex_lock(&state->lock);
-    state->volume -= 0.02f;
-    if (state->volume < 0.00f) state->volume = 0.00f;
-  pthread_mutex_unlock(&state->lock);
+  command_push(state, (Command){ .type = CMD_VOLUME, .delta = -0.02f });
 }
 // ===================================================================
 
-void change_Audio(PlayBackState *state){
-    pthread_mutex_lock(&state->lock);
-    state->running = 0;
-    state->paused = 0;
-    pthread_cond_broadcast(&state->wait_cond);
-    pthread_mutex_unlock(&state->lock);
-    
-    // Note: KeepPlayingDirectory stays 1 (true) by default, 
-    // so utils.c knows to play the next file
-}
 void loop_toggle(PlayBackState *state) {
-    if (state->looping) loop_false(state);
-    else loop_true(state);
+  command_push(state, (Command){ .type = CMD_LOOP, .flag = -1 });
 }
 
 inline void loop_true(PlayBackState *state){
-  pthread_mutex_lock(&state->lock);
-  state->looping = true;
-  DirFiles.DirLoopStop = false;
-  pthread_cond_broadcast(&state->wait_cond);
-  pthread_mutex_unlock(&state->lock);
+  command_push(state, (Command){ .type = CMD_LOOP, .flag = 1 });
 }
 
 inline void loop_false(PlayBackState *state){
-  pthread_mutex_lock(&state->lock);
-    state->looping = false;
-    DirFiles.DirLoopStop = true;
-  pthread_mutex_unlock(&state->lock);
+  command_push(state, (Command){ .type = CMD_LOOP, .flag = 0 });
+}
+
+// A-B loop: the decoder puts the markers where we are now,
+// setting B turns looping on
+void ab_mark_a(PlayBackState *state){
+  command_push(state, (Command){ .type = CMD_MARK, .flag = MARK_A });
+}
+
+void ab_mark_b(PlayBackState *state){
+  command_push(state, (Command){ .type = CMD_MARK, .flag = MARK_B });
+}
+
+void ab_clear(PlayBackState *state){
+  command_push(state, (Command){ .type = CMD_MARK, .flag = MARK_CLEAR });
 }
 
 void shuffle_toggle(PlayBackState *state) {
@@ -281,18 +300,76 @@ void shuffle_toggle(PlayBackState *state) {
 }
 
 inline void shuffle_true(PlayBackState *state){
-  pthread_mutex_lock(&state->lock);
   // state->shuffle = true;
   DirFiles.shuffle = true;
-  pthread_cond_broadcast(&state->wait_cond);
-  pthread_mutex_unlock(&state->lock);
 }
 
 inline void shuffle_false(PlayBackState *state){
+  // state->shuffle = false;
+  DirFiles.shuffle = false;
+}
+
+inline void playback_next_audio(PlayBackState *state){
+  command_push(state, (Command){ .type = CMD_NEXT });
+}
+
+inline void playback_prev_audio(PlayBackState *state){
+  command_push(state, (Command){ .type = CMD_PREV });
+}
+
+inline void chapter_next(PlayBackState *state){
+  command_push(state, (Command){ .type = CMD_CHAPTER, .flag = 1 });
+}
+
+inline void chapter_prev(PlayBackState *state){
+  command_push(state, (Command){ .type = CMD_CHAPTER, .flag = -1 });
+}
+
+// chapter number (from 1) of the file playing
+void playback_chapter(PlayBackState *state, int number){
+  command_push(state, (Command){ .type = CMD_CHAPTER_TO, .flag = number });
+}
+
+// seconds from the start of the file
+void playback_goto(PlayBackState *state, double seconds){
+  command_push(state, (Command){ .type = CMD_GOTO, .offset_us = (int64_t)(seconds * 1000000) });
+}
+
+// a CUE sheet plays: go to its TRACK number
+void playback_track(PlayBackState *state, int number){
+  command_push(state, (Command){ .type = CMD_TRACK, .flag = number });
+}
+
+// =================================================================
+
+// applied by the decoder thread when it drains the commands (command.c)
+
+// Stops playback and wakes any waiting threads (from command_push, any thread)
+void playback_stop_now(PlayBackState *state){
   pthread_mutex_lock(&state->lock);
-    // state->shuffle = false;
-    DirFiles.shuffle = false;
+    state->paused = 0;
+    state->running = 0;
+    // state->shuffle = 0;
+    // state->looping = 0;
+    pthread_cond_broadcast(&state->wait_cond);
   pthread_mutex_unlock(&state->lock);
+  KeepPlayingDirectory = false;
+}
+
+void change_Audio(PlayBackState *state){
+    pthread_mutex_lock(&state->lock);
+    state->running = 0;
+    state->paused = 0;
+    pthread_cond_broadcast(&state->wait_cond);
+    pthread_mutex_unlock(&state->lock);
+    
+    // Note: KeepPlayingDirectory stays 1 (true) by default, 
+    // so utils.c knows to play the next file
+}
+
+void loop_set(PlayBackState *state, uint on){
+  state->looping = on;
+  DirFiles.DirLoopStop = !on;
 }
 
 void stopAndShuffle(PlayBackState* state){
@@ -300,36 +377,77 @@ void stopAndShuffle(PlayBackState* state){
   change_Audio(state);
 }
 
+// the album of an entry when the library index knows it
+static const char *entry_album(int file){
+  if (file < 0 || file >= DirFiles.totalFiles) return NULL;
+  const Library_Tags *tags = library_tags(library_find(DirFiles.library, DirFiles.files[file]));
+  return tags ? tags->album : NULL;
+}
+
+// a random entry, not the one playing and, when the index knows the
+// albums, not of the same album (a few draws, a folder may be one album)
+static int shuffle_pick(){
+  static int seeded;
+  if (!seeded) {
+    srand(time(NULL) ^ getpid());
+    seeded = 1;
+  }
+
+  int total = DirFiles.totalFiles, current = DirFiles.currentFile;
+  const char *album = entry_album(current);
+  int file = rand() % total;
+  for (int i = 0; i < SHUFFLE_DRAWS && total > 1; i++) {
+    const char *other = file != current ? entry_album(file) : NULL;
+    if (file != current && (!album || !other || strcmp(album, other))) break;
+    file = rand() % total;
+  }
+  return file;
+}
+
 void shuffle(){
-  srand(time(NULL));
   if(DirFiles.totalFiles > 0)
-    DirFiles.currentFile = rand() % (DirFiles.totalFiles);
+    DirFiles.currentFile = shuffle_pick();
 }
 
+// compute the new index first, the player thread reads currentFile
 void next(PlayBackState *state){
-  DirFiles.currentFile++;
-  if (DirFiles.currentFile >= DirFiles.totalFiles)
-    DirFiles.currentFile = 0; 
-    
+  int file = DirFiles.currentFile + 1;
+  if (file >= DirFiles.totalFiles)
+    file = 0; 
+
+  DirFiles.currentFile = file;
   change_Audio(state); 
 }
 
 void prev(PlayBackState *state){
-  DirFiles.currentFile--;
-  if (DirFiles.currentFile < 0)
-    DirFiles.currentFile = DirFiles.totalFiles-1; 
+  int file = DirFiles.currentFile - 1;
+  if (file < 0)
+    file = DirFiles.totalFiles-1; 
 
+  DirFiles.currentFile = file;
   change_Audio(state); 
 }
 
-inline void playback_next_audio(PlayBackState *state){
+// the entry select_next_audio (step 1) or select_prev_audio (-1) would
+// play, without going there. -1 when there is no folder
+int playlist_peek(int step){
+  if (DirFiles.totalFiles <= 0) return -1;
+  if (DirFiles.shuffle) return shuffle_pick();
+
+  int file = DirFiles.currentFile + step;
+  if (file >= DirFiles.totalFiles) file = 0;
+  if (file < 0) file = DirFiles.totalFiles - 1;
+  return file;
+}
+
+void select_next_audio(PlayBackState *state){
   if(DirFiles.shuffle)
     stopAndShuffle(state);
   else 
     next(state);
 }
 
-inline void playback_prev_audio(PlayBackState *state){
+void select_prev_audio(PlayBackState *state){
   if(DirFiles.shuffle)
     stopAndShuffle(state);
   else
@@ -4,6 +4,7 @@
 #include "backend.h"
 
 void *handle_input(void *arg);
+int control_dispatch(PlayBackState *state, const char *key);
 
 void playback_toggle(PlayBackState *state);
 void playback_pause(PlayBackState *state);
@@ -32,7 +33,24 @@ void loop_toggle(PlayBackState *state);
 void loop_true(PlayBackState *state);
 void loop_false(PlayBackState *state);
 
+void ab_mark_a(PlayBackState *state);
+void ab_mark_b(PlayBackState *state);
+void ab_clear(PlayBackState *state);
+
 void playback_next_audio(PlayBackState *state);
 void playback_prev_audio(PlayBackState *state);
+void playback_track(PlayBackState *state, int number);
+void chapter_next(PlayBackState *state);
+void chapter_prev(PlayBackState *state);
+void playback_chapter(PlayBackState *state, int number);
+void playback_goto(PlayBackState *state, double seconds);
+
+// applied by the decoder (command.c)
+void playback_stop_now(PlayBackState *state);
+void loop_set(PlayBackState *state, uint on);
+void select_next_audio(PlayBackState *state);
+void select_prev_audio(PlayBackState *state);
+void change_Audio(PlayBackState *state);
+int playlist_peek(int step);
 
 #endif
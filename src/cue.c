@@ -0,0 +1,234 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "cue.h"
+
+// a sheet made for a .wav often sits next to the flac it was encoded to
+static const char *audio_exts[] = { "flac", "wv", "ape", "wav", "m4a", "opus", "ogg", "mp3", NULL };
+
+static const char *base_name(const char *path)
+{
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+int cue_is_sheet(const char *path)
+{
+  size_t len = strlen(path);
+  return len > 4 && !strcasecmp(path + len - 4, ".cue");
+}
+
+int cue_split(const char *path, char *sheet, size_t len, int *number)
+{
+  const char *hash = strrchr(path, '#');
+  if (!hash || !isdigit((unsigned char)hash[1])) return 0;
+
+  char *end;
+  long n = strtol(hash + 1, &end, 10);
+  if (*end || n <= 0 || (size_t)(hash - path) >= len) return 0;
+
+  memcpy(sheet, path, hash - path);
+  sheet[hash - path] = '\0';
+  if (!cue_is_sheet(sheet)) return 0;
+
+  *number = n;
+  return 1;
+}
+
+// the next word of a line, or the "quoted string" (quotes dropped)
+static void cue_word(char **line, char *out, size_t len)
+{
+  char *p = *line;
+  size_t n = 0;
+
+  while (isspace((unsigned char)*p)) p++;
+
+  if (*p == '"') {
+    for (p++; *p && *p != '"'; p++)
+      if (n + 1 < len) out[n++] = *p;
+    if (*p == '"') p++;
+  }
+  else {
+    for (; *p && !isspace((unsigned char)*p); p++)
+      if (n + 1 < len) out[n++] = *p;
+  }
+
+  out[n] = '\0';
+  *line = p;
+}
+
+// mm:ss:ff in frames, -1 when it isn't one
+static int64_t cue_time(const char *text)
+{
+  int m, s, f;
+  if (sscanf(text, "%d:%d:%d", &m, &s, &f) != 3 || m < 0 || s < 0 || s > 59 || f < 0 || f >= CUE_FRAMES_PER_SEC)
+    return -1;
+  return ((int64_t)m * 60 + s) * CUE_FRAMES_PER_SEC + f;
+}
+
+static int exists(const char *path)
+{
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// FILE is relative to the sheet (written on windows maybe), when it isn't
+// there the same name with another audio extension is tried
+static int cue_resolve(Cue_Sheet *cue, const char *name)
+{
+  char file[PATH_MAX];
+  snprintf(file, sizeof(file), "%s", name);
+  for (char *p = file; *p; p++)
+    if (*p == '\\') *p = '/';
+
+  int dir = file[0] == '/' ? 0 : base_name(cue->path) - cue->path;
+  if (snprintf(cue->file, sizeof(cue->file), "%.*s%s", dir, cue->path, file) >= (int)sizeof(cue->file))
+    return -1;
+  if (exists(cue->file)) return 0;
+
+  char *dot = strrchr(cue->file, '.');
+  if (!dot || strchr(dot, '/')) return -1;
+  size_t stem = dot - cue->file;
+
+  for (int i = 0; audio_exts[i]; i++) {
+    snprintf(cue->file + stem, sizeof(cue->file) - stem, ".%s", audio_exts[i]);
+    if (exists(cue->file)) return 0;
+  }
+  return -1;
+}
+
+int cue_load(const char *path, Cue_Sheet *cue)
+{
+  FILE *f = fopen(path, "r");
+  if (!f) return -1;
+
+  memset(cue, 0, sizeof(*cue));
+  snprintf(cue->path, sizeof(cue->path), "%s", path);
+
+  char line[1024], word[256], file[PATH_MAX] = "";
+  int files = 0, tracks = 0;
+  Cue_Track *track = NULL;
+
+  while (fgets(line, sizeof(line), f)) {
+    char *p = line;
+    if (!strncmp(p, "\xef\xbb\xbf", 3)) p += 3; // UTF-8 BOM
+    cue_word(&p, word, sizeof(word));
+
+    if (!strcasecmp(word, "FILE")) {
+      if (files++) break;
+      cue_word(&p, file, sizeof(file));
+    }
+
+    // data tracks (and the ones past the limit) are skipped with what follows them
+    else if (!strcasecmp(word, "TRACK")) {
+      char type[16];
+      cue_word(&p, word, sizeof(word));
+      cue_word(&p, type, sizeof(type));
+      tracks++;
+      track = NULL;
+      if (!files || strcasecmp(type, "AUDIO") || cue->count == CUE_MAX_TRACKS) continue;
+
+      track = &cue->tracks[cue->count++];
+      track->number = atoi(word);
+      track->start = -1;
+    }
+
+    else if (!strcasecmp(word, "INDEX")) {
+      cue_word(&p, word, sizeof(word));
+      int index = atoi(word);
+      cue_word(&p, word, sizeof(word));
+      if (track && index == 1) track->start = cue_time(word);
+    }
+
+    // before the first TRACK they are the album's
+    else if (!strcasecmp(word, "TITLE") || !strcasecmp(word, "PERFORMER")) {
+      int title = !strcasecmp(word, "TITLE");
+      char *to = track ? (title ? track->title : track->performer)
+                       : tracks ? NULL : (title ? cue->title : cue->performer);
+      if (to) cue_word(&p, to, sizeof(cue->title));
+    }
+  }
+  fclose(f);
+
+  // a track without INDEX 01, or starting before the one it follows, can't be cut
+  int n = 0;
+  for (int i = 0; i < cue->count; i++) {
+    Cue_Track *t = &cue->tracks[i];
+    if (t->start < 0 || (n > 0 && t->start <= cue->tracks[n - 1].start)) continue;
+    cue->tracks[n++] = *t;
+  }
+  cue->count = n;
+
+  if (!files || cue->count == 0) return -1;
+  return cue_resolve(cue, file);
+}
+
+char **cue_list(const char *path, int *count, char *file, size_t len)
+{
+  Cue_Sheet *cue = malloc(sizeof(Cue_Sheet));
+  if (!cue || cue_load(path, cue) < 0) {
+    free(cue);
+    return NULL;
+  }
+
+  char **names = calloc(cue->count, sizeof(char*));
+  if (!names) {
+    free(cue);
+    return NULL;
+  }
+
+  const char *sheet = base_name(path);
+  for (int i = 0; i < cue->count; i++) {
+    size_t size = strlen(sheet) + 16;
+    if (!(names[i] = malloc(size))) {
+      while (i--) free(names[i]);
+      free(names);
+      free(cue);
+      return NULL;
+    }
+    snprintf(names[i], size, "%s#%02d", sheet, cue->tracks[i].number);
+  }
+
+  *count = cue->count;
+  if (file) snprintf(file, len, "%s", cue->file);
+  free(cue);
+  return names;
+}
+
+int cue_track_find(const Cue_Sheet *cue, int number)
+{
+  for (int i = 0; i < cue->count; i++)
+    if (cue->tracks[i].number == number) return i;
+  return -1;
+}
+
+int cue_entry(const Cue_Sheet *cue, const char *name)
+{
+  char sheet[PATH_MAX];
+  int number;
+  if (!cue_split(name, sheet, sizeof(sheet), &number)) return -1;
+
+  // entries are relative to the folder played: "CD2/album.cue" is not "CD1/album.cue"
+  size_t len = strlen(sheet), all = strlen(cue->path);
+  if (len > all || strcmp(cue->path + all - len, sheet)) return -1;
+  if (len < all && cue->path[all - len - 1] != '/') return -1;
+  return cue_track_find(cue, number);
+}
+
+int64_t cue_track_start(const Cue_Sheet *cue, int track, int rate)
+{
+  return cue->tracks[track].start * rate / CUE_FRAMES_PER_SEC;
+}
+
+// the pregap of the first track (before its INDEX 01) counts as the first track
+int cue_track_at(const Cue_Sheet *cue, int64_t sample, int rate)
+{
+  int track = 0;
+  while (track + 1 < cue->count && cue_track_start(cue, track + 1, rate) <= sample)
+    track++;
+  return track;
+}
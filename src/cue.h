@@ -0,0 +1,63 @@
+#ifndef CUE_H
+#define CUE_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// CUE sheets: one audio file (a whole CD rip) cut into tracks at their
+// INDEX 01 (mm:ss:ff, 75 frames a second). every track is a playlist
+// entry of its own, named after the sheet: album.cue#03. they all play
+// from one decoder on the file, opened and probed once: from a track into
+// the next the audio just goes on, a jump is a precise seek to the first
+// sample of the track. of a sheet with several FILEs only the tracks of
+// the first one are played
+
+#define CUE_FRAMES_PER_SEC 75
+#define CUE_MAX_TRACKS     99
+
+typedef struct {
+  int number;              // TRACK nn
+  int64_t start;           // INDEX 01, in frames (1/75s)
+  char title[128];
+  char performer[128];
+
+} Cue_Track;
+
+typedef struct Cue_Sheet {
+  char path[PATH_MAX];     // the sheet
+  char file[PATH_MAX];     // the audio file it cuts (next to the sheet)
+  char title[128];
+  char performer[128];
+  int count;
+  Cue_Track tracks[CUE_MAX_TRACKS];
+
+} Cue_Sheet;
+
+// a .cue file (by its name)
+int cue_is_sheet(const char *path);
+
+// a track entry "dir/album.cue#3": 1 with the sheet path and the track
+// number, 0 when the path is not one
+int cue_split(const char *path, char *sheet, size_t len, int *number);
+
+// 0, -1 when it can't be read, has no audio track or its file is missing
+int cue_load(const char *path, Cue_Sheet *cue);
+
+// the track entries of a sheet ("album.cue#01", next to the sheet) and the
+// audio file they play (to leave it out of the listing). NULL when it
+// can't be loaded, the names and the array are the caller's to free
+char **cue_list(const char *path, int *count, char *file, size_t len);
+
+// index of TRACK number, -1 when the sheet has no such track
+int cue_track_find(const Cue_Sheet *cue, int number);
+
+// index of the track of a playlist entry name ("CD1/album.cue#03", from
+// the folder played) when it is one of this sheet, -1 when it is not
+int cue_entry(const Cue_Sheet *cue, const char *name);
+
+// first sample of a track at rate, the track sample is in
+int64_t cue_track_start(const Cue_Sheet *cue, int track, int rate);
+int cue_track_at(const Cue_Sheet *cue, int64_t sample, int rate);
+
+#endif
@@ -0,0 +1,537 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "diskcache.h"
+#include "stats.h"
+#include "utils.h"
+
+#define RAM_SLOTS 64
+#define DISKCACHE_CHUNK (1 << 20)  // PCM handed to the writer thread at once
+#define DISKCACHE_QUEUE (32 << 20) // a disk this far behind loses the entry, not the decoder its time
+
+// recently played entries which stay mapped (main thread only)
+static struct {
+  uint64_t key;
+  void *map;
+  size_t len;
+  uint64_t used;
+} ram[RAM_SLOTS];
+
+static size_t ram_bytes;
+static uint64_t ram_clock;
+
+// writer threads still running, the session waits for them at the end
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_idle = PTHREAD_COND_INITIALIZER;
+static int jobs;
+
+static size_t disk_budget(void) { return (size_t)Options.cache_disk_mb << 20; }
+static size_t ram_budget(void)  { return (size_t)Options.cache_ram_mb << 20; }
+
+static int64_t thread_cpu_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// $XDG_CACHE_HOME/tomu/<name> or ~/.cache/tomu/<name>, created on the way
+int diskcache_dir(const char *name, char *out, size_t len)
+{
+  const char *base = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int n;
+
+  if (base && base[0])
+    n = snprintf(out, len, "%s/tomu/%s", base, name);
+  else if (home && home[0])
+    n = snprintf(out, len, "%s/.cache/tomu/%s", home, name);
+  else
+    return -1;
+
+  if (n < 0 || (size_t)n >= len) return -1;
+
+  // mkdir -p
+  for (char *p = out + 1; *p; p++) {
+    if (*p != '/') continue;
+    *p = '\0';
+    mkdir(out, 0755);
+    *p = '/';
+  }
+  if (mkdir(out, 0755) < 0 && errno != EEXIST) return -1;
+  return 0;
+}
+
+// FNV-1a of the real path, the size and the mtime: an edited file is a new key
+int diskcache_key(const char *path, uint64_t *key)
+{
+  char real[PATH_MAX];
+  struct stat st;
+
+  if (!realpath(path, real) || stat(real, &st) < 0) return -1;
+
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const char *p = real; *p; p++)
+    hash = (hash ^ (unsigned char)*p) * 0x100000001b3ULL;
+
+  int64_t meta[3] = { st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+  const unsigned char *bytes = (const unsigned char*)meta;
+  for (size_t i = 0; i < sizeof(meta); i++)
+    hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+
+  *key = hash;
+  return 0;
+}
+
+static int entry_path(char *out, size_t len, uint64_t key)
+{
+  char dir[900];
+  if (diskcache_dir("pcm", dir, sizeof(dir)) < 0) return -1;
+
+  int n = snprintf(out, len, "%s/%016llx.pcm", dir, (unsigned long long)key);
+  return (n < 0 || (size_t)n >= len) ? -1 : 0;
+}
+
+static int hit_from_map(Cache_Hit *hit, uint64_t key, void *map, size_t len)
+{
+  if (len < DISKCACHE_DATA) return -1;
+
+  memcpy(&hit->head, map, sizeof(hit->head));
+  Disk_Cache_Header *head = &hit->head;
+
+  if (head->magic != DISKCACHE_MAGIC || head->version != DISKCACHE_VERSION ||
+      head->frame_bytes <= 0 || head->samples <= 0 ||
+      DISKCACHE_DATA + (uint64_t)head->samples * head->frame_bytes != len)
+    return -1;
+
+  hit->key = key;
+  hit->map = map;
+  hit->map_len = len;
+  hit->pcm = (const uint8_t*)map + DISKCACHE_DATA;
+  return 0;
+}
+
+int diskcache_lookup(const char *path, Cache_Hit *hit)
+{
+  uint64_t key;
+  if (disk_budget() == 0 || diskcache_key(path, &key) < 0) return 0;
+
+  stats_add(cache_lookups, 1);
+
+  // played a moment ago: still mapped, no syscall at all
+  for (int i = 0; i < RAM_SLOTS; i++) {
+    if (!ram[i].map || ram[i].key != key) continue;
+
+    if (hit_from_map(hit, key, ram[i].map, ram[i].len) < 0) break;
+    ram_bytes -= ram[i].len;
+    ram[i].map = NULL;
+
+    stats_add(cache_hits, 1);
+    stats_add(cache_ram_hits, 1);
+    stats_add(cpu_saved_ms, hit->head.decode_ns / 1000000);
+    return 1;
+  }
+
+  char file[1024];
+  if (entry_path(file, sizeof(file), key) < 0) return 0;
+
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
+
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+  if (map == MAP_FAILED || hit_from_map(hit, key, map, st.st_size) < 0) {
+    // a broken entry (crash while writing it, older version)
+    if (map != MAP_FAILED) munmap(map, st.st_size);
+    close(fd);
+    unlink(file);
+    return 0;
+  }
+
+  // the LRU order on disk is the mtime
+  futimens(fd, NULL);
+  close(fd);
+
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  stats_add(cache_hits, 1);
+  stats_add(cpu_saved_ms, hit->head.decode_ns / 1000000);
+  return 1;
+}
+
+void diskcache_release(Cache_Hit *hit)
+{
+  if (!hit->map) return;
+
+  if (hit->map_len > ram_budget()) {
+    munmap(hit->map, hit->map_len);
+    hit->map = NULL;
+    return;
+  }
+
+  // drop the least recently used until it fits
+  for (;;) {
+    int free_slot = -1, oldest = -1;
+
+    for (int i = 0; i < RAM_SLOTS; i++) {
+      if (!ram[i].map) { if (free_slot < 0) free_slot = i; continue; }
+      if (oldest < 0 || ram[i].used < ram[oldest].used) oldest = i;
+    }
+
+    if (free_slot >= 0 && ram_bytes + hit->map_len <= ram_budget()) {
+      ram[free_slot].key = hit->key;
+      ram[free_slot].map = hit->map;
+      ram[free_slot].len = hit->map_len;
+      ram[free_slot].used = ++ram_clock;
+      ram_bytes += hit->map_len;
+      break;
+    }
+
+    munmap(ram[oldest].map, ram[oldest].len);
+    ram_bytes -= ram[oldest].len;
+    ram[oldest].map = NULL;
+  }
+  hit->map = NULL;
+}
+
+void diskcache_close(void)
+{
+  for (int i = 0; i < RAM_SLOTS; i++) {
+    if (ram[i].map) munmap(ram[i].map, ram[i].len);
+    ram[i].map = NULL;
+  }
+  ram_bytes = 0;
+
+  // an entry the last track finished is still going to disk
+  pthread_mutex_lock(&jobs_lock);
+    while (jobs > 0)
+      pthread_cond_wait(&jobs_idle, &jobs_lock);
+  pthread_mutex_unlock(&jobs_lock);
+}
+
+typedef struct {
+  char name[32];
+  off_t size;
+  time_t mtime;
+} Disk_Entry;
+
+static int by_mtime(const void *a, const void *b)
+{
+  time_t ta = ((const Disk_Entry*)a)->mtime, tb = ((const Disk_Entry*)b)->mtime;
+  return (ta > tb) - (ta < tb);
+}
+
+// least recently played entries go until the cache fits the disk budget.
+// unlinking is safe for a player which still has one mapped
+static void enforce_disk_budget(void)
+{
+  char dir[1024];
+  if (diskcache_dir("pcm", dir, sizeof(dir)) < 0) return;
+
+  DIR *d = opendir(dir);
+  if (!d) return;
+
+  Disk_Entry *entries = NULL;
+  size_t count = 0, cap = 0;
+  uint64_t total = 0;
+  struct dirent *ent;
+
+  while ((ent = readdir(d)) != NULL) {
+    size_t len = strlen(ent->d_name);
+    if (len < 5 || len >= sizeof(entries->name) || strcmp(ent->d_name + len - 4, ".pcm"))
+      continue;
+
+    struct stat st;
+    if (fstatat(dirfd(d), ent->d_name, &st, 0) < 0) continue;
+
+    if (count == cap) {
+      cap = cap ? cap * 2 : 64;
+      Disk_Entry *grown = realloc(entries, cap * sizeof(*entries));
+      if (!grown) break;
+      entries = grown;
+    }
+    strcpy(entries[count].name, ent->d_name);
+    entries[count].size = st.st_size;
+    entries[count].mtime = st.st_mtime;
+    total += st.st_size;
+    count++;
+  }
+
+  qsort(entries, count, sizeof(*entries), by_mtime);
+
+  for (size_t i = 0; i < count && total > disk_budget(); i++) {
+    if (unlinkat(dirfd(d), entries[i].name, 0) == 0)
+      total -= entries[i].size;
+  }
+
+  closedir(d);
+  free(entries);
+}
+
+// the writer thread of an entry: the decoder hands it chunks, it writes
+// them in order and gives them back for the decoder to fill again
+typedef struct Cache_Chunk {
+  struct Cache_Chunk *next;
+  size_t len;
+  uint8_t data[];
+
+} Cache_Chunk;
+
+typedef struct Cache_Job {
+  pthread_mutex_t lock;
+  pthread_cond_t more;
+  Cache_Chunk *first, *last;   // to write
+  Cache_Chunk *spare;          // written, for the decoder to fill again
+  size_t queued;               // bytes in first..last
+  int done;                    // 1 the decoder finished (head is set), -1 drop the entry
+  uint64_t key;
+  Disk_Cache_Header head;
+
+} Cache_Job;
+
+static void chunks_free(Cache_Chunk *c)
+{
+  while (c) {
+    Cache_Chunk *next = c->next;
+    free(c);
+    c = next;
+  }
+}
+
+static void *writer_run(void *arg)
+{
+  Cache_Job *job = arg;
+
+  // header last, when we know it is complete
+  char file[1024], tmp[1100];
+  FILE *out = NULL;
+  if (entry_path(file, sizeof(file), job->key) == 0) {
+    snprintf(tmp, sizeof(tmp), "%s.tmp%d.%llx", file, (int)getpid(), (unsigned long long)(uintptr_t)job);
+    out = fopen(tmp, "w");
+    if (out && fseek(out, DISKCACHE_DATA, SEEK_SET) < 0) {
+      fclose(out);
+      unlink(tmp);
+      out = NULL;
+    }
+  }
+
+  pthread_mutex_lock(&job->lock);
+  if (!out) job->done = -1;
+
+  for (;;) {
+    while (!job->first && !job->done)
+      pthread_cond_wait(&job->more, &job->lock);
+    if (job->done < 0 || !job->first) break;
+
+    Cache_Chunk *c = job->first;
+    job->first = c->next;
+    if (!job->first) job->last = NULL;
+    job->queued -= c->len;
+    pthread_mutex_unlock(&job->lock);
+
+    int ok = fwrite(c->data, 1, c->len, out) == c->len;
+
+    pthread_mutex_lock(&job->lock);
+    c->next = job->spare;
+    job->spare = c;
+    if (!ok) job->done = -1; // the decoder sees it on its next chunk
+  }
+
+  int done = job->done;
+  pthread_mutex_unlock(&job->lock);
+
+  if (out) {
+    int ok = done > 0 &&
+             fseek(out, 0, SEEK_SET) == 0 &&
+             fwrite(&job->head, sizeof(job->head), 1, out) == 1;
+    ok &= fclose(out) == 0;
+
+    if (ok && rename(tmp, file) == 0) {
+      stats_add(cache_bytes_written, DISKCACHE_DATA + job->head.samples * job->head.frame_bytes);
+      enforce_disk_budget();
+    }
+    else
+      unlink(tmp);
+  }
+
+  chunks_free(job->first);
+  chunks_free(job->spare);
+  pthread_mutex_destroy(&job->lock);
+  pthread_cond_destroy(&job->more);
+  free(job);
+
+  pthread_mutex_lock(&jobs_lock);
+    jobs--;
+    pthread_cond_broadcast(&jobs_idle);
+  pthread_mutex_unlock(&jobs_lock);
+  return NULL;
+}
+
+void diskcache_writer_begin(Cache_Writer *w, const char *path, int sample_rate, int channels,
+                            int sample_fmt, int frame_bytes, int64_t expected, int64_t loop_a, int64_t loop_b)
+{
+  *w = (Cache_Writer){0};
+  if (disk_budget() == 0 || diskcache_key(path, &w->key) < 0) return;
+
+  // it would push everything else out (or not fit at all)
+  if ((uint64_t)expected * frame_bytes > disk_budget() / 2) return;
+
+  Cache_Job *job = calloc(1, sizeof(Cache_Job));
+  if (!job) return;
+  job->key = w->key;
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->more, NULL);
+
+  pthread_mutex_lock(&jobs_lock);
+    jobs++;
+  pthread_mutex_unlock(&jobs_lock);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, writer_run, job) != 0) {
+    pthread_mutex_lock(&jobs_lock);
+      jobs--;
+    pthread_mutex_unlock(&jobs_lock);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->more);
+    free(job);
+    return;
+  }
+  pthread_detach(thread);
+  w->job = job;
+
+  w->head = (Disk_Cache_Header){
+    .magic = DISKCACHE_MAGIC,
+    .version = DISKCACHE_VERSION,
+    .sample_rate = sample_rate,
+    .channels = channels,
+    .sample_fmt = sample_fmt,
+    .frame_bytes = frame_bytes,
+    .loop_a = loop_a,
+    .loop_b = loop_b,
+  };
+  w->cpu_start = thread_cpu_ns();
+}
+
+// give the chunk being filled to the thread, -1 when the entry is lost
+// (the thread failed, or the disk is DISKCACHE_QUEUE behind)
+static int writer_hand(Cache_Writer *w)
+{
+  Cache_Job *job = w->job;
+  Cache_Chunk *c = w->chunk;
+  int ret = 0;
+
+  pthread_mutex_lock(&job->lock);
+  if (job->done < 0 || job->queued + c->len > DISKCACHE_QUEUE)
+    ret = -1;
+  else {
+    c->next = NULL;
+    if (job->last) job->last->next = c;
+    else job->first = c;
+    job->last = c;
+    job->queued += c->len;
+    w->chunk = NULL;
+    pthread_cond_signal(&job->more);
+  }
+  pthread_mutex_unlock(&job->lock);
+  return ret;
+}
+
+// an empty chunk, one the thread wrote when there is one
+static Cache_Chunk *writer_chunk(Cache_Writer *w)
+{
+  Cache_Job *job = w->job;
+
+  pthread_mutex_lock(&job->lock);
+  Cache_Chunk *c = job->spare;
+  if (c) job->spare = c->next;
+  pthread_mutex_unlock(&job->lock);
+
+  if (!c) c = malloc(sizeof(Cache_Chunk) + DISKCACHE_CHUNK);
+  if (c) c->len = 0;
+  return c;
+}
+
+void diskcache_writer_append(Cache_Writer *w, const uint8_t *pcm, int64_t samples, int64_t start)
+{
+  if (!w->job || samples <= 0) return;
+
+  if (start != w->head.samples ||
+      (uint64_t)(w->head.samples + samples) * w->head.frame_bytes > disk_budget() / 2) {
+    diskcache_writer_abort(w);
+    return;
+  }
+
+  size_t bytes = samples * w->head.frame_bytes;
+  while (bytes > 0) {
+    if (!w->chunk && !(w->chunk = writer_chunk(w))) {
+      diskcache_writer_abort(w);
+      return;
+    }
+
+    size_t n = DISKCACHE_CHUNK - w->chunk->len;
+    if (n > bytes) n = bytes;
+    memcpy(w->chunk->data + w->chunk->len, pcm, n);
+    w->chunk->len += n;
+    pcm += n;
+    bytes -= n;
+
+    if (w->chunk->len == DISKCACHE_CHUNK && writer_hand(w) < 0) {
+      diskcache_writer_abort(w);
+      return;
+    }
+  }
+  w->head.samples += samples;
+}
+
+void diskcache_writer_finish(Cache_Writer *w, int64_t end)
+{
+  if (!w->job) return;
+
+  if (end != w->head.samples || w->head.samples == 0 ||
+      (w->chunk && w->chunk->len > 0 && writer_hand(w) < 0)) {
+    diskcache_writer_abort(w);
+    return;
+  }
+
+  w->head.decode_ns = thread_cpu_ns() - w->cpu_start;
+
+  // the thread publishes it when it wrote the rest
+  Cache_Job *job = w->job;
+  pthread_mutex_lock(&job->lock);
+    job->head = w->head;
+    if (job->done == 0) job->done = 1;
+    pthread_cond_signal(&job->more);
+  pthread_mutex_unlock(&job->lock);
+
+  free(w->chunk);
+  w->chunk = NULL;
+  w->job = NULL;
+}
+
+void diskcache_writer_abort(Cache_Writer *w)
+{
+  if (!w->job) return;
+
+  Cache_Job *job = w->job;
+  pthread_mutex_lock(&job->lock);
+    job->done = -1;
+    pthread_cond_signal(&job->more);
+  pthread_mutex_unlock(&job->lock);
+
+  free(w->chunk);
+  w->chunk = NULL;
+  w->job = NULL;
+}
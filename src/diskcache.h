@@ -0,0 +1,76 @@
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// decoded PCM of files played before, in $XDG_CACHE_HOME/tomu/pcm
+// (~/.cache/tomu/pcm), keyed by path + mtime + size. a hit is mmap'ed
+// and played without opening the file with ffmpeg at all.
+// --cache-disk MB is the budget on disk (LRU by mtime, 0 = no cache),
+// --cache-ram MB how much of the recent entries stays mapped in memory.
+
+#define DISKCACHE_MAGIC   0x6d637074 // "tpcm"
+#define DISKCACHE_VERSION 1
+#define DISKCACHE_DATA    4096       // PCM starts at a page boundary
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  int32_t sample_rate;
+  int32_t channels;
+  int32_t sample_fmt;          // enum AVSampleFormat, interleaved
+  int32_t frame_bytes;
+  int64_t samples;
+  int64_t loop_a, loop_b;      // LOOPSTART/LOOPEND tags, -1 none
+  int64_t decode_ns;           // decoder CPU time of the pass, what a hit saves
+
+} Disk_Cache_Header;
+
+typedef struct {
+  Disk_Cache_Header head;
+  const uint8_t *pcm;
+  uint64_t key;
+  void *map;
+  size_t map_len;
+
+} Cache_Hit;
+
+struct Cache_Job;
+struct Cache_Chunk;
+
+// filled by the decoder while it plays a file from start to end. the
+// decoder only copies the PCM into chunks: a thread of the entry writes
+// them, publishes the entry and evicts, the disk never makes it wait
+typedef struct {
+  struct Cache_Job *job;       // the writer thread's, NULL no entry
+  struct Cache_Chunk *chunk;   // being filled
+  uint64_t key;
+  Disk_Cache_Header head;
+  int64_t cpu_start;
+
+} Cache_Writer;
+
+// 1 hit (release it when done), 0 miss
+int diskcache_lookup(const char *path, Cache_Hit *hit);
+void diskcache_release(Cache_Hit *hit);
+
+void diskcache_writer_begin(Cache_Writer *w, const char *path, int sample_rate, int channels,
+                            int sample_fmt, int frame_bytes, int64_t expected, int64_t loop_a, int64_t loop_b);
+// samples which start at start, anything but the continuation drops the entry
+void diskcache_writer_append(Cache_Writer *w, const uint8_t *pcm, int64_t samples, int64_t start);
+// the decoder reached the end at position end: publish the entry
+void diskcache_writer_finish(Cache_Writer *w, int64_t end);
+void diskcache_writer_abort(Cache_Writer *w);
+
+// FNV-1a of the real path, size and mtime, also names the shared entries
+int diskcache_key(const char *path, uint64_t *key);
+
+// $XDG_CACHE_HOME/tomu/<name> (~/.cache/tomu/<name>), made if missing
+int diskcache_dir(const char *name, char *out, size_t len);
+
+// unmap what the RAM budget kept, wait for the entries still being
+// written (end of the session)
+void diskcache_close(void);
+
+#endif
@@ -0,0 +1,103 @@
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "events.h"
+#include "mpsc.h"
+
+static Mpsc_Queue queue;
+static int wake_fd = -1; // socket thread polls this
+
+static const struct { Event_Type type; const char *name; } event_names[] = {
+  {EVENT_TRACK    , "track"},
+  {EVENT_PAUSE    , "pause"},
+  {EVENT_RESUME   , "resume"},
+  {EVENT_SEEK     , "seek"},
+  {EVENT_POSITION , "position"},
+  {EVENT_UNDERRUN , "underrun"},
+  {EVENT_STALL    , "stall"},
+  {EVENT_STALL_END, "stall-end"},
+  {EVENT_CHAPTER  , "chapter"}
+};
+
+static const int names_len = sizeof(event_names) / sizeof(event_names[0]);
+
+int events_init(void)
+{
+  if (mpsc_queue_init(&queue, 128, sizeof(Event)) < 0) return -1;
+
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return wake_fd < 0 ? -1 : 0;
+}
+
+void events_destroy(void)
+{
+  if (wake_fd >= 0) close(wake_fd);
+  wake_fd = -1;
+  mpsc_queue_destroy(&queue);
+}
+
+int events_fd(void)
+{
+  return wake_fd;
+}
+
+static int push(Event_Type type, double value, const char *text)
+{
+  if (!queue.slots) return 0; // no socket, nobody listens
+
+  Event ev = { .type = type, .value = value };
+  if (text) {
+    strncpy(ev.text, text, sizeof(ev.text) - 1);
+    // one event per line on the socket
+    for (char *c = ev.text; *c; c++)
+      if (*c == '\n') *c = '?';
+  }
+  return mpsc_queue_push(&queue, &ev);
+}
+
+// from normal threads: queue it and wake the socket thread
+void event_emit(Event_Type type, double value, const char *text)
+{
+  if (push(type, value, text)) {
+    uint64_t one = 1;
+    (void)!write(wake_fd, &one, sizeof(one)); // nonblocking, a full counter is fine
+  }
+}
+
+// from the audio callback: no syscalls, the socket thread picks it up on its next tick
+void event_emit_rt(Event_Type type, double value)
+{
+  push(type, value, NULL);
+}
+
+// socket thread only
+int event_next(Event *ev)
+{
+  if (!queue.slots) return 0;
+  return mpsc_queue_pop(&queue, ev);
+}
+
+// socket thread, after events_fd() polled readable
+void events_ack(void)
+{
+  uint64_t count;
+  (void)!read(wake_fd, &count, sizeof(count));
+}
+
+const char *event_name(Event_Type type)
+{
+  for (int i = 0; i < names_len; i++)
+    if (event_names[i].type == type) return event_names[i].name;
+  return "unknown";
+}
+
+Event_Type event_parse(const char *name)
+{
+  if (!strcmp(name, "all")) return EVENT_ALL;
+
+  for (int i = 0; i < names_len; i++)
+    if (!strcmp(event_names[i].name, name)) return event_names[i].type;
+  return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+// events pushed to socket subscribers (see socket.c)
+// emitting never blocks: the event goes into a lock-free queue and the
+// socket thread fans it out, a full queue just drops the event
+
+typedef enum {
+  EVENT_TRACK    = 1 << 0,   // text = file
+  EVENT_PAUSE    = 1 << 1,
+  EVENT_RESUME   = 1 << 2,
+  EVENT_SEEK     = 1 << 3,   // value = new position (sec)
+  EVENT_POSITION = 1 << 4,   // generated by the socket thread, never queued
+  EVENT_UNDERRUN = 1 << 5,
+  EVENT_STALL    = 1 << 6,   // a read is blocked past its deadline, value = position (sec)
+  EVENT_STALL_END = 1 << 7,  // it returned, value = how long it took (sec)
+  EVENT_CHAPTER  = 1 << 8,   // value = chapter number, text = its title
+
+} Event_Type;
+
+#define EVENT_ALL (EVENT_TRACK | EVENT_PAUSE | EVENT_RESUME | EVENT_SEEK | EVENT_POSITION | EVENT_UNDERRUN | \
+                   EVENT_STALL | EVENT_STALL_END | EVENT_CHAPTER)
+
+typedef struct {
+  Event_Type type;
+  double value;
+  char text[240];
+
+} Event;
+
+int events_init(void);
+void events_destroy(void);
+int events_fd(void);
+void events_ack(void);
+
+void event_emit(Event_Type type, double value, const char *text);
+void event_emit_rt(Event_Type type, double value);
+int event_next(Event *ev);
+
+const char *event_name(Event_Type type);
+Event_Type event_parse(const char *name);
+
+#endif
@@ -0,0 +1,427 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libavformat/avformat.h>
+#include <libavutil/mem.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fileio.h"
+#include "stats.h"
+#include "uring.h"
+#include "utils.h"
+
+#define AVIO_BUFFER_SIZE (64 * 1024)
+
+enum { AHEAD_READY, AHEAD_WANTED, AHEAD_FILLING };
+
+struct File_IO {
+  int mode;                    // IO_*, or -1 for --preload
+  int fd;                      // -1 once the whole file is in memory
+  int64_t size;
+  int64_t pos;                 // where the demuxer reads
+  uint8_t *window;             // file bytes [win_start, win_start + win_len), the mapping for mmap
+  int64_t win_start, win_len, win_cap;
+  Uring_Reader *uring;         // IO_URING
+  AVIOContext *avio;
+
+  // --preload of a file bigger than MB: two windows of half of it, the
+  // helper thread reads the next one while the demuxer reads this one
+  uint8_t *ahead;              // [ahead_start, ahead_start + ahead_len) when READY
+  int64_t ahead_start, ahead_len;
+  int ahead_state;             // AHEAD_*
+  int64_t asked_for;           // win_start we asked the next window for
+  pthread_t helper;
+  int helper_running;
+  int quit;
+  pthread_mutex_t lock;        // ahead*, quit
+  pthread_cond_t cond;
+};
+
+int fileio_mode(const char *name)
+{
+  if (!strcmp(name, "ffmpeg")) return IO_FFMPEG;
+  if (!strcmp(name, "read")) return IO_READ;
+  if (!strcmp(name, "mmap")) return IO_MMAP;
+  if (!strcmp(name, "uring")) return IO_URING;
+  return -1;
+}
+
+// up to win_cap bytes of the file at start into data, what we got
+static int64_t window_read(File_IO *io, uint8_t *data, int64_t start)
+{
+  int64_t want = io->size - start < io->win_cap ? io->size - start : io->win_cap;
+  int64_t got = 0;
+
+  while (got < want) {
+    ssize_t n = pread(io->fd, data + got, want - got, start + got);
+    stats_add(io_syscalls, 1);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    got += n;
+  }
+
+  stats_add(io_bytes, got);
+  stats_add(preload_fills, 1);
+  return got;
+}
+
+// read the window at `at`, a little before it so short seeks back stay inside
+static int window_fill(File_IO *io, int64_t at)
+{
+  int64_t start = at - io->win_cap / 16;
+  if (start < 0 || io->win_cap >= io->size) start = 0;
+  if (start + io->win_cap > io->size) start = io->size > io->win_cap ? io->size - io->win_cap : 0;
+
+  io->win_start = start;
+  io->win_len = window_read(io, io->window, start);
+  return io->win_len > 0 ? 0 : -1;
+}
+
+// the helper thread: reads the window asked for into ahead
+static void *ahead_run(void *arg)
+{
+  File_IO *io = arg;
+
+  pthread_mutex_lock(&io->lock);
+  for (;;) {
+    while (io->ahead_state != AHEAD_WANTED && !io->quit)
+      pthread_cond_wait(&io->cond, &io->lock);
+    if (io->quit) break;
+
+    io->ahead_state = AHEAD_FILLING;
+    int64_t start = io->ahead_start;
+    pthread_mutex_unlock(&io->lock);
+
+    int64_t got = window_read(io, io->ahead, start);
+
+    pthread_mutex_lock(&io->lock);
+    io->ahead_len = got;
+    io->ahead_state = AHEAD_READY;
+    pthread_cond_broadcast(&io->cond);
+  }
+  pthread_mutex_unlock(&io->lock);
+  return NULL;
+}
+
+// the demuxer is past the middle of the window: the next one is read now,
+// it is there (or on the way) when the demuxer gets to its end
+static void ahead_ask(File_IO *io)
+{
+  int64_t end = io->win_start + io->win_len;
+  if (io->asked_for == io->win_start || end >= io->size ||
+      io->pos < io->win_start + io->win_len / 2)
+    return;
+
+  pthread_mutex_lock(&io->lock);
+  if (io->ahead_state == AHEAD_READY && !(io->ahead_start == end && io->ahead_len > 0)) {
+    io->ahead_start = end;
+    io->ahead_len = 0;
+    io->ahead_state = AHEAD_WANTED;
+    pthread_cond_signal(&io->cond);
+  }
+  if (io->ahead_start == end) io->asked_for = io->win_start; // else it is busy with an old one
+  pthread_mutex_unlock(&io->lock);
+}
+
+// pos is in the other window (the next one, or the one before a short
+// seek back): it becomes this one. waits only when the demuxer caught up
+// with the helper. 0 when it isn't there
+static int ahead_take(File_IO *io)
+{
+  int taken = 0;
+
+  pthread_mutex_lock(&io->lock);
+  while (io->ahead_state != AHEAD_READY && io->pos >= io->ahead_start &&
+         io->pos < io->ahead_start + io->win_cap) {
+    stats_add(preload_waits, 1);
+    pthread_cond_wait(&io->cond, &io->lock);
+  }
+
+  if (io->ahead_state == AHEAD_READY &&
+      io->pos >= io->ahead_start && io->pos < io->ahead_start + io->ahead_len) {
+    uint8_t *data = io->window;
+    int64_t start = io->win_start, len = io->win_len;
+    io->window = io->ahead;
+    io->win_start = io->ahead_start;
+    io->win_len = io->ahead_len;
+    io->ahead = data;
+    io->ahead_start = start;
+    io->ahead_len = len;
+    taken = 1;
+  }
+  pthread_mutex_unlock(&io->lock);
+  return taken;
+}
+
+// --io mmap: a page past the end of a file cut short while we play it
+// (re-tagged, synced) is a SIGBUS. the copy from the mapping jumps back
+// out of it, the file is read normally from there on
+static _Thread_local sigjmp_buf *volatile bus_guard; // the handler reads it: stores stay around the copy
+static struct sigaction bus_default;
+
+static void bus_handler(int sig, siginfo_t *info, void *ctx)
+{
+  if (bus_guard) siglongjmp(*bus_guard, 1);
+
+  // not one of our copies: what would have happened without us
+  sigaction(SIGBUS, &bus_default, NULL);
+  raise(sig);
+  (void)info;
+  (void)ctx;
+}
+
+static void bus_install(void)
+{
+  struct sigaction sa = { .sa_sigaction = bus_handler, .sa_flags = SA_SIGINFO };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGBUS, &sa, &bus_default);
+}
+
+// len bytes at pos from the mapping, -1 when the file got shorter: the
+// mapping is dropped and io is IO_READ
+static int map_copy(File_IO *io, uint8_t *buf, int len)
+{
+  sigjmp_buf jump;
+
+  // no mask saved: no syscall per read, the rare jump unblocks it itself
+  if (sigsetjmp(jump, 0)) {
+    bus_guard = NULL;
+    sigset_t bus;
+    sigemptyset(&bus);
+    sigaddset(&bus, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &bus, NULL);
+
+    warn("\nio: the file changed while playing, reading it normally");
+    munmap(io->window, io->size);
+    io->window = NULL;
+    io->win_start = io->win_len = 0;
+    io->mode = IO_READ;
+    return -1;
+  }
+
+  bus_guard = &jump;
+  atomic_signal_fence(memory_order_seq_cst);
+  memcpy(buf, io->window + (io->pos - io->win_start), len);
+  atomic_signal_fence(memory_order_seq_cst);
+  bus_guard = NULL;
+  return 0;
+}
+
+static int io_read(void *opaque, uint8_t *buf, int len)
+{
+  File_IO *io = opaque;
+  if (io->pos >= io->size) return AVERROR_EOF;
+
+  // from the readahead, the demuxer only waits when it outran it
+  if (io->mode == IO_URING) {
+    int n = uring_read(io->uring, buf, len, io->pos);
+    if (n != -EAGAIN) {
+      if (n < 0) return AVERROR(-n);
+      if (n == 0) return AVERROR_EOF;
+      io->pos += n;
+      return n;
+    }
+    // the ring is full of cancels: this once, the blocking way
+  }
+
+  // straight from the file, one syscall per AVIO buffer
+  if (io->mode == IO_READ || io->mode == IO_URING) {
+    ssize_t n;
+    do {
+      n = pread(io->fd, buf, len, io->pos);
+      stats_add(io_syscalls, 1);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) return AVERROR(errno);
+    if (n == 0) return AVERROR_EOF;
+    stats_add(io_bytes, n);
+    io->pos += n;
+    return n;
+  }
+
+  // out of the window: the next one is read ahead, a seek further away waits
+  if (io->pos < io->win_start || io->pos >= io->win_start + io->win_len) {
+    if (!(io->ahead && ahead_take(io)) &&
+        (io->fd < 0 || window_fill(io, io->pos) < 0))
+      return AVERROR(EIO);
+  }
+
+  int64_t left = io->win_start + io->win_len - io->pos;
+  if (len > left) len = left;
+
+  if (io->mode == IO_MMAP) {
+    if (map_copy(io, buf, len) < 0) return io_read(opaque, buf, len);
+    stats_add(io_bytes, len); // page faults, not syscalls
+  }
+  else
+    memcpy(buf, io->window + (io->pos - io->win_start), len);
+
+  io->pos += len;
+  if (io->ahead) ahead_ask(io);
+  return len;
+}
+
+static int64_t io_seek(void *opaque, int64_t offset, int whence)
+{
+  File_IO *io = opaque;
+
+  if (whence & AVSEEK_SIZE) return io->size;
+  whence &= ~AVSEEK_FORCE;
+
+  int64_t pos;
+  if (whence == SEEK_SET) pos = offset;
+  else if (whence == SEEK_CUR) pos = io->pos + offset;
+  else if (whence == SEEK_END) pos = io->size + offset;
+  else return AVERROR(EINVAL);
+
+  if (pos < 0) return AVERROR(EINVAL);
+  io->pos = pos;
+
+  // a real seek (handle_audio_seek): what was read ahead of the old position goes
+  if (io->uring) uring_seek(io->uring, pos);
+  return pos;
+}
+
+// the whole file mapped: the window never moves, the kernel reads ahead
+static int map_file(File_IO *io)
+{
+  static pthread_once_t bus_once = PTHREAD_ONCE_INIT;
+  pthread_once(&bus_once, bus_install);
+
+  void *map = mmap(NULL, io->size, PROT_READ, MAP_PRIVATE, io->fd, 0);
+  stats_add(io_syscalls, 1);
+  if (map == MAP_FAILED) return -1;
+
+  madvise(map, io->size, MADV_SEQUENTIAL);
+  stats_add(io_syscalls, 1);
+
+  io->window = map;
+  io->win_start = 0;
+  io->win_len = io->win_cap = io->size;
+  return 0;
+}
+
+// --preload: the first window (or all of it) before anything plays. a
+// bigger file gets two windows of half of MB and the helper thread
+static int preload_file(File_IO *io)
+{
+  int64_t cap = (int64_t)Options.preload_mb << 20;
+  if (io->size > cap) cap /= 2;
+  io->win_cap = io->size < cap ? io->size : cap;
+  io->window = malloc(io->win_cap);
+  if (!io->window || window_fill(io, 0) < 0) return -1;
+
+  if (io->win_len == io->size) return 0;
+
+  warn("preload: %lld of %lld MB in memory, the rest read ahead as it plays",
+       (long long)(2 * io->win_cap >> 20), (long long)(io->size >> 20));
+
+  io->asked_for = -1;
+  if (!(io->ahead = malloc(io->win_cap))) return -1;
+  if (pthread_create(&io->helper, NULL, ahead_run, io) != 0) {
+    free(io->ahead);
+    io->ahead = NULL; // windows are read when the demuxer gets there
+    return 0;
+  }
+  io->helper_running = 1;
+  return 0;
+}
+
+AVIOContext *fileio_open(const char *path, File_IO **out)
+{
+  *out = NULL;
+
+  int mode = Options.preload_mb > 0 ? -1 : Options.io_mode;
+  if (mode == IO_FFMPEG) return NULL;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  File_IO *io = calloc(1, sizeof(File_IO));
+  if (!io) {
+    close(fd);
+    return NULL;
+  }
+  io->mode = mode;
+  io->fd = fd;
+  io->size = st.st_size;
+  pthread_mutex_init(&io->lock, NULL);
+  pthread_cond_init(&io->cond, NULL);
+
+  int ret = 0;
+  if (mode == -1) ret = preload_file(io);
+  else if (mode == IO_MMAP) ret = map_file(io);
+  else if (mode == IO_URING && !(io->uring = uring_open(fd, io->size))) {
+    // the blocking path, say it once
+    static int warned;
+    if (!warned++) warn("io: no io_uring here, reading files normally");
+    io->mode = IO_READ;
+  }
+  else if (mode == IO_URING)
+    uring_seek(io->uring, 0); // the first reads go out before the demuxer asks
+
+  uint8_t *buffer = av_malloc(AVIO_BUFFER_SIZE);
+  if (ret < 0 || !buffer) {
+    av_free(buffer);
+    fileio_close(io);
+    return NULL;
+  }
+
+  // all of it is here: the descriptor is not needed anymore (a mapping
+  // keeps it, to read the file normally when it gets shorter)
+  if (io->window && io->win_len == io->size && io->mode != IO_MMAP) {
+    close(io->fd);
+    io->fd = -1;
+  }
+
+  io->avio = avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 0, io, io_read, NULL, io_seek);
+  if (!io->avio) {
+    av_free(buffer);
+    fileio_close(io);
+    return NULL;
+  }
+
+  *out = io;
+  return io->avio;
+}
+
+void fileio_close(File_IO *io)
+{
+  if (!io) return;
+
+  if (io->avio) {
+    av_freep(&io->avio->buffer);
+    avio_context_free(&io->avio);
+  }
+  uring_close(io->uring);
+
+  // the helper may be in a read of its window
+  if (io->helper_running) {
+    pthread_mutex_lock(&io->lock);
+      io->quit = 1;
+      pthread_cond_signal(&io->cond);
+    pthread_mutex_unlock(&io->lock);
+    pthread_join(io->helper, NULL);
+  }
+  pthread_mutex_destroy(&io->lock);
+  pthread_cond_destroy(&io->cond);
+  free(io->ahead);
+  if (io->fd >= 0) close(io->fd);
+
+  if (io->mode == IO_MMAP && io->window) munmap(io->window, io->size);
+  else free(io->window);
+  free(io);
+}
@@ -0,0 +1,29 @@
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <libavformat/avio.h>
+#include <stdint.h>
+
+// our own reading of the file for the demuxer (a custom AVIOContext)
+// instead of ffmpeg's file protocol.
+// --preload MB: the whole file, or a window of that size, is read into
+//   memory up front; the demuxer reads from there and the storage is only
+//   touched again when it leaves the window (NFS/SMB hiccups, disk spin down)
+// --io read: pread() for each read of the demuxer (like ffmpeg, but counted)
+// --io mmap: the file is mapped, reads are memcpy from the page cache
+// --io uring: large reads in flight ahead of the demuxer (uring.h), plain
+//   reads when the kernel doesn't let us have io_uring
+
+enum { IO_FFMPEG, IO_READ, IO_MMAP, IO_URING };
+
+// "ffmpeg", "read", "mmap", "uring" -> IO_*, -1 unknown
+int fileio_mode(const char *name);
+
+typedef struct File_IO File_IO;
+
+// NULL when there is nothing to do (no --preload, --io ffmpeg) or it
+// failed (not a regular file...): let ffmpeg open it
+AVIOContext *fileio_open(const char *path, File_IO **io);
+void fileio_close(File_IO *io);
+
+#endif
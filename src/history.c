@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "history.h"
+
+int history_init(Pcm_History *h, int seconds, int sample_rate, int frame_bytes)
+{
+  *h = (Pcm_History){ .frame_bytes = frame_bytes };
+  if (seconds <= 0 || frame_bytes <= 0) return 0;
+
+  h->capacity = (int64_t)seconds * sample_rate;
+  h->data = malloc(h->capacity * frame_bytes);
+  if (!h->data) {
+    h->capacity = 0;
+    return -1;
+  }
+  return 0;
+}
+
+void history_destroy(Pcm_History *h)
+{
+  free(h->data);
+  *h = (Pcm_History){0};
+}
+
+void history_reset(Pcm_History *h)
+{
+  h->filled = 0;
+  h->write_pos = 0;
+  h->end = 0;
+}
+
+void history_append(Pcm_History *h, const uint8_t *pcm, int64_t samples, int64_t start)
+{
+  if (!h->data || samples <= 0) return;
+
+  // not the continuation of what we have: it can't be replayed as one piece
+  if (h->filled && start != h->end)
+    history_reset(h);
+
+  h->end = start + samples;
+
+  // more than fits: only the newest part matters
+  if (samples > h->capacity) {
+    pcm += (samples - h->capacity) * h->frame_bytes;
+    samples = h->capacity;
+  }
+
+  int64_t until_end = h->capacity - h->write_pos;
+  int64_t first = samples < until_end ? samples : until_end;
+
+  memcpy(h->data + h->write_pos * h->frame_bytes, pcm, first * h->frame_bytes);
+  if (samples > first)
+    memcpy(h->data, pcm + first * h->frame_bytes, (samples - first) * h->frame_bytes);
+
+  h->write_pos = (h->write_pos + samples) % h->capacity;
+  h->filled += samples;
+  if (h->filled > h->capacity) h->filled = h->capacity;
+}
+
+int history_has(const Pcm_History *h, int64_t position)
+{
+  return h->filled && position >= h->end - h->filled && position < h->end;
+}
+
+int64_t history_peek(const Pcm_History *h, int64_t position, int64_t max, const uint8_t **pcm)
+{
+  if (!history_has(h, position)) return 0;
+
+  // ring slot of position: count back from the write position
+  int64_t back = h->end - position;
+  int64_t slot = (h->write_pos - back + h->capacity) % h->capacity;
+
+  int64_t count = back;
+  if (count > h->capacity - slot) count = h->capacity - slot; // up to the wrap
+  if (count > max) count = max;
+
+  *pcm = h->data + slot * h->frame_bytes;
+  return count;
+}
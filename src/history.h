@@ -0,0 +1,38 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the last seconds of played audio, as interleaved PCM at the file rate
+// (after the format conversion, before the speed one). short rewinds are
+// replayed from here without touching the demuxer or the codec.
+// decoder thread only.
+typedef struct {
+  uint8_t *data;
+  int64_t capacity;            // in samples (per channel)
+  int64_t write_pos;           // next sample slot
+  int64_t filled;              // samples stored
+  int64_t end;                 // file position right after the newest sample
+  int frame_bytes;             // bytes of one sample of all channels
+
+} Pcm_History;
+
+// seconds <= 0 disables it (every call is then a no-op/miss)
+int history_init(Pcm_History *h, int seconds, int sample_rate, int frame_bytes);
+void history_destroy(Pcm_History *h);
+
+// forget everything, the next append starts a new run
+void history_reset(Pcm_History *h);
+
+// add samples which start at file position start, a gap resets it
+void history_append(Pcm_History *h, const uint8_t *pcm, int64_t samples, int64_t start);
+
+// 1 when position can be replayed
+int history_has(const Pcm_History *h, int64_t position);
+
+// contiguous samples from position, up to max: no copy, the pointer is
+// valid until the next append. 0 when position is not (or no more) stored
+int64_t history_peek(const Pcm_History *h, int64_t position, int64_t max, const uint8_t **pcm);
+
+#endif
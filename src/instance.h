@@ -0,0 +1,64 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+// per-instance runtime files (control socket, ...)
+// shared by the player and the clients, so keep this header libc only
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define INSTANCE_PREFIX "tomu-"
+#define INSTANCE_SOCK_SUFFIX ".sock"
+
+// directory holding the runtime files of every tomu instance of this user
+// $XDG_RUNTIME_DIR/tomu, or /tmp/tomu-<uid> when there is no runtime dir
+static inline int instance_dir(char *out, size_t len)
+{
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  int n;
+
+  if (runtime && runtime[0])
+    n = snprintf(out, len, "%s/tomu", runtime);
+  else
+    n = snprintf(out, len, "/tmp/tomu-%u", (unsigned)getuid());
+
+  if (n < 0 || (size_t)n >= len) return -1;
+
+  // only the owner may talk to its players
+  if (mkdir(out, 0700) < 0) {
+    struct stat st;
+    if (stat(out, &st) < 0 || !S_ISDIR(st.st_mode)) return -1;
+  }
+  return 0;
+}
+
+// <dir>/tomu-<pid><suffix>
+static inline int instance_path(char *out, size_t len, pid_t pid, const char *suffix)
+{
+  char dir[256];
+  if (instance_dir(dir, sizeof(dir)) < 0) return -1;
+
+  int n = snprintf(out, len, "%s/" INSTANCE_PREFIX "%d%s", dir, (int)pid, suffix);
+  return (n < 0 || (size_t)n >= len) ? -1 : 0;
+}
+
+// parse the pid back out of a directory entry name, 0 when it isn't ours
+static inline pid_t instance_pid(const char *name, const char *suffix)
+{
+  size_t plen = strlen(INSTANCE_PREFIX), slen = strlen(suffix), len = strlen(name);
+
+  if (len <= plen + slen || strncmp(name, INSTANCE_PREFIX, plen) != 0 ||
+      strcmp(name + len - slen, suffix) != 0)
+    return 0;
+
+  char *end;
+  long pid = strtol(name + plen, &end, 10);
+  if (end != name + len - slen || pid <= 0) return 0;
+  return (pid_t)pid;
+}
+
+#endif
@@ -0,0 +1,733 @@
+#include <fcntl.h>
+#include <libswresample/swresample.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "diskcache.h"
+#include "library.h"
+#include "stats.h"
+
+#define LIBRARY_MAGIC   0x62696c74 // "tlib"
+#define LIBRARY_VERSION 2
+
+#if LIBSWRESAMPLE_VERSION_MAJOR <= 3
+  #define LEGACY_LIBRARY_CHANNELS
+#endif
+
+// the file: header, folders (sorted by name), their subfolders (indexes
+// of folders), files (grouped by folder, sorted by name in it), the files
+// in name order (their indexes), strings.
+// names and tags are offsets in the strings, 0 is "" (none)
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t dir_count, sub_count, file_count;
+  uint32_t strings_len;
+  uint64_t dirs_off, subs_off, files_off, order_off, strings_off;
+
+} Library_Header;
+
+typedef struct {
+  uint32_t name;
+  uint32_t file_first, file_count;
+  uint32_t sub_first, sub_count;
+  uint32_t pad;
+  int64_t mtime;
+
+} Library_Dir;
+
+typedef struct {
+  uint32_t name;
+  int32_t kind;
+  int64_t mtime, size;
+  int32_t known;
+  int32_t duration_ms, sample_rate, channels;
+  char codec[16];
+  uint32_t title, artist, album;
+  uint32_t dir;                 // the folder it is in
+
+} Library_File;
+
+// the index being read (mapped)
+typedef struct {
+  const Library_Header *head;
+  const Library_Dir *dirs;
+  const uint32_t *subs;
+  const Library_File *files;
+  const uint32_t *order;
+  const char *strings;
+  unsigned char *keep;          // per folder: it didn't change (map_known)
+  atomic_int reused;
+
+} Library_Map;
+
+// the index is per folder, keyed on its real path alone (its mtime
+// changes, diskcache_key would give it a new name every time)
+static int index_path(char *out, size_t len, const char *root)
+{
+  char real[PATH_MAX], dir[900];
+  if (!realpath(root, real) || diskcache_dir("library", dir, sizeof(dir)) < 0) return -1;
+
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const char *p = real; *p; p++)
+    hash = (hash ^ (unsigned char)*p) * 0x100000001b3ULL;
+
+  int n = snprintf(out, len, "%s/%016llx.idx", dir, (unsigned long long)hash);
+  return (n < 0 || (size_t)n >= len) ? -1 : 0;
+}
+
+static int64_t now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// ===================== reading =====================
+
+static const char *map_str(const Library_Map *m, uint32_t off)
+{
+  return off < m->head->strings_len ? m->strings + off : "";
+}
+
+static int map_open(Library *lib, Library_Map *m, const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+
+  struct stat st;
+  void *map = fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Library_Header)
+            ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED) return -1;
+
+  const Library_Header *h = map;
+  uint64_t len = st.st_size;
+  int ok = h->magic == LIBRARY_MAGIC && h->version == LIBRARY_VERSION &&
+           h->dirs_off + (uint64_t)h->dir_count * sizeof(Library_Dir) <= len &&
+           h->subs_off + (uint64_t)h->sub_count * sizeof(uint32_t) <= len &&
+           h->files_off + (uint64_t)h->file_count * sizeof(Library_File) <= len &&
+           h->order_off + (uint64_t)h->file_count * sizeof(uint32_t) <= len &&
+           h->strings_off + h->strings_len <= len && h->strings_len > 0 &&
+           ((const char*)map)[h->strings_off + h->strings_len - 1] == '\0';
+
+  // ranges out of the tables would be read past them
+  const Library_Dir *dirs = (const Library_Dir*)((const char*)map + h->dirs_off);
+  for (uint32_t i = 0; ok && i < h->dir_count; i++)
+    ok = (uint64_t)dirs[i].file_first + dirs[i].file_count <= h->file_count &&
+         (uint64_t)dirs[i].sub_first + dirs[i].sub_count <= h->sub_count;
+  const uint32_t *subs = (const uint32_t*)((const char*)map + h->subs_off);
+  for (uint32_t i = 0; ok && i < h->sub_count; i++)
+    ok = subs[i] < h->dir_count;
+
+  // a file is in the range of its folder: no two folders share one
+  const Library_File *files = (const Library_File*)((const char*)map + h->files_off);
+  for (uint32_t i = 0; ok && i < h->file_count; i++)
+    ok = files[i].dir < h->dir_count && i >= dirs[files[i].dir].file_first &&
+         i - dirs[files[i].dir].file_first < dirs[files[i].dir].file_count;
+  const uint32_t *order = (const uint32_t*)((const char*)map + h->order_off);
+  for (uint32_t i = 0; ok && i < h->file_count; i++)
+    ok = order[i] < h->file_count;
+
+  if (!ok) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  lib->map = map;
+  lib->map_len = st.st_size;
+  m->head = h;
+  m->dirs = dirs;
+  m->subs = subs;
+  m->files = files;
+  m->order = order;
+  m->strings = (const char*)map + h->strings_off;
+  return 0;
+}
+
+// the folder name (len bytes of it), -1 when the index has none
+static int map_dir(const Library_Map *m, const char *name, size_t len)
+{
+  int lo = 0, hi = m->head ? (int)m->head->dir_count - 1 : -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    const char *d = map_str(m, m->dirs[mid].name);
+    int cmp = strncmp(name, d, len);
+    if (cmp == 0 && d[len]) cmp = -1;
+    if (cmp == 0) return mid;
+    if (cmp < 0) hi = mid - 1;
+    else lo = mid + 1;
+  }
+  return -1;
+}
+
+// the folder part of an entry name ("" at the root)
+static size_t dir_len(const char *name)
+{
+  const char *slash = strrchr(name, '/');
+  return slash ? (size_t)(slash - name) : 0;
+}
+
+static const Library_File *map_file(const Library_Map *m, int dir, const char *name)
+{
+  int lo = m->dirs[dir].file_first, hi = lo + m->dirs[dir].file_count - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    int cmp = strcmp(name, map_str(m, m->files[mid].name));
+    if (cmp == 0) return &m->files[mid];
+    if (cmp < 0) hi = mid - 1;
+    else lo = mid + 1;
+  }
+  return NULL;
+}
+
+// scan.h: a folder which didn't change is what the index has. its files
+// are taken from the index by library_open, its subfolders are checked
+static int map_known(void *ctx, Scan_Sink *sink, const char *rel, int64_t mtime)
+{
+  Library_Map *m = ctx;
+  int dir = map_dir(m, rel, strlen(rel));
+  if (dir < 0 || m->dirs[dir].mtime != mtime) return 0;
+
+  const Library_Dir *d = &m->dirs[dir];
+  for (uint32_t i = 0; i < d->sub_count; i++)
+    scan_keep(sink, map_str(m, m->dirs[m->subs[d->sub_first + i]].name), SCAN_DIR);
+
+  // a folder is scanned by one thread, read after they are joined
+  m->keep[dir] = 1;
+  atomic_fetch_add(&m->reused, 1);
+  return 1;
+}
+
+static const char *tag_or_null(const Library_Map *m, uint32_t off)
+{
+  const char *s = map_str(m, off);
+  return s[0] ? s : NULL;
+}
+
+// ===================== writing =====================
+
+typedef struct {
+  char *data;
+  uint64_t len, cap;
+  int failed;
+
+} Strings;
+
+// offset 0 is the "" every missing tag points at
+static int strings_init(Strings *s)
+{
+  s->cap = 1 << 16;
+  s->data = malloc(s->cap);
+  if (!s->data) return -1;
+  s->data[0] = '\0';
+  s->len = 1;
+  return 0;
+}
+
+static uint32_t strings_add(Strings *s, const char *text)
+{
+  if (!text || !text[0]) return 0;
+
+  size_t n = strlen(text) + 1;
+  if (s->len + n > UINT32_MAX) {
+    s->failed = 1;
+    return 0;
+  }
+  if (s->len + n > s->cap) {
+    uint64_t cap = s->cap;
+    while (cap < s->len + n) cap *= 2;
+    char *tmp = realloc(s->data, cap);
+    if (!tmp) {
+      s->failed = 1;
+      return 0;
+    }
+    s->data = tmp;
+    s->cap = cap;
+  }
+  memcpy(s->data + s->len, text, n);
+  s->len += n;
+  return s->len - n;
+}
+
+// the folder of index dirs (sorted Scan_Entry) with this name, -1 none
+static int dir_find(const Scan_Entry *dirs, int count, const char *name, size_t len)
+{
+  int lo = 0, hi = count - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    int cmp = strncmp(name, dirs[mid].name, len);
+    if (cmp == 0 && dirs[mid].name[len]) cmp = -1;
+    if (cmp == 0) return mid;
+    if (cmp < 0) hi = mid - 1;
+    else lo = mid + 1;
+  }
+  return -1;
+}
+
+// the records are made under lib->lock (the threads which learn tracks
+// wait), the file is written after
+static int library_save(Library *lib)
+{
+  char path[1024], tmp[1100];
+  if (index_path(path, sizeof(path), lib->root) < 0) return -1;
+  snprintf(tmp, sizeof(tmp), "%s.tmp%d", path, (int)getpid());
+
+  int dirs = lib->dir_count, files = lib->count;
+  Library_Dir *drec = calloc(dirs ? dirs : 1, sizeof(Library_Dir));
+  Library_File *frec = calloc(files ? files : 1, sizeof(Library_File));
+  uint32_t *subs = calloc(dirs ? dirs : 1, sizeof(uint32_t));
+  uint32_t *order = calloc(files ? files : 1, sizeof(uint32_t));
+  int *file_dir = calloc(files ? files : 1, sizeof(int));
+  int *parent = calloc(dirs ? dirs : 1, sizeof(int));
+  Strings strings = {0};
+  int ok = drec && frec && subs && order && file_dir && parent && strings_init(&strings) == 0;
+
+  // what is learnt from here on is saved the next time
+  pthread_mutex_lock(&lib->lock);
+  atomic_store(&lib->dirty, 0);
+
+  // files by folder, in the order they are sorted in (by name)
+  for (int i = 0; ok && i < files; i++) {
+    file_dir[i] = dir_find(lib->dirs, dirs, lib->tracks[i].name, dir_len(lib->tracks[i].name));
+    if (file_dir[i] >= 0) drec[file_dir[i]].file_count++;
+  }
+  for (int i = 0, first = 0; ok && i < dirs; i++) {
+    drec[i].file_first = first;
+    first += drec[i].file_count;
+    drec[i].file_count = 0;
+  }
+
+  int written = 0;
+  for (int i = 0; ok && i < files; i++) {
+    Library_Track *t = &lib->tracks[i];
+    if (file_dir[i] < 0) continue;
+    Library_Dir *d = &drec[file_dir[i]];
+    Library_File *f = &frec[d->file_first + d->file_count++];
+    order[written++] = f - frec;
+
+    f->name = strings_add(&strings, t->name);
+    f->kind = t->kind;
+    f->dir = file_dir[i];
+    f->mtime = t->mtime;
+    f->size = t->size;
+    if (library_known(t)) {
+      f->known = 1;
+      f->duration_ms = t->duration_ms;
+      f->sample_rate = t->sample_rate;
+      f->channels = t->channels;
+      memcpy(f->codec, t->codec, sizeof(f->codec));
+      const Library_Tags *tags = library_tags(t);
+      if (tags) {
+        f->title = strings_add(&strings, tags->title);
+        f->artist = strings_add(&strings, tags->artist);
+        f->album = strings_add(&strings, tags->album);
+      }
+    }
+  }
+
+  // subfolders: the root has no parent
+  for (int i = 0; ok && i < dirs; i++) {
+    const char *name = lib->dirs[i].name;
+    parent[i] = name[0] ? dir_find(lib->dirs, dirs, name, dir_len(name)) : -1;
+    if (parent[i] >= 0) drec[parent[i]].sub_count++;
+  }
+  for (int i = 0, first = 0; ok && i < dirs; i++) {
+    drec[i].sub_first = first;
+    first += drec[i].sub_count;
+    drec[i].sub_count = 0;
+  }
+  int sub_count = 0;
+  for (int i = 0; ok && i < dirs; i++) {
+    drec[i].name = strings_add(&strings, lib->dirs[i].name);
+    drec[i].mtime = lib->dirs[i].mtime;
+    if (parent[i] < 0) continue;
+    Library_Dir *p = &drec[parent[i]];
+    subs[p->sub_first + p->sub_count++] = i;
+    sub_count++;
+  }
+  pthread_mutex_unlock(&lib->lock);
+
+  ok &= !strings.failed;
+  Library_Header head = {
+    .magic = LIBRARY_MAGIC,
+    .version = LIBRARY_VERSION,
+    .dir_count = dirs,
+    .sub_count = sub_count,
+    .file_count = written,
+    .strings_len = strings.len,
+  };
+  head.dirs_off = sizeof(head);
+  head.subs_off = head.dirs_off + (uint64_t)dirs * sizeof(Library_Dir);
+  head.files_off = head.subs_off + (uint64_t)sub_count * sizeof(uint32_t);
+  head.files_off = (head.files_off + 7) & ~7ULL;
+  head.order_off = head.files_off + (uint64_t)written * sizeof(Library_File);
+  head.strings_off = head.order_off + (uint64_t)written * sizeof(uint32_t);
+
+  FILE *f = ok ? fopen(tmp, "w") : NULL;
+  ok = f != NULL;
+  static const char zero[8];
+  ok = ok && fwrite(&head, sizeof(head), 1, f) == 1 &&
+       fwrite(drec, sizeof(Library_Dir), dirs, f) == (size_t)dirs &&
+       fwrite(subs, sizeof(uint32_t), sub_count, f) == (size_t)sub_count &&
+       fwrite(zero, 1, head.files_off - head.subs_off - sub_count * sizeof(uint32_t), f) ==
+         head.files_off - head.subs_off - sub_count * sizeof(uint32_t) &&
+       fwrite(frec, sizeof(Library_File), written, f) == (size_t)written &&
+       fwrite(order, sizeof(uint32_t), written, f) == (size_t)written &&
+       fwrite(strings.data, 1, strings.len, f) == strings.len;
+  if (f) ok &= fclose(f) == 0;
+
+  if (ok && rename(tmp, path) == 0)
+    stats_add(library_saves, 1);
+  else {
+    unlink(tmp);
+    atomic_store(&lib->dirty, 1);
+    ok = 0;
+  }
+
+  free(drec);
+  free(frec);
+  free(subs);
+  free(order);
+  free(file_dir);
+  free(parent);
+  free(strings.data);
+  return ok ? 0 : -1;
+}
+
+// ===================== the library =====================
+
+static void track_from_map(Library_Track *t, const Library_Map *m, const Library_File *f)
+{
+  if (!f->known) return;
+  t->duration_ms = f->duration_ms;
+  t->sample_rate = f->sample_rate;
+  t->channels = f->channels;
+  memcpy(t->codec, f->codec, sizeof(t->codec));
+  t->codec[sizeof(t->codec) - 1] = '\0';
+  t->mapped.title = tag_or_null(m, f->title);
+  t->mapped.artist = tag_or_null(m, f->artist);
+  t->mapped.album = tag_or_null(m, f->album);
+  if (t->mapped.title || t->mapped.artist || t->mapped.album)
+    atomic_store(&t->tags, &t->mapped);
+  atomic_store(&t->state, LIBRARY_KNOWN);
+}
+
+static void file_stat(const char *root, const char *name, int64_t *mtime, int64_t *size)
+{
+  char full[PATH_MAX];
+  struct stat st;
+  *mtime = *size = 0;
+  if (snprintf(full, sizeof(full), "%s/%s", root, name) >= (int)sizeof(full) || stat(full, &st) < 0) return;
+  *mtime = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  *size = st.st_size;
+}
+
+// a file of a folder read again: what the index knew of it is kept when
+// the file has the mtime and size it had
+static void track_found(Library_Track *t, const Library_Map *m, const char *root, const Scan_Entry *e)
+{
+  t->name = e->name;
+  t->kind = e->kind;
+  file_stat(root, t->name, &t->mtime, &t->size);
+
+  int dir = m->head ? map_dir(m, t->name, dir_len(t->name)) : -1;
+  const Library_File *f = dir >= 0 ? map_file(m, dir, t->name) : NULL;
+  if (f && f->mtime == t->mtime && f->size == t->size)
+    track_from_map(t, m, f);
+}
+
+// names (and tags) of the folders kept point in the map
+static int map_has(const Library *lib, const char *p)
+{
+  return lib->map && p >= (const char*)lib->map && p < (const char*)lib->map + lib->map_len;
+}
+
+Library *library_open(const char *root)
+{
+  int64_t start = now_ms();
+  Library *lib = calloc(1, sizeof(Library));
+  if (!lib) return NULL;
+  snprintf(lib->root, sizeof(lib->root), "%s", root);
+  pthread_mutex_init(&lib->lock, NULL);
+
+  char path[1024];
+  Library_Map m = {0};
+  if (index_path(path, sizeof(path), root) == 0 && map_open(lib, &m, path) == 0) {
+    stats_add(library_loads, 1);
+    if (!(m.keep = calloc(m.head->dir_count ? m.head->dir_count : 1, 1))) m.head = NULL;
+  }
+  int map_dirs = m.head ? m.head->dir_count : 0;
+  int map_files = m.head ? m.head->file_count : 0;
+
+  int count;
+  Scan_Entry *found = scan_tree(root, m.head ? map_known : NULL, &m, &count);
+  if (!found) {
+    free(m.keep);
+    library_close(lib);
+    return NULL;
+  }
+
+  // the folders which didn't change (and their files) come from the
+  // index, the scan has the ones it read
+  int dirs = 0, files = 0;
+  for (int i = 0; i < map_dirs; i++)
+    if (m.keep[i]) {
+      dirs++;
+      files += m.dirs[i].file_count;
+    }
+  for (int i = 0; i < count; i++) {
+    if (found[i].kind == SCAN_DIR) dirs++;
+    else files++;
+  }
+  lib->dirs = malloc((dirs ? dirs : 1) * sizeof(Scan_Entry));
+  lib->tracks = calloc(files ? files : 1, sizeof(Library_Track));
+  if (!lib->dirs || !lib->tracks) {
+    for (int i = 0; i < count; i++) free(found[i].name);
+    free(found);
+    free(m.keep);
+    library_close(lib);
+    return NULL;
+  }
+
+  // both are sorted by name (the index has its files in name order too):
+  // they are merged, nothing is sorted again or looked up
+  for (int i = 0, j = 0;;) {
+    while (i < map_dirs && !m.keep[i]) i++;
+    while (j < count && found[j].kind != SCAN_DIR) j++;
+    if (i == map_dirs && j == count) break;
+
+    const char *name = i < map_dirs ? map_str(&m, m.dirs[i].name) : NULL;
+    if (name && (j == count || strcmp(name, found[j].name) < 0)) {
+      lib->dirs[lib->dir_count++] = (Scan_Entry){ (char*)name, SCAN_DIR, m.dirs[i].mtime };
+      i++;
+    }
+    else lib->dirs[lib->dir_count++] = found[j++];
+  }
+
+  for (int i = 0, j = 0; lib->count < files;) {
+    while (i < map_files && !m.keep[m.files[m.order[i]].dir]) i++;
+    while (j < count && found[j].kind == SCAN_DIR) j++;
+    if (i == map_files && j == count) break;
+
+    Library_Track *t = &lib->tracks[lib->count++];
+    const Library_File *f = i < map_files ? &m.files[m.order[i]] : NULL;
+    if (f && (j == count || strcmp(map_str(&m, f->name), found[j].name) < 0)) {
+      t->name = (char*)map_str(&m, f->name);
+      t->kind = f->kind;
+      t->mtime = f->mtime;
+      t->size = f->size;
+      track_from_map(t, &m, f);
+      i++;
+    }
+    else track_found(t, &m, root, &found[j++]);
+  }
+  free(found);
+  free(m.keep);
+
+  // saved by the prober (library_probe_start), or by library_close
+  int reused = atomic_load(&m.reused);
+  stats_add(library_dirs_reused, reused);
+  if (count > 0 || reused != map_dirs)
+    atomic_store(&lib->dirty, 1);
+  stats_add(library_load_ms, now_ms() - start);
+  return lib;
+}
+
+Library_Track *library_find(Library *lib, const char *name)
+{
+  if (!lib) return NULL;
+  int lo = 0, hi = lib->count - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    int cmp = strcmp(name, lib->tracks[mid].name);
+    if (cmp == 0) return &lib->tracks[mid];
+    if (cmp < 0) hi = mid - 1;
+    else lo = mid + 1;
+  }
+  return NULL;
+}
+
+int library_known(const Library_Track *track)
+{
+  return track && atomic_load_explicit(&((Library_Track*)track)->state, memory_order_acquire) == LIBRARY_KNOWN;
+}
+
+const Library_Tags *library_tags(const Library_Track *track)
+{
+  return track ? atomic_load_explicit(&((Library_Track*)track)->tags, memory_order_acquire) : NULL;
+}
+
+static const char *tag(AVFormatContext *fmtCTX, AVStream *st, const char *key)
+{
+  // ogg and opus keep the tags on the stream
+  AVDictionaryEntry *e = av_dict_get(fmtCTX->metadata, key, NULL, 0);
+  if (!e && st) e = av_dict_get(st->metadata, key, NULL, 0);
+  return e && e->value[0] ? e->value : NULL;
+}
+
+static const char *tags_copy(char **to, const char *text)
+{
+  if (!text) return NULL;
+  size_t n = strlen(text) + 1;
+  memcpy(*to, text, n);
+  *to += n;
+  return *to - n;
+}
+
+// the tags of an open file in one block (the strings follow the struct),
+// NULL when it has none
+static Library_Tags *tags_new(AVFormatContext *fmtCTX, AVStream *st)
+{
+  const char *title = tag(fmtCTX, st, "title");
+  const char *artist = tag(fmtCTX, st, "artist");
+  const char *album = tag(fmtCTX, st, "album");
+  if (!title && !artist && !album) return NULL;
+
+  size_t len = sizeof(Library_Tags) + (title ? strlen(title) + 1 : 0) +
+               (artist ? strlen(artist) + 1 : 0) + (album ? strlen(album) + 1 : 0);
+  Library_Tags *tags = malloc(len);
+  if (!tags) return NULL;
+
+  char *text = (char*)(tags + 1);
+  tags->title = tags_copy(&text, title);
+  tags->artist = tags_copy(&text, artist);
+  tags->album = tags_copy(&text, album);
+  return tags;
+}
+
+// lib->lock is held
+static void garbage_add(Library *lib, Library_Tags *tags)
+{
+  Library_Tags **tmp = realloc(lib->garbage, (lib->garbage_count + 1) * sizeof(Library_Tags*));
+  if (tmp) {
+    lib->garbage = tmp;
+    lib->garbage[lib->garbage_count++] = tags;
+  }
+}
+
+// the track is ours (LIBRARY_PROBING), lib->lock is held (library_save
+// reads it): fill it from the open file
+static void track_fill(Library *lib, Library_Track *t, AVFormatContext *fmtCTX, int stream)
+{
+  AVStream *st = fmtCTX && stream >= 0 && stream < (int)fmtCTX->nb_streams ? fmtCTX->streams[stream] : NULL;
+
+  t->duration_ms = t->sample_rate = t->channels = 0;
+  t->codec[0] = '\0';
+
+  // the new tags are complete before readers see them, the old ones may
+  // be in their hands: they are freed by library_close
+  const Library_Tags *old = atomic_exchange(&t->tags, fmtCTX ? tags_new(fmtCTX, st) : NULL);
+  if (old && old != &t->mapped) garbage_add(lib, (Library_Tags*)old);
+
+  if (fmtCTX) {
+    if (fmtCTX->duration > 0)
+      t->duration_ms = fmtCTX->duration / 1000;
+    else if (st && st->duration > 0)
+      t->duration_ms = av_rescale_q(st->duration, st->time_base, (AVRational){1, 1000});
+  }
+  if (st) {
+    t->sample_rate = st->codecpar->sample_rate;
+    #ifdef LEGACY_LIBRARY_CHANNELS
+      t->channels = st->codecpar->channels;
+    #else
+      t->channels = st->codecpar->ch_layout.nb_channels;
+    #endif
+    snprintf(t->codec, sizeof(t->codec), "%s", avcodec_get_name(st->codecpar->codec_id));
+  }
+
+  atomic_store_explicit(&t->state, LIBRARY_KNOWN, memory_order_release);
+  atomic_store(&lib->dirty, 1);
+}
+
+void library_learn(Library *lib, Library_Track *track, AVFormatContext *fmtCTX, int stream)
+{
+  if (!lib || !track || !fmtCTX) return;
+
+  int64_t mtime, size;
+  file_stat(lib->root, track->name, &mtime, &size);
+
+  int state = LIBRARY_UNKNOWN;
+  if (!atomic_compare_exchange_strong(&track->state, &state, LIBRARY_PROBING)) {
+    // known as it was before it changed: it is learnt again
+    if (state != LIBRARY_KNOWN || (mtime == track->mtime && size == track->size)) return;
+    if (!atomic_compare_exchange_strong(&track->state, &state, LIBRARY_PROBING)) return;
+  }
+  pthread_mutex_lock(&lib->lock);
+  track->mtime = mtime;
+  track->size = size;
+  track_fill(lib, track, fmtCTX, stream);
+  pthread_mutex_unlock(&lib->lock);
+}
+
+// saves what library_open found changed, then probes: headers only, no
+// avformat_find_stream_info, nothing is decoded
+static void *library_prober(void *arg)
+{
+  Library *lib = arg;
+  if (atomic_load(&lib->dirty))
+    library_save(lib);
+
+  for (int i = 0; i < lib->count && !atomic_load(&lib->stop); i++) {
+    Library_Track *t = &lib->tracks[i];
+    int state = LIBRARY_UNKNOWN;
+    if (t->kind != SCAN_AUDIO || !atomic_compare_exchange_strong(&t->state, &state, LIBRARY_PROBING))
+      continue;
+
+    char full[PATH_MAX];
+    AVFormatContext *fmtCTX = NULL;
+    if (snprintf(full, sizeof(full), "%s/%s", lib->root, t->name) >= (int)sizeof(full) ||
+        avformat_open_input(&fmtCTX, full, NULL, NULL) < 0)
+      fmtCTX = NULL;
+
+    int stream = fmtCTX ? av_find_best_stream(fmtCTX, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0) : -1;
+    pthread_mutex_lock(&lib->lock);
+    track_fill(lib, t, fmtCTX, stream);
+    pthread_mutex_unlock(&lib->lock);
+    if (fmtCTX) avformat_close_input(&fmtCTX);
+    stats_add(library_probes, 1);
+  }
+  return NULL;
+}
+
+void library_probe_start(Library *lib)
+{
+  if (!lib || lib->probing) return;
+  av_log_set_level(AV_LOG_QUIET);
+  lib->probing = pthread_create(&lib->prober, NULL, library_prober, lib) == 0;
+}
+
+void library_close(Library *lib)
+{
+  if (!lib) return;
+
+  if (lib->probing) {
+    atomic_store(&lib->stop, 1);
+    pthread_join(lib->prober, NULL);
+  }
+  if (atomic_load(&lib->dirty))
+    library_save(lib);
+
+  for (int i = 0; i < lib->count; i++) {
+    Library_Track *t = &lib->tracks[i];
+    if (!map_has(lib, t->name)) free(t->name);
+    const Library_Tags *tags = library_tags(t);
+    if (tags != &t->mapped) free((Library_Tags*)tags);
+  }
+  for (int i = 0; i < lib->dir_count; i++)
+    if (!map_has(lib, lib->dirs[i].name)) free(lib->dirs[i].name);
+  for (int i = 0; i < lib->garbage_count; i++)
+    free(lib->garbage[i]);
+
+  if (lib->map) munmap(lib->map, lib->map_len);
+  pthread_mutex_destroy(&lib->lock);
+  free(lib->garbage);
+  free(lib->tracks);
+  free(lib->dirs);
+  free(lib);
+}
@@ -0,0 +1,100 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <libavformat/avformat.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "scan.h"
+
+// library index of a folder played: what the scan (scan.h) found under it,
+// the mtime and size of every file, its duration, codec, rate, channels
+// and tags. kept in $XDG_CACHE_HOME/tomu/library, a file per folder (by
+// its path), mapped and not parsed: the next start reads again only the
+// folders whose mtime changed (an entry added, removed or renamed in
+// them), the rest comes from the index as it was.
+// a file rewritten in place doesn't change its folder: its record is
+// checked again when it plays. files not known yet are probed by a thread
+// in the background (headers only, nothing is decoded)
+
+enum { LIBRARY_UNKNOWN, LIBRARY_PROBING, LIBRARY_KNOWN };
+
+// the tags of a track, replaced as a whole when it is learnt again
+typedef struct {
+  const char *title, *artist, *album;  // NULL when the file has none
+
+} Library_Tags;
+
+typedef struct {
+  char *name;                   // from the folder: "disc1/01.flac"
+  int kind;                     // SCAN_AUDIO, SCAN_ARCHIVE, SCAN_CUE
+  int64_t mtime, size;          // of the file (mtime in ns)
+
+  // the rest is only read once state is LIBRARY_KNOWN
+  atomic_int state;
+  int32_t duration_ms;
+  int32_t sample_rate;
+  int32_t channels;
+  char codec[16];
+
+  // library_tags(): &mapped (they are in the mapped index), one of ours,
+  // NULL when there are none. a reader keeps what it loaded
+  _Atomic(const Library_Tags*) tags;
+  Library_Tags mapped;
+
+} Library_Track;
+
+typedef struct Library {
+  char root[PATH_MAX];
+  Library_Track *tracks;        // sorted by name
+  int count;
+  Scan_Entry *dirs;             // the folders and their mtime, sorted by name
+  int dir_count;
+
+  // the index we started from: names and tags of the folders which
+  // didn't change point in it
+  void *map;
+  size_t map_len;
+
+  // held to learn a track and by library_save. guards garbage: tags
+  // replaced while playing, readers may still hold them
+  pthread_mutex_t lock;
+  Library_Tags **garbage;
+  int garbage_count;
+
+  pthread_t prober;
+  int probing;
+  atomic_int stop;
+  atomic_int dirty;             // differs from the index on disk
+
+} Library;
+
+// the index of root brought up to date, NULL when root can't be read.
+// a folder which didn't change costs a stat: its files are served from
+// the mapped index as they are
+Library *library_open(const char *root);
+
+// in the background: save the index when library_open changed it, then
+// probe the files not known yet
+void library_probe_start(Library *lib);
+
+// the track of an entry name, NULL when it isn't one (archive entries, CUE tracks)
+Library_Track *library_find(Library *lib, const char *name);
+
+// the file of track is open (stream: its audio): learn it when the
+// index doesn't know it, or knew it before it changed
+void library_learn(Library *lib, Library_Track *track, AVFormatContext *fmtCTX, int stream);
+
+// the fields after state can be read (never for a NULL track)
+int library_known(const Library_Track *track);
+
+// the tags of track, NULL when it has none (or is NULL). they stay
+// readable until library_close, a track learnt again gets new ones
+const Library_Tags *library_tags(const Library_Track *track);
+
+// stop the prober, save what it learnt, free
+void library_close(Library *lib);
+
+#endif
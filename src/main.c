@@ -1,13 +1,19 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/prctl.h>
 
 // #include "control.h"
 #include "backend.h"
+#include "fileio.h"
+#include "stats.h"
 #include "utils.h"
 
 #define PROG_NAME "tomu"
 #define PROG_VER "0.0.11"
 
+#define POWER_TIMER_SLACK_NS (50 * 1000000UL)
+
 int main(int argc, char *argv[])
 {
   // 1. check user what want
@@ -16,21 +22,71 @@ int main(int argc, char *argv[])
     return 0;
   }
 
-  char *option = argv[1];
   char *path = argv[argc - 1];
+  uint loop = false;
+  uint mode = false; // --loop or --shuffle given
 
   // 2. See what the user wants with "--" and handle it
-  if ( argv[1][0] == '-' && argv[1][1] == '-' ){
+  for (int i = 1; i < argc && argv[i][0] == '-' && argv[i][1] == '-'; i++) {
+    char *option = argv[i];
 
     if ( strcmp("--loop", option ) == 0 ){
-      path_handle(path, true);
-      return 0;
+      loop = true;
+      mode = true;
     }
 
     else if ( strcmp("--shuffle", option) == 0 ){
       //DirFiles.shuffle = true; // TODO mv this later
-      path_handle(path, false);
-      return 0;
+      mode = true;
+    }
+
+    else if ( strcmp("--stats", option) == 0 ){
+      Options.stats = true;
+    }
+
+    else if ( strcmp("--preload", option) == 0 && i + 1 < argc ){
+      Options.preload_mb = atoi(argv[++i]);
+    }
+
+    else if ( strcmp("--io", option) == 0 && i + 1 < argc ){
+      Options.io_mode = fileio_mode(argv[++i]);
+      if (Options.io_mode < 0) {
+        printf("[T]: unknown io mode '%s'\n", argv[i]);
+        return 0;
+      }
+    }
+
+    else if ( strcmp("--net-buffer", option) == 0 && i + 1 < argc ){
+      Options.net_buffer_sec = atoi(argv[++i]);
+    }
+
+    else if ( strcmp("--rt", option) == 0 ){
+      Options.rt = true;
+    }
+
+    else if ( strcmp("--power-save", option) == 0 && i + 1 < argc ){
+      Options.burst_sec = atoi(argv[++i]);
+      if (Options.burst_sec == 1) Options.burst_sec = 2; // the low water mark needs some room
+    }
+
+    else if ( strcmp("--rewind", option) == 0 && i + 1 < argc ){
+      Options.rewind_sec = atoi(argv[++i]);
+    }
+
+    else if ( strcmp("--loop-cache", option) == 0 && i + 1 < argc ){
+      Options.loop_cache_mb = atoi(argv[++i]);
+    }
+
+    else if ( strcmp("--cache-disk", option) == 0 && i + 1 < argc ){
+      Options.cache_disk_mb = atoi(argv[++i]);
+    }
+
+    else if ( strcmp("--cache-ram", option) == 0 && i + 1 < argc ){
+      Options.cache_ram_mb = atoi(argv[++i]);
+    }
+
+    else if ( strcmp("--shm-cache", option) == 0 && i + 1 < argc ){
+      Options.shm_cache_mb = atoi(argv[++i]);
     }
 
     else if ( strcmp("--help", option) == 0 ){
@@ -49,8 +105,18 @@ int main(int argc, char *argv[])
     }
   }
 
-  // 3. No options? Just handle the path (check file or directory)  
-  DirFiles.shuffle = true; // TODO mv this later
-  path_handle(path, false);
+  // also when we leave through die() (ctrl+c)
+  stats_start();
+  if (Options.stats)
+    atexit(stats_print);
+
+  // let the kernel batch our timers with the others (threads inherit it)
+  if (Options.burst_sec > 0)
+    prctl(PR_SET_TIMERSLACK, POWER_TIMER_SLACK_NS, 0, 0, 0);
+
+  // 3. No mode? Just handle the path (check file or directory)  
+  if (!mode)
+    DirFiles.shuffle = true; // TODO mv this later
+  path_handle(path, loop);
   return 0;
 }
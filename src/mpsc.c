@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpsc.h"
+
+// every slot starts with its sequence number, the element follows
+#define SLOT_SEQ(q, pos) ((atomic_size_t*)((q)->slots + ((pos) & (q)->mask) * (q)->slot_size))
+#define SLOT_DATA(q, pos) ((q)->slots + ((pos) & (q)->mask) * (q)->slot_size + sizeof(atomic_size_t))
+
+int mpsc_queue_init(Mpsc_Queue *q, size_t slots, size_t elem_size)
+{
+  // round up to a power of two so the index is just a mask
+  size_t count = 2;
+  while (count < slots) count <<= 1;
+
+  // keep the sequence numbers aligned
+  size_t align = sizeof(atomic_size_t);
+  q->slot_size = (sizeof(atomic_size_t) + elem_size + align - 1) / align * align;
+  q->elem_size = elem_size;
+  q->mask = count - 1;
+
+  q->slots = malloc(count * q->slot_size);
+  if (!q->slots) return -1;
+
+  // slot i is free for the push at position i
+  for (size_t i = 0; i < count; i++)
+    atomic_init(SLOT_SEQ(q, i), i);
+
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  return 0;
+}
+
+void mpsc_queue_destroy(Mpsc_Queue *q)
+{
+  free(q->slots);
+  q->slots = NULL;
+}
+
+bool mpsc_queue_push(Mpsc_Queue *q, const void *elem)
+{
+  size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+  for (;;) {
+    size_t seq = atomic_load_explicit(SLOT_SEQ(q, pos), memory_order_acquire);
+    long diff = (long)seq - (long)pos;
+
+    if (diff == 0) {
+      // slot is free, claim it
+      if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+            memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0)
+      return false; // full, the consumer has not freed it yet
+    else
+      pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  }
+
+  memcpy(SLOT_DATA(q, pos), elem, q->elem_size);
+  atomic_store_explicit(SLOT_SEQ(q, pos), pos + 1, memory_order_release);
+  return true;
+}
+
+bool mpsc_queue_pop(Mpsc_Queue *q, void *elem)
+{
+  size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  size_t seq = atomic_load_explicit(SLOT_SEQ(q, pos), memory_order_acquire);
+
+  // not published yet (empty, or a producer is still copying)
+  if (seq != pos + 1) return false;
+
+  memcpy(elem, SLOT_DATA(q, pos), q->elem_size);
+
+  // hand the slot back for the push one lap later
+  atomic_store_explicit(SLOT_SEQ(q, pos), pos + q->mask + 1, memory_order_release);
+  atomic_store_explicit(&q->tail, pos + 1, memory_order_relaxed);
+  return true;
+}
+
+// consumer side peek, a cheap check before popping
+bool mpsc_queue_empty(Mpsc_Queue *q)
+{
+  size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  return atomic_load_explicit(SLOT_SEQ(q, pos), memory_order_acquire) != pos + 1;
+}
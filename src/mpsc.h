@@ -0,0 +1,27 @@
+#ifndef MPSC_H
+#define MPSC_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// bounded lock-free queue: many threads push, one thread pops.
+// push never blocks (it fails when full), so it is safe from the
+// decoder and the audio callback.
+typedef struct {
+  unsigned char *slots;        // [seq][element] per slot
+  size_t elem_size;
+  size_t slot_size;
+  size_t mask;                 // slot count - 1 (power of two)
+  atomic_size_t head;          // next slot to push (producers)
+  atomic_size_t tail;          // next slot to pop (consumer)
+
+} Mpsc_Queue;
+
+int mpsc_queue_init(Mpsc_Queue *q, size_t slots, size_t elem_size);
+void mpsc_queue_destroy(Mpsc_Queue *q);
+bool mpsc_queue_push(Mpsc_Queue *q, const void *elem);
+bool mpsc_queue_pop(Mpsc_Queue *q, void *elem);
+bool mpsc_queue_empty(Mpsc_Queue *q);
+
+#endif
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcmcache.h"
+
+void pcm_cache_begin(Pcm_Cache *c, size_t limit_bytes, int64_t expected, int frame_bytes)
+{
+  pcm_cache_free(c);
+  if (limit_bytes == 0 || frame_bytes <= 0) return;
+
+  c->frame_bytes = frame_bytes;
+  c->limit = limit_bytes / frame_bytes;
+  if (expected > c->limit) return; // too long, don't even try
+
+  // the duration is a guess (VBR mp3 without a header): a little slack
+  c->capacity = expected > 0 ? expected + expected / 32 : c->limit / 8;
+  if (c->capacity > c->limit) c->capacity = c->limit;
+
+  c->data = malloc(c->capacity * frame_bytes);
+  c->capturing = c->data != NULL;
+}
+
+void pcm_cache_append(Pcm_Cache *c, const uint8_t *pcm, int64_t samples, int64_t start)
+{
+  if (!c->capturing || samples <= 0) return;
+
+  if (start != c->samples || c->samples + samples > c->limit) {
+    pcm_cache_free(c);
+    return;
+  }
+
+  if (c->samples + samples > c->capacity) {
+    int64_t capacity = c->capacity * 2;
+    if (capacity < c->samples + samples) capacity = c->samples + samples;
+    if (capacity > c->limit) capacity = c->limit;
+
+    uint8_t *data = realloc(c->data, capacity * c->frame_bytes);
+    if (!data) {
+      pcm_cache_free(c);
+      return;
+    }
+    c->data = data;
+    c->capacity = capacity;
+  }
+
+  memcpy(c->data + c->samples * c->frame_bytes, pcm, samples * c->frame_bytes);
+  c->samples += samples;
+}
+
+int pcm_cache_finish(Pcm_Cache *c, int64_t end)
+{
+  if (c->complete) return 1;
+  if (!c->capturing || c->samples == 0 || c->samples != end) {
+    pcm_cache_free(c);
+    return 0;
+  }
+
+  // give back the slack of the estimate
+  uint8_t *data = realloc(c->data, c->samples * c->frame_bytes);
+  if (data) {
+    c->data = data;
+    c->capacity = c->samples;
+  }
+
+  c->capturing = 0;
+  c->complete = 1;
+  return 1;
+}
+
+void pcm_cache_wrap(Pcm_Cache *c, const uint8_t *data, int64_t samples, int frame_bytes)
+{
+  pcm_cache_free(c);
+  *c = (Pcm_Cache){
+    .data = (uint8_t*)data,
+    .samples = samples,
+    .capacity = samples,
+    .limit = samples,
+    .frame_bytes = frame_bytes,
+    .complete = 1,
+    .borrowed = 1,
+  };
+}
+
+void pcm_cache_free(Pcm_Cache *c)
+{
+  if (!c->borrowed) free(c->data);
+  *c = (Pcm_Cache){0};
+}
+
+int64_t pcm_cache_peek(const Pcm_Cache *c, int64_t position, int64_t max, const uint8_t **pcm)
+{
+  if (!c->complete || position < 0 || position >= c->samples) return 0;
+
+  int64_t count = c->samples - position;
+  if (count > max) count = max;
+
+  *pcm = c->data + position * c->frame_bytes;
+  return count;
+}
@@ -0,0 +1,41 @@
+#ifndef PCMCACHE_H
+#define PCMCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// a whole file decoded once, interleaved PCM at the file rate (same format
+// as the rewind history). filled while the first loop pass plays, then
+// every other pass plays from here. decoder thread only.
+typedef struct {
+  uint8_t *data;
+  int64_t samples;             // stored, always from position 0 on
+  int64_t capacity;            // allocated, in samples
+  int64_t limit;               // never grow past this (samples)
+  int frame_bytes;
+  int capturing;               // taking the frames the decoder makes
+  int complete;                // holds the file up to its end
+  int borrowed;                // data belongs to someone else (a mapped disk cache entry)
+
+} Pcm_Cache;
+
+// start capturing at position 0, expected is a size hint (0 unknown).
+// nothing happens when the file can't fit in limit_bytes
+void pcm_cache_begin(Pcm_Cache *c, size_t limit_bytes, int64_t expected, int frame_bytes);
+
+// samples which start at start: anything that isn't the continuation
+// (a seek) or doesn't fit stops the capture
+void pcm_cache_append(Pcm_Cache *c, const uint8_t *pcm, int64_t samples, int64_t start);
+
+// the decoder reached the end at position end, 1 when it is all here
+int pcm_cache_finish(Pcm_Cache *c, int64_t end);
+
+// a complete cache over memory we don't own
+void pcm_cache_wrap(Pcm_Cache *c, const uint8_t *data, int64_t samples, int frame_bytes);
+
+void pcm_cache_free(Pcm_Cache *c);
+
+// contiguous samples from position (no copy), 0 at the end
+int64_t pcm_cache_peek(const Pcm_Cache *c, int64_t position, int64_t max, const uint8_t **pcm);
+
+#endif
@@ -0,0 +1,116 @@
+#define _GNU_SOURCE // RUSAGE_THREAD, gettid
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "rt.h"
+#include "stats.h"
+#include "utils.h"
+
+// low in the real-time range: above every normal thread, below the
+// sound server and the kernel threads that feed it
+#define RT_PRIORITY 10
+#define RT_NICE     -10
+
+static int try_policy(int policy)
+{
+  int min = sched_get_priority_min(policy);
+  int max = sched_get_priority_max(policy);
+  if (min < 0 || max < 0) return -1;
+
+  struct sched_param param = { .sched_priority = min + RT_PRIORITY <= max ? min + RT_PRIORITY : max };
+  return pthread_setschedparam(pthread_self(), policy, &param) == 0 ? 0 : -1;
+}
+
+void rt_promote(const char *who)
+{
+  if (!Options.rt) return;
+
+  if (try_policy(SCHED_FIFO) == 0) {
+    stats_add(rt_realtime, 1);
+    return;
+  }
+  if (try_policy(SCHED_RR) == 0) {
+    stats_add(rt_realtime, 1);
+    return;
+  }
+
+  // no CAP_SYS_NICE and no RLIMIT_RTPRIO: maybe RLIMIT_NICE lets us go up a little
+  if (setpriority(PRIO_PROCESS, gettid(), RT_NICE) == 0) {
+    stats_add(rt_nice, 1);
+    warn("rt: %s: no real-time scheduling, running at nice %d", who, RT_NICE);
+    return;
+  }
+  warn("rt: %s: no real-time scheduling nor higher priority (%s)", who, strerror(errno));
+}
+
+// in front of what rt_alloc hands out: the region is ours from its
+// first page to its last, nothing else is unlocked with it
+typedef struct {
+  size_t len;                  // of the mapping, 0 from malloc
+  int locked;
+  char pad[64 - sizeof(size_t) - sizeof(int)]; // the data stays 64 byte aligned
+
+} Rt_Block;
+
+void *rt_alloc(size_t len)
+{
+  if (!Options.rt) {
+    Rt_Block *b = malloc(sizeof(Rt_Block) + len);
+    if (!b) return NULL;
+    b->len = 0;
+    b->locked = 0;
+    return b + 1;
+  }
+
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = (sizeof(Rt_Block) + len + page - 1) / page * page;
+  Rt_Block *b = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (b == MAP_FAILED) return NULL;
+  b->len = size;
+
+  // RLIMIT_MEMLOCK is small for normal users, say it once
+  static atomic_int warned;
+  b->locked = mlock(b, size) == 0;
+  if (!b->locked && !atomic_exchange(&warned, 1))
+    warn("rt: mlock: %s (raise ulimit -l)", strerror(errno));
+
+  if (b->locked) {
+    uint64_t now = stats_add(rt_locked_bytes, size) + size;
+    stats_max(rt_locked_peak, now);
+  }
+  return b + 1;
+}
+
+void rt_free(void *p)
+{
+  if (!p) return;
+  Rt_Block *b = (Rt_Block*)p - 1;
+
+  if (!b->len) {
+    free(b);
+    return;
+  }
+  if (b->locked) stats_sub(rt_locked_bytes, b->len);
+  munmap(b, b->len); // unlocks it
+}
+
+void rt_thread_stats(void)
+{
+  struct rusage ru;
+  if (getrusage(RUSAGE_THREAD, &ru) < 0) return;
+
+  stats_add(decoder_minflt, ru.ru_minflt);
+  stats_add(decoder_majflt, ru.ru_majflt);
+  stats_add(decoder_nvcsw, ru.ru_nvcsw);
+  stats_add(decoder_nivcsw, ru.ru_nivcsw);
+  stats_add(decoder_cpu_ms, (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000 +
+                            (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000);
+}
@@ -0,0 +1,22 @@
+#ifndef RT_H
+#define RT_H
+
+#include <stddef.h>
+
+// --rt: the audio path (decoder thread, ring, scratch buffers) asks for
+// real-time scheduling and locked memory. everything falls back quietly
+// to what an unprivileged user gets, it never fails playback.
+
+// the calling thread: SCHED_FIFO, else SCHED_RR, else a lower nice value
+void rt_promote(const char *who);
+
+// len bytes kept in RAM (no page faults): with --rt pages of their own,
+// locked, so freeing them never unlocks anything else. malloc without
+// --rt. NULL without memory, free them with rt_free
+void *rt_alloc(size_t len);
+void rt_free(void *p);
+
+// page faults, context switches and CPU time of the calling thread, into the stats
+void rt_thread_stats(void);
+
+#endif
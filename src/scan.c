@@ -0,0 +1,416 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "scan.h"
+#include "stats.h"
+
+#define SNIFF_BYTES 64
+
+// the kernel's record, glibc only has it (and getdents64) from 2.30
+struct dirent64_rec {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+#ifndef DT_UNKNOWN
+  #define DT_UNKNOWN 0
+  #define DT_DIR     4
+  #define DT_REG     8
+  #define DT_LNK     10
+#endif
+
+// what ffmpeg plays, taken without opening the file
+static const char *audio_exts[] = {
+  "mp3", "mp2", "flac", "ogg", "oga", "opus", "spx", "wav", "wave", "w64", "aif", "aiff", "aifc",
+  "m4a", "m4b", "mp4", "aac", "ac3", "eac3", "dts", "wv", "ape", "mka", "webm", "wma", "asf",
+  "mpc", "tta", "caf", "au", "snd", "amr", "dsf", "dff", "tak", "ra", NULL
+};
+
+// what sits next to albums, never opened
+static const char *other_exts[] = {
+  "jpg", "jpeg", "png", "gif", "bmp", "webp", "tif", "tiff", "txt", "nfo", "log", "md", "pdf",
+  "m3u", "m3u8", "pls", "xspf", "lrc", "srt", "sfv", "md5", "ffp", "accurip", "db", "ini",
+  "html", "htm", "xml", "json", "torrent", "url", NULL
+};
+
+// a folder to read, relative to the root ("" is the root)
+typedef struct {
+  char *rel;
+
+} Scan_Dir;
+
+// a thread's folders: it pushes and pops at the end, the others steal
+// from the start
+typedef struct {
+  pthread_mutex_t lock;
+  Scan_Dir *dirs;
+  int head, tail, cap;
+
+  Scan_Entry *found;    // what this thread found, merged at the end
+  int count, found_cap;
+  char *batch;          // getdents64 buffer
+
+} Scan_Queue;
+
+typedef struct {
+  const char *path;     // the root folder
+  int root;             // and its fd
+  Scan_Known known;
+  void *ctx;
+  int threads;
+  Scan_Queue *queues;
+
+  atomic_int pending;   // folders queued or being read, 0: done
+  atomic_int queued;    // of those, in a queue
+  atomic_int idle;      // threads waiting for one
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+
+} Scan_Pool;
+
+typedef struct {
+  Scan_Pool *pool;
+  int id;
+
+} Scan_Worker;
+
+struct Scan_Sink {
+  Scan_Pool *pool;
+  Scan_Queue *queue;
+};
+
+static int ext_in(const char *name, const char **exts)
+{
+  const char *dot = strrchr(name, '.');
+  if (!dot || dot == name) return -1; // no extension
+  for (int i = 0; exts[i]; i++)
+    if (!strcasecmp(dot + 1, exts[i])) return 1;
+  return 0;
+}
+
+// the first bytes of the audio formats (and containers) ffmpeg plays
+static int audio_magic(const unsigned char *b, ssize_t n)
+{
+  if (n < 4) return 0;
+  if (!memcmp(b, "ID3", 3)) return 1;                                      // mp3 with tags
+  if (b[0] == 0xFF && (b[1] & 0xE0) == 0xE0) return 1;                     // mpeg audio, ADTS
+  if (b[0] == 0x0B && b[1] == 0x77) return 1;                              // AC-3
+  if (!memcmp(b, "fLaC", 4) || !memcmp(b, "OggS", 4) || !memcmp(b, "MAC ", 4) ||
+      !memcmp(b, "wvpk", 4) || !memcmp(b, "TTA1", 4) || !memcmp(b, "MPCK", 4) ||
+      !memcmp(b, "caff", 4) || !memcmp(b, ".snd", 4) || !memcmp(b, "DSD ", 4) ||
+      !memcmp(b, "tBaK", 4) || !memcmp(b, "#!AMR", n < 5 ? 4 : 5))
+    return 1;
+  if (!memcmp(b, "\x1a\x45\xdf\xa3", 4)) return 1;                         // matroska
+  if (!memcmp(b, "\x30\x26\xb2\x75", 4)) return 1;                         // asf (wma)
+  if (n < 12) return 0;
+  if ((!memcmp(b, "RIFF", 4) || !memcmp(b, "RF64", 4)) && !memcmp(b + 8, "WAVE", 4)) return 1;
+  if (!memcmp(b, "FORM", 4) && (!memcmp(b + 8, "AIFF", 4) || !memcmp(b + 8, "AIFC", 4))) return 1;
+  if (!memcmp(b + 4, "ftyp", 4)) return 1;                                 // mp4, m4a
+  return 0;
+}
+
+static int sniff(int dir, const char *name)
+{
+  int fd = openat(dir, name, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) return 0;
+
+  unsigned char b[SNIFF_BYTES];
+  ssize_t n = pread(fd, b, sizeof(b), 0);
+  close(fd);
+
+  stats_add(scan_sniffs, 1);
+  return audio_magic(b, n);
+}
+
+// SCAN_* of a regular file, -1 when it isn't one we play
+static int classify(Scan_Pool *pool, int dir, const char *rel, const char *name)
+{
+  size_t len = strlen(name);
+  if (len > 4 && !strcasecmp(name + len - 4, ".cue")) return SCAN_CUE;
+
+  if (len > 4 && (!strcasecmp(name + len - 4, ".zip") || !strcasecmp(name + len - 4, ".tar"))) {
+    char full[PATH_MAX];
+    if (snprintf(full, sizeof(full), "%s/%s", pool->path, rel) >= (int)sizeof(full)) return -1;
+    return archive_type(full) != ARCHIVE_NONE ? SCAN_ARCHIVE : -1;
+  }
+
+  if (ext_in(name, audio_exts) == 1) return SCAN_AUDIO;
+  if (ext_in(name, other_exts) == 1) return -1;
+  return sniff(dir, name) ? SCAN_AUDIO : -1;
+}
+
+static int found_add(Scan_Queue *q, char *name, int kind, int64_t mtime)
+{
+  if (!name) return -1;
+  if (q->count == q->found_cap) {
+    int cap = q->found_cap ? q->found_cap * 2 : 256;
+    Scan_Entry *tmp = realloc(q->found, cap * sizeof(Scan_Entry));
+    if (!tmp) {
+      free(name);
+      return -1;
+    }
+    q->found = tmp;
+    q->found_cap = cap;
+  }
+  q->found[q->count++] = (Scan_Entry){ name, kind, mtime };
+  return 0;
+}
+
+static void pool_push(Scan_Pool *pool, Scan_Queue *q, char *rel)
+{
+  if (!rel) return;
+
+  // counted before anyone can take it, or its end could look like the last one
+  atomic_fetch_add(&pool->pending, 1);
+
+  pthread_mutex_lock(&q->lock);
+  if (q->tail == q->cap) {
+    // move what is left to the start, grow when it is still full
+    memmove(q->dirs, q->dirs + q->head, (q->tail - q->head) * sizeof(Scan_Dir));
+    q->tail -= q->head;
+    q->head = 0;
+    if (q->tail == q->cap) {
+      int cap = q->cap ? q->cap * 2 : 64;
+      Scan_Dir *tmp = realloc(q->dirs, cap * sizeof(Scan_Dir));
+      if (!tmp) {
+        pthread_mutex_unlock(&q->lock);
+        free(rel);
+        atomic_fetch_sub(&pool->pending, 1);
+        return;
+      }
+      q->dirs = tmp;
+      q->cap = cap;
+    }
+  }
+  q->dirs[q->tail++] = (Scan_Dir){ rel };
+  atomic_fetch_add(&pool->queued, 1);
+  pthread_mutex_unlock(&q->lock);
+
+  if (atomic_load(&pool->idle) > 0) {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+// own: the newest, else the oldest of another thread. NULL when all are empty
+static char *pool_take(Scan_Pool *pool, int id)
+{
+  for (int i = 0; i < pool->threads; i++) {
+    Scan_Queue *q = &pool->queues[(id + i) % pool->threads];
+    char *rel = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail)
+      rel = i == 0 ? q->dirs[--q->tail].rel : q->dirs[q->head++].rel;
+    pthread_mutex_unlock(&q->lock);
+
+    if (rel) {
+      atomic_fetch_sub(&pool->queued, 1);
+      return rel;
+    }
+  }
+  return NULL;
+}
+
+static char *join(const char *rel, const char *name)
+{
+  size_t a = strlen(rel), b = strlen(name);
+  char *out = malloc(a + b + 2);
+  if (!out) return NULL;
+  if (a) {
+    memcpy(out, rel, a);
+    out[a++] = '/';
+  }
+  memcpy(out + a, name, b + 1);
+  return out;
+}
+
+static void scan_one(Scan_Pool *pool, Scan_Queue *q, const char *rel)
+{
+  // a known folder costs a stat: it is opened only when it is read.
+  // one which changes after the stat is read as it is then, the next
+  // scan sees an mtime newer than the one kept and reads it again
+  struct stat st;
+  int64_t mtime = fstatat(pool->root, *rel ? rel : ".", &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)
+                ? (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec : 0;
+
+  Scan_Sink sink = { pool, q };
+  if (pool->known && mtime && pool->known(pool->ctx, &sink, rel, mtime))
+    return;
+
+  int dir = openat(pool->root, *rel ? rel : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir < 0) return;
+  found_add(q, strdup(rel), SCAN_DIR, mtime);
+  stats_add(scan_dirs, 1);
+
+  long n;
+  while ((n = syscall(SYS_getdents64, dir, q->batch, SCAN_BATCH)) > 0) {
+    for (long off = 0; off < n;) {
+      struct dirent64_rec *d = (struct dirent64_rec*)(q->batch + off);
+      off += d->d_reclen;
+      if (d->d_name[0] == '.') continue;
+      stats_add(scan_entries, 1);
+
+      int type = d->d_type;
+      if (type == DT_UNKNOWN || type == DT_LNK) {
+        struct stat st;
+        // a link to a folder is left alone, it may point up the tree
+        int flags = type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW;
+        if (fstatat(dir, d->d_name, &st, flags) < 0) continue;
+        type = S_ISDIR(st.st_mode) ? (type == DT_LNK ? DT_LNK : DT_DIR) : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+      }
+
+      if (type == DT_DIR) {
+        pool_push(pool, q, join(rel, d->d_name));
+        continue;
+      }
+      if (type != DT_REG) continue;
+
+      char *name = join(rel, d->d_name);
+      int kind = name ? classify(pool, dir, name, d->d_name) : -1;
+      if (kind < 0) free(name);
+      else found_add(q, name, kind, 0);
+    }
+  }
+  close(dir);
+}
+
+void scan_keep(Scan_Sink *sink, const char *name, int kind)
+{
+  if (kind == SCAN_DIR) pool_push(sink->pool, sink->queue, strdup(name));
+  else found_add(sink->queue, strdup(name), kind, 0);
+}
+
+static void *scan_worker(void *arg)
+{
+  Scan_Worker *w = arg;
+  Scan_Pool *pool = w->pool;
+  Scan_Queue *q = &pool->queues[w->id];
+
+  for (;;) {
+    char *rel = pool_take(pool, w->id);
+    if (rel) {
+      scan_one(pool, q, rel);
+      free(rel);
+
+      // the last folder: wake the others up to leave
+      if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+      }
+      continue;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->idle, 1);
+    while (atomic_load(&pool->queued) == 0 && atomic_load(&pool->pending) > 0)
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    atomic_fetch_sub(&pool->idle, 1);
+    int done = atomic_load(&pool->pending) == 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (done) break;
+  }
+  return NULL;
+}
+
+static int by_name(const void *a, const void *b)
+{
+  return strcmp(((const Scan_Entry*)a)->name, ((const Scan_Entry*)b)->name);
+}
+
+Scan_Entry *scan_tree(const char *root, Scan_Known known, void *ctx, int *count)
+{
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  Scan_Pool pool = {
+    .path = root,
+    .root = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC),
+    .known = known,
+    .ctx = ctx,
+  };
+  if (pool.root < 0) return NULL;
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  pool.threads = cores < 1 ? 1 : cores > SCAN_MAX_THREADS ? SCAN_MAX_THREADS : cores;
+  pool.queues = calloc(pool.threads, sizeof(Scan_Queue));
+  Scan_Worker *workers = calloc(pool.threads, sizeof(Scan_Worker));
+  pthread_t *tids = calloc(pool.threads, sizeof(pthread_t));
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.wake, NULL);
+
+  int ok = pool.queues && workers && tids;
+  for (int i = 0; ok && i < pool.threads; i++) {
+    pthread_mutex_init(&pool.queues[i].lock, NULL);
+    ok = (pool.queues[i].batch = malloc(SCAN_BATCH)) != NULL;
+  }
+
+  // thread 0 is us
+  int started = 1;
+  if (ok) {
+    pool_push(&pool, &pool.queues[0], strdup(""));
+    for (; started < pool.threads; started++) {
+      workers[started] = (Scan_Worker){ &pool, started };
+      if (pthread_create(&tids[started], NULL, scan_worker, &workers[started]) != 0) break;
+    }
+    workers[0] = (Scan_Worker){ &pool, 0 };
+    scan_worker(&workers[0]);
+  }
+  for (int i = 1; i < started; i++)
+    pthread_join(tids[i], NULL);
+
+  // one list out of the threads' ones
+  Scan_Entry *all = NULL;
+  int total = 0;
+  for (int i = 0; pool.queues && i < pool.threads; i++)
+    total += pool.queues[i].count;
+
+  if (ok && (all = malloc((total ? total : 1) * sizeof(Scan_Entry)))) {
+    total = 0;
+    for (int i = 0; i < pool.threads; i++) {
+      memcpy(all + total, pool.queues[i].found, pool.queues[i].count * sizeof(Scan_Entry));
+      total += pool.queues[i].count;
+    }
+    qsort(all, total, sizeof(Scan_Entry), by_name);
+    *count = total;
+  }
+  else {
+    for (int i = 0; pool.queues && i < pool.threads; i++)
+      for (int j = 0; j < pool.queues[i].count; j++)
+        free(pool.queues[i].found[j].name);
+  }
+
+  for (int i = 0; pool.queues && i < pool.threads; i++) {
+    free(pool.queues[i].found);
+    free(pool.queues[i].dirs);
+    free(pool.queues[i].batch);
+    pthread_mutex_destroy(&pool.queues[i].lock);
+  }
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.wake);
+  free(pool.queues);
+  free(workers);
+  free(tids);
+  close(pool.root);
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  stats_add(scan_ms, (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000);
+  return all;
+}
@@ -0,0 +1,48 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdint.h>
+
+// the playable files under a folder, subfolders included. the tree is
+// walked by a pool of threads (one per core, up to SCAN_MAX_THREADS), each
+// with its own queue of folders to read: it takes the last one it queued
+// (the subtree it is in) and when it runs out takes the oldest one of
+// another thread (a big subtree nobody got to yet). folders are read with
+// getdents64 in SCAN_BATCH sized reads, no stat for the entries which
+// have a type.
+// a file is audio by its extension, files with an extension we don't
+// know (or none) by their first bytes. pictures, playlists, logs are
+// never opened. hidden entries (".name") are skipped, symlinks to folders
+// are not followed (no loops).
+// a folder the caller knows from an earlier scan (the library index) is
+// not read (nor opened) when its mtime didn't change: it stays the
+// caller's, only its subfolders are handed back to be scanned in turn
+
+#define SCAN_MAX_THREADS 16
+#define SCAN_BATCH       (64 * 1024)
+
+enum { SCAN_AUDIO, SCAN_ARCHIVE, SCAN_CUE, SCAN_DIR };
+
+typedef struct {
+  char *name;     // from the folder scanned: "disc1/01.flac" ("" the folder itself)
+  int kind;       // SCAN_*
+  int64_t mtime;  // SCAN_DIR: of the folder (ns), it changes with its entries
+
+} Scan_Entry;
+
+typedef struct Scan_Sink Scan_Sink;
+
+// a folder about to be read (rel, its mtime): 1 when the caller knows it
+// as it is (it is left out of what scan_tree finds) and gave its
+// subfolders to scan_keep, 0 reads it. called from all the threads at once
+typedef int (*Scan_Known)(void *ctx, Scan_Sink *sink, const char *rel, int64_t mtime);
+
+// an entry of a known folder (name from the root). SCAN_DIR is scanned in turn
+void scan_keep(Scan_Sink *sink, const char *name, int kind);
+
+// what is under root (a SCAN_DIR for every folder read, root included),
+// sorted by name. known may be NULL. NULL when root can't be read, the
+// entries and their names are the caller's to free
+Scan_Entry *scan_tree(const char *root, Scan_Known known, void *ctx, int *count);
+
+#endif
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "diskcache.h"
+#include "seekindex.h"
+#include "stats.h"
+
+#define SEEKINDEX_MAGIC   0x78697374 // "tsix"
+#define SEEKINDEX_VERSION 1
+
+#if LIBAVFORMAT_VERSION_MAJOR < 59
+  #define LEGACY_LIBAVFORMAT_INDEX
+#endif
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  int32_t tb_num, tb_den;      // time base of the timestamps
+  int64_t count;
+
+} Seek_Index_Header;
+
+typedef struct {
+  int64_t timestamp;
+  int64_t pos;
+
+} Seek_Index_Point;
+
+// demuxers which seek by bisecting or reading forward
+static const char *slow_formats[] = { "mp3", "aac", "ac3", "eac3", "ogg", "flac", NULL };
+
+static int index_count(AVStream *st)
+{
+  #ifdef LEGACY_LIBAVFORMAT_INDEX
+    return st->nb_index_entries;
+  #else
+    return avformat_index_get_entries_count(st);
+  #endif
+}
+
+static const AVIndexEntry *index_entry(AVStream *st, int i)
+{
+  #ifdef LEGACY_LIBAVFORMAT_INDEX
+    return &st->index_entries[i];
+  #else
+    return avformat_index_get_entry(st, i);
+  #endif
+}
+
+static int index_path(char *out, size_t len, const char *path)
+{
+  char dir[900];
+  uint64_t key;
+  if (diskcache_key(path, &key) < 0 || diskcache_dir("seek", dir, sizeof(dir)) < 0) return -1;
+
+  int n = snprintf(out, len, "%s/%016llx.idx", dir, (unsigned long long)key);
+  return (n < 0 || (size_t)n >= len) ? -1 : 0;
+}
+
+void seekindex_open(Seek_Index *idx, const char *path, AVFormatContext *fmtCTX, int stream, int duration_sec)
+{
+  *idx = (Seek_Index){ .last = AV_NOPTS_VALUE };
+  if (duration_sec < SEEKINDEX_MIN_SEC || !fmtCTX->iformat || !fmtCTX->iformat->name) return;
+
+  int slow = 0;
+  for (int i = 0; slow_formats[i] && !slow; i++)
+    slow = !strcmp(fmtCTX->iformat->name, slow_formats[i]);
+  if (!slow) return;
+
+  AVStream *st = fmtCTX->streams[stream];
+  idx->on = 1;
+  idx->trusted = 1;
+  idx->step = av_rescale_q(SEEKINDEX_STEP_SEC, (AVRational){1, 1}, st->time_base);
+  idx->covered = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+
+  char file[1024];
+  FILE *f = index_path(file, sizeof(file), path) == 0 ? fopen(file, "r") : NULL;
+  if (!f) return;
+
+  Seek_Index_Header head;
+  Seek_Index_Point point;
+  if (fread(&head, sizeof(head), 1, f) == 1 && head.magic == SEEKINDEX_MAGIC &&
+      head.version == SEEKINDEX_VERSION && head.tb_num == st->time_base.num && head.tb_den == st->time_base.den) {
+    for (int64_t i = 0; i < head.count && fread(&point, sizeof(point), 1, f) == 1; i++) {
+      if (av_add_index_entry(st, point.pos, point.timestamp, 0, 0, AVINDEX_KEYFRAME) < 0) break;
+      if (point.timestamp > idx->covered) idx->covered = point.timestamp;
+      idx->loaded++;
+    }
+  }
+  fclose(f);
+
+  if (idx->loaded) stats_add(seek_index_loads, 1);
+}
+
+void seekindex_learn(Seek_Index *idx, AVFormatContext *fmtCTX, const AVPacket *packet)
+{
+  if (!idx->on || !idx->trusted || packet->pos < 0 || packet->pts == AV_NOPTS_VALUE) return;
+
+  if (packet->pts > idx->covered) idx->covered = packet->pts;
+  if (idx->last != AV_NOPTS_VALUE && llabs(packet->pts - idx->last) < idx->step) return;
+
+  idx->last = packet->pts;
+  if (av_add_index_entry(fmtCTX->streams[packet->stream_index], packet->pos, packet->pts,
+                         0, 0, AVINDEX_KEYFRAME) >= 0)
+    idx->learnt++;
+}
+
+void seekindex_seek(Seek_Index *idx, int64_t timestamp)
+{
+  idx->trusted = timestamp <= idx->covered;
+  idx->last = AV_NOPTS_VALUE;
+}
+
+void seekindex_close(Seek_Index *idx, const char *path, AVFormatContext *fmtCTX, int stream)
+{
+  if (!idx->on || !idx->learnt) return;
+
+  char file[1024], tmp[1100];
+  if (index_path(file, sizeof(file), path) < 0) return;
+  snprintf(tmp, sizeof(tmp), "%s.tmp%d", file, (int)getpid());
+
+  FILE *f = fopen(tmp, "w");
+  if (!f) return;
+
+  // one point a step, the demuxer may have indexed every packet
+  AVStream *st = fmtCTX->streams[stream];
+  Seek_Index_Header head = {
+    .magic = SEEKINDEX_MAGIC,
+    .version = SEEKINDEX_VERSION,
+    .tb_num = st->time_base.num,
+    .tb_den = st->time_base.den,
+  };
+  int ok = fwrite(&head, sizeof(head), 1, f) == 1;
+
+  int64_t last = AV_NOPTS_VALUE;
+  for (int i = 0; ok && i < index_count(st); i++) {
+    const AVIndexEntry *e = index_entry(st, i);
+    if (e->pos < 0 || (last != AV_NOPTS_VALUE && e->timestamp - last < idx->step)) continue;
+
+    Seek_Index_Point point = { e->timestamp, e->pos };
+    ok = fwrite(&point, sizeof(point), 1, f) == 1;
+    last = e->timestamp;
+    head.count++;
+  }
+
+  ok &= fseek(f, 0, SEEK_SET) == 0 && fwrite(&head, sizeof(head), 1, f) == 1;
+  ok &= fclose(f) == 0;
+
+  if (!ok || rename(tmp, file) < 0) {
+    unlink(tmp);
+    return;
+  }
+  stats_add(seek_index_saves, 1);
+}
@@ -0,0 +1,47 @@
+#ifndef SEEKINDEX_H
+#define SEEKINDEX_H
+
+#include <libavformat/avformat.h>
+#include <stdint.h>
+
+// where to seek in long files. formats without a full index of their own
+// (mp3 without a TOC, raw AAC/AC-3, ogg, flac without a seektable) find a
+// far target by bisecting or by reading the file up to it; mp4/m4b and
+// matroska index every packet and are left alone.
+// while such a file plays, a packet every SEEKINDEX_STEP_SEC (its byte
+// offset and timestamp) goes into the demuxer's own index, and when it
+// stops the index is kept in $XDG_CACHE_HOME/tomu/seek (same key as the
+// disk cache). the next time it is loaded before the first seek: a jump
+// hours into the file is one read at the right offset.
+// only files of SEEKINDEX_MIN_SEC or more
+
+#define SEEKINDEX_STEP_SEC 10
+#define SEEKINDEX_MIN_SEC  (20 * 60)
+
+// timestamps are only right as far as the demuxer read from the start or
+// from a point of the index: a seek past that lands on an estimate
+// (mp3 TOC, bitrate), nothing is learnt until we seek back
+typedef struct {
+  int on;
+  int trusted;        // the packets read now have exact timestamps
+  int64_t covered;    // up to here they are (stream time base)
+  int64_t step;       // SEEKINDEX_STEP_SEC in the stream time base
+  int64_t last;       // timestamp of the last point added (AV_NOPTS_VALUE none)
+  int loaded, learnt; // points read from the disk, and added while playing
+
+} Seek_Index;
+
+// the saved points of path go into the index of stream st (when the
+// format and the length are worth it, idx->on tells)
+void seekindex_open(Seek_Index *idx, const char *path, AVFormatContext *fmtCTX, int stream, int duration_sec);
+
+// a packet the decoder read, a point every SEEKINDEX_STEP_SEC
+void seekindex_learn(Seek_Index *idx, AVFormatContext *fmtCTX, const AVPacket *packet);
+
+// the decoder seeks to timestamp (stream time base)
+void seekindex_seek(Seek_Index *idx, int64_t timestamp);
+
+// keep the index for the next time when it learnt something
+void seekindex_close(Seek_Index *idx, const char *path, AVFormatContext *fmtCTX, int stream);
+
+#endif
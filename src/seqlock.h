@@ -0,0 +1,39 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+// sequence lock: one writer at a time, readers never block the writer.
+// odd sequence = write in progress, readers retry until they see the
+// same even sequence before and after their copy.
+
+#include <sched.h>
+#include <stdatomic.h>
+
+static inline void seqlock_write_begin(atomic_uint *seq)
+{
+  unsigned s = atomic_load_explicit(seq, memory_order_relaxed);
+  atomic_store_explicit(seq, s + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static inline void seqlock_write_end(atomic_uint *seq)
+{
+  unsigned s = atomic_load_explicit(seq, memory_order_relaxed);
+  atomic_store_explicit(seq, s + 1, memory_order_release);
+}
+
+static inline unsigned seqlock_read_begin(const atomic_uint *seq)
+{
+  unsigned s;
+  while ((s = atomic_load_explicit((atomic_uint*)seq, memory_order_acquire)) & 1)
+    sched_yield(); // writer is busy, it's a few stores away
+  return s;
+}
+
+// 1 when the copy raced with a writer and must be read again
+static inline int seqlock_read_retry(const atomic_uint *seq, unsigned start)
+{
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit((atomic_uint*)seq, memory_order_relaxed) != start;
+}
+
+#endif
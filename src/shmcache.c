@@ -0,0 +1,402 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmcache.h"
+#include "stats.h"
+#include "utils.h"
+
+#define SHM_INDEX_MAGIC 0x78646974 // "tidx"
+#define SHM_SLOTS 256
+#define SHM_USERS 8
+
+typedef struct {
+  uint64_t key;
+  uint64_t bytes;
+  uint64_t used;                     // LRU clock
+  int state;                         // 0 free, SHM_WRITING, SHM_READY
+  pid_t users[SHM_USERS];            // sessions which have it mapped
+
+} Shm_Slot;
+
+typedef struct {
+  atomic_uint magic;                 // set last, once the lock is usable
+  pthread_mutex_t lock;              // process shared and robust
+  uint64_t clock;
+  Shm_Slot slots[SHM_SLOTS];
+
+} Shm_Index;
+
+static Shm_Index *index_map;
+
+static size_t shm_budget(void) { return (size_t)Options.shm_cache_mb << 20; }
+
+static void shm_name(char *out, size_t len, const char *what)
+{
+  snprintf(out, len, "/tomu-%u-%s", (unsigned)getuid(), what);
+}
+
+static void entry_name(char *out, size_t len, uint64_t key)
+{
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)key);
+  shm_name(out, len, hex);
+}
+
+static int pid_alive(pid_t pid)
+{
+  return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+// map the index, creating it when we are the first session
+static Shm_Index *index_open(void)
+{
+  if (index_map) return index_map;
+
+  char name[64];
+  shm_name(name, sizeof(name), "index");
+
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  int creator = fd >= 0;
+
+  if (!creator) {
+    fd = shm_open(name, O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0) return NULL;
+
+    // the creator may still be sizing it
+    struct stat st;
+    for (int i = 0; i < 100 && fstat(fd, &st) == 0 && st.st_size < (off_t)sizeof(Shm_Index); i++)
+      usleep(1000);
+  }
+  else if (ftruncate(fd, sizeof(Shm_Index)) < 0) {
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+
+  Shm_Index *idx = mmap(NULL, sizeof(Shm_Index), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (idx == MAP_FAILED) return NULL;
+
+  if (creator) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&idx->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    atomic_store(&idx->magic, SHM_INDEX_MAGIC);
+  }
+  else {
+    for (int i = 0; i < 100 && atomic_load(&idx->magic) != SHM_INDEX_MAGIC; i++)
+      usleep(1000);
+    if (atomic_load(&idx->magic) != SHM_INDEX_MAGIC) {
+      munmap(idx, sizeof(Shm_Index));
+      return NULL;
+    }
+  }
+
+  index_map = idx;
+  return idx;
+}
+
+static void index_lock(Shm_Index *idx)
+{
+  // a session died holding it: the index is only bookkeeping, go on
+  if (pthread_mutex_lock(&idx->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&idx->lock);
+}
+
+static void index_unlock(Shm_Index *idx)
+{
+  pthread_mutex_unlock(&idx->lock);
+}
+
+static Shm_Slot *slot_find(Shm_Index *idx, uint64_t key)
+{
+  for (int i = 0; i < SHM_SLOTS; i++)
+    if (idx->slots[i].state && idx->slots[i].key == key) return &idx->slots[i];
+  return NULL;
+}
+
+static void slot_free(Shm_Slot *slot)
+{
+  char name[64];
+  entry_name(name, sizeof(name), slot->key);
+  shm_unlink(name);
+  memset(slot, 0, sizeof(*slot));
+}
+
+// forget sessions which are gone, returns how many are left
+static int slot_users(Shm_Slot *slot)
+{
+  int live = 0;
+  for (int i = 0; i < SHM_USERS; i++) {
+    if (slot->users[i] && !pid_alive(slot->users[i])) slot->users[i] = 0;
+    if (slot->users[i]) live++;
+  }
+  return live;
+}
+
+static void slot_user(Shm_Slot *slot, pid_t pid, int add)
+{
+  for (int i = 0; i < SHM_USERS; i++) {
+    if (add && !slot->users[i]) { slot->users[i] = pid; return; }
+    if (!add && slot->users[i] == pid) { slot->users[i] = 0; return; }
+  }
+}
+
+// LRU eviction until `need` more bytes fit, entries nobody plays go first.
+// index locked
+static void make_room(Shm_Index *idx, uint64_t need)
+{
+  for (;;) {
+    uint64_t total = need;
+    Shm_Slot *victim = NULL;
+    int victim_users = 0;
+
+    for (int i = 0; i < SHM_SLOTS; i++) {
+      Shm_Slot *slot = &idx->slots[i];
+      if (!slot->state) continue;
+      total += slot->bytes;
+      if (slot->state != SHM_READY) continue;
+
+      int users = slot_users(slot) > 0;
+      if (!victim || users < victim_users || (users == victim_users && slot->used < victim->used)) {
+        victim = slot;
+        victim_users = users;
+      }
+    }
+
+    if (total <= shm_budget() || !victim) return;
+    slot_free(victim);
+  }
+}
+
+static int entry_map(Shm_Entry *e, uint64_t key, int writable, size_t len)
+{
+  char name[64];
+  entry_name(name, sizeof(name), key);
+
+  int fd = shm_open(name, (writable ? O_RDWR | O_CREAT | O_EXCL : O_RDONLY) | O_CLOEXEC, 0600);
+  if (fd < 0) return -1;
+
+  if (writable && ftruncate(fd, len) < 0) {
+    close(fd);
+    shm_unlink(name);
+    return -1;
+  }
+
+  if (!writable) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < SHMCACHE_DATA) {
+      close(fd);
+      return -1;
+    }
+    len = st.st_size;
+  }
+
+  void *map = mmap(NULL, len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    if (writable) shm_unlink(name);
+    return -1;
+  }
+
+  e->head = map;
+  e->pcm = (const uint8_t*)map + SHMCACHE_DATA;
+  e->wpcm = writable ? (uint8_t*)map + SHMCACHE_DATA : NULL;
+  e->map_len = len;
+  e->key = key;
+  return 0;
+}
+
+int shmcache_lookup(const char *path, Shm_Entry *e)
+{
+  *e = (Shm_Entry){0};
+
+  uint64_t key;
+  Shm_Index *idx;
+  if (shm_budget() == 0 || diskcache_key(path, &key) < 0 || !(idx = index_open())) return 0;
+
+  index_lock(idx);
+  Shm_Slot *slot = slot_find(idx, key);
+
+  int attached = 0;
+  if (slot && entry_map(e, key, 0, 0) == 0) {
+    int state = atomic_load(&e->head->state);
+
+    // nobody will ever finish it
+    if (state == SHM_FAILED || (state == SHM_WRITING && !pid_alive(e->head->writer))) {
+      munmap(e->head, e->map_len);
+      slot_free(slot);
+    }
+    else {
+      e->capacity = (e->map_len - SHMCACHE_DATA) / e->head->head.frame_bytes;
+      slot->used = ++idx->clock;
+      slot_users(slot);
+      slot_user(slot, getpid(), 1);
+      attached = 1;
+    }
+  }
+  else if (slot) {
+    slot_free(slot); // in the index, but the segment is gone
+  }
+  index_unlock(idx);
+
+  if (!attached) *e = (Shm_Entry){0};
+  else stats_add(shm_hits, 1);
+  return attached;
+}
+
+void shmcache_release(Shm_Entry *e)
+{
+  if (!e->head) return;
+
+  Shm_Index *idx = index_open();
+  if (idx) {
+    index_lock(idx);
+    Shm_Slot *slot = slot_find(idx, e->key);
+    if (slot) slot_user(slot, getpid(), 0);
+    index_unlock(idx);
+  }
+
+  munmap(e->head, e->map_len);
+  *e = (Shm_Entry){0};
+}
+
+int64_t shmcache_ready(const Shm_Entry *e)
+{
+  return atomic_load_explicit(&e->head->ready, memory_order_acquire);
+}
+
+int shmcache_complete(const Shm_Entry *e)
+{
+  return atomic_load_explicit(&e->head->state, memory_order_acquire) == SHM_READY;
+}
+
+int shmcache_alive(const Shm_Entry *e)
+{
+  int state = atomic_load(&e->head->state);
+  if (state == SHM_READY) return 1;
+  return state == SHM_WRITING && pid_alive(e->head->writer);
+}
+
+void shmcache_writer_begin(Shm_Entry *e, const char *path, int sample_rate, int channels,
+                           int sample_fmt, int frame_bytes, int64_t expected, int64_t loop_a, int64_t loop_b)
+{
+  *e = (Shm_Entry){0};
+
+  uint64_t key;
+  Shm_Index *idx;
+  if (shm_budget() == 0 || expected <= 0 || diskcache_key(path, &key) < 0 || !(idx = index_open()))
+    return;
+
+  // the duration is a guess: a little slack, tmpfs only uses the pages we touch
+  int64_t capacity = expected + expected / 32 + sample_rate;
+  size_t len = SHMCACHE_DATA + (size_t)capacity * frame_bytes;
+  if (len > shm_budget() / 2) return;
+
+  index_lock(idx);
+
+  Shm_Slot *slot = NULL;
+  if (!slot_find(idx, key)) {
+    make_room(idx, len);
+    for (int i = 0; i < SHM_SLOTS && !slot; i++)
+      if (!idx->slots[i].state) slot = &idx->slots[i];
+  }
+
+  if (slot && entry_map(e, key, 1, len) == 0) {
+    e->head->head = (Disk_Cache_Header){
+      .magic = DISKCACHE_MAGIC,
+      .version = DISKCACHE_VERSION,
+      .sample_rate = sample_rate,
+      .channels = channels,
+      .sample_fmt = sample_fmt,
+      .frame_bytes = frame_bytes,
+      .samples = expected,
+      .loop_a = loop_a,
+      .loop_b = loop_b,
+    };
+    e->head->writer = getpid();
+    atomic_store(&e->head->ready, 0);
+    atomic_store(&e->head->state, SHM_WRITING);
+
+    *slot = (Shm_Slot){ .key = key, .bytes = len, .used = ++idx->clock, .state = SHM_WRITING };
+    slot_user(slot, getpid(), 1);
+
+    e->capacity = capacity;
+    e->writing = 1;
+  }
+  else {
+    *e = (Shm_Entry){0};
+  }
+  index_unlock(idx);
+}
+
+void shmcache_writer_append(Shm_Entry *e, const uint8_t *pcm, int64_t samples, int64_t start)
+{
+  if (!e->writing || samples <= 0) return;
+
+  int64_t ready = atomic_load_explicit(&e->head->ready, memory_order_relaxed);
+  if (start != ready || ready + samples > e->capacity) {
+    shmcache_writer_abort(e);
+    return;
+  }
+
+  int frame_bytes = e->head->head.frame_bytes;
+  memcpy(e->wpcm + ready * frame_bytes, pcm, samples * frame_bytes);
+
+  // followers read up to ready: publish after the copy
+  atomic_store_explicit(&e->head->ready, ready + samples, memory_order_release);
+}
+
+void shmcache_writer_finish(Shm_Entry *e, int64_t end)
+{
+  if (!e->writing) return;
+
+  if (end != shmcache_ready(e) || end == 0) {
+    shmcache_writer_abort(e);
+    return;
+  }
+
+  Shm_Index *idx = index_open();
+  index_lock(idx);
+
+  e->head->head.samples = end;
+  atomic_store_explicit(&e->head->state, SHM_READY, memory_order_release);
+
+  Shm_Slot *slot = slot_find(idx, e->key);
+  if (slot) slot->state = SHM_READY;
+
+  index_unlock(idx);
+
+  // keep the mapping: we play it too (as a reader from now on)
+  e->writing = 0;
+  e->wpcm = NULL;
+  stats_add(shm_bytes_shared, SHMCACHE_DATA + end * e->head->head.frame_bytes);
+}
+
+void shmcache_writer_abort(Shm_Entry *e)
+{
+  if (!e->writing) return;
+
+  // followers see it and decode the rest themselves
+  atomic_store(&e->head->state, SHM_FAILED);
+
+  Shm_Index *idx = index_open();
+  index_lock(idx);
+  Shm_Slot *slot = slot_find(idx, e->key);
+  if (slot) slot_free(slot);
+  index_unlock(idx);
+
+  munmap(e->head, e->map_len);
+  *e = (Shm_Entry){0};
+}
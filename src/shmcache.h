@@ -0,0 +1,59 @@
+#ifndef SHMCACHE_H
+#define SHMCACHE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "diskcache.h"
+
+// decoded PCM shared by every tomu session of the user, in POSIX shared
+// memory (/dev/shm/tomu-<uid>-<key>) with one index segment next to it.
+// the first session decodes into an entry, the others map the same pages
+// read-only, even while it is still being written (they follow the writer).
+// --shm-cache MB is the budget of all entries together (0 = off).
+// evicting only unlinks: a session which has an entry mapped keeps it.
+
+#define SHMCACHE_DATA 4096           // PCM starts at a page boundary
+
+enum { SHM_WRITING = 1, SHM_READY, SHM_FAILED };
+
+// first page of an entry
+typedef struct {
+  Disk_Cache_Header head;            // samples: expected while writing, exact once ready
+  atomic_llong ready;                // samples written so far
+  atomic_int state;                  // SHM_*
+  pid_t writer;
+
+} Shm_Entry_Header;
+
+typedef struct {
+  Shm_Entry_Header *head;
+  const uint8_t *pcm;
+  uint8_t *wpcm;                     // writer only
+  size_t map_len;
+  int64_t capacity;                  // samples the segment holds
+  uint64_t key;
+  int writing;
+
+} Shm_Entry;
+
+// 1: attached to an entry, ready or being written by another session
+int shmcache_lookup(const char *path, Shm_Entry *e);
+void shmcache_release(Shm_Entry *e);
+
+// followers: what can be played now, 1 once it is all there,
+// 0 from alive when the writer died or gave up before the end
+int64_t shmcache_ready(const Shm_Entry *e);
+int shmcache_complete(const Shm_Entry *e);
+int shmcache_alive(const Shm_Entry *e);
+
+// the session decoding a file nobody shares yet
+void shmcache_writer_begin(Shm_Entry *e, const char *path, int sample_rate, int channels,
+                           int sample_fmt, int frame_bytes, int64_t expected, int64_t loop_a, int64_t loop_b);
+void shmcache_writer_append(Shm_Entry *e, const uint8_t *pcm, int64_t samples, int64_t start);
+void shmcache_writer_finish(Shm_Entry *e, int64_t end);
+void shmcache_writer_abort(Shm_Entry *e);
+
+#endif
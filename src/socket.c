@@ -1,78 +1,435 @@
+#define _GNU_SOURCE // accept4
 #include <errno.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
 #include <poll.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "socket.h"
 #include "backend.h"
+#include "backend_utils.h"
 #include "control.h"
+#include "cue.h"
+#include "instance.h"
+#include "events.h"
+#include "stats.h"
 #include "utils.h"
 
+#define MAX_CLIENTS 32
+#define CLIENT_OUT_SIZE 8192 // per client bounded queue of answers and events
+
+typedef struct {
+  int fd;
+  char in[256];            // partial command line
+  int in_len;
+  char out[CLIENT_OUT_SIZE];
+  int out_len;
+  Event_Type events;       // what this client subscribed to
+  int tick_ms;             // position events interval
+  int64_t next_tick;
+
+} Socket_Client;
+
+static char socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static atomic_int socket_running;
+static pthread_t sock_thread;
+
+// the state of the file playing now (NULL between two files)
+static PlayBackState *attached;
+static pthread_mutex_t attach_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void unlink_socket(void){
+	if (socket_path[0]) unlink(socket_path);
+}
+
 void cleanup_socket(int sig){
-	unlink(SOCKET_PATH);
+	unlink_socket();
 	die("");
 }
 
-// TODO: change the fn name 
-// TODO: abstract input reading from "control.c" to be used in here as well since we have code duplication
+void socket_start(void)
+{
+	// every instance gets its own socket, $XDG_RUNTIME_DIR/tomu/tomu-<pid>.sock
+	if (instance_path(socket_path, sizeof(socket_path), getpid(), INSTANCE_SOCK_SUFFIX) < 0) {
+		warn("Socket: no runtime directory, controls disabled");
+		socket_path[0] = '\0';
+		return;
+	}
+
+	if (events_init() < 0)
+		warn("Socket: events disabled");
+
+	atexit(unlink_socket); // die() exits too
+	atomic_store(&socket_running, 1);
+	pthread_create(&sock_thread, NULL, run_socket, NULL);
+}
+
+void socket_stop(void)
+{
+	if (!atomic_exchange(&socket_running, 0)) return;
+	pthread_join(sock_thread, NULL);
+	events_destroy();
+	unlink_socket();
+}
+
+void socket_attach(PlayBackState *state)
+{
+	pthread_mutex_lock(&attach_lock);
+	attached = state;
+	pthread_mutex_unlock(&attach_lock);
+}
+
+void socket_detach(void)
+{
+	pthread_mutex_lock(&attach_lock);
+	attached = NULL;
+	pthread_mutex_unlock(&attach_lock);
+}
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// append to the client queue, -1 when there is no room (never waits)
+static int client_queue(Socket_Client *c, const char *fmt, ...)
+{
+	int room = CLIENT_OUT_SIZE - c->out_len;
+
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(c->out + c->out_len, room, fmt, ap);
+	va_end(ap);
+
+	if (n < 0 || n >= room) return -1;
+	c->out_len += n;
+	return 0;
+}
+
+static void client_close(Socket_Client *c)
+{
+	if (c->fd >= 0) close(c->fd);
+	c->fd = -1;
+}
+
+// write what the socket takes now, keep the rest for POLLOUT
+static void client_flush(Socket_Client *c)
+{
+	if (c->fd < 0 || c->out_len == 0) return;
+
+	ssize_t n = send(c->fd, c->out, c->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) client_close(c);
+		return;
+	}
+
+	memmove(c->out, c->out + n, c->out_len - n);
+	c->out_len -= n;
+}
+
+// "subscribe track,pause,position:4"
+static int subscribe(Socket_Client *c, char *list)
+{
+	Event_Type events = 0;
+	int hz = 1;
+	char *save = NULL;
+
+	for (char *name = strtok_r(list, ", ", &save); name; name = strtok_r(NULL, ", ", &save)) {
+		char *rate = strchr(name, ':');
+		if (rate) {
+			*rate++ = '\0';
+			hz = atoi(rate);
+		}
+
+		Event_Type type = event_parse(name);
+		if (!type) return -1;
+		events |= type;
+	}
+
+	if (hz < 1) hz = 1;
+	if (hz > 50) hz = 50;
+
+	c->events = events ? events : EVENT_ALL;
+	c->tick_ms = 1000 / hz;
+	c->next_tick = now_ms();
+	return 0;
+}
+
+// run one command line and queue the answer
+static void handle_command(Socket_Client *c, char *line)
+{
+	int ret;
+
+	if (!strncmp(line, "subscribe", 9) && (line[9] == ' ' || line[9] == '\0')) {
+		if (subscribe(c, line + 9) < 0)
+			ret = client_queue(c, "err unknown event\n");
+		else
+			ret = client_queue(c, "ok\n");
+	}
+
+	else if (!strcmp(line, "unsubscribe")) {
+		c->events = 0;
+		ret = client_queue(c, "ok\n");
+	}
+
+	// session counters, there is no need to be playing
+	else if (!strcmp(line, "stats")) {
+		char counters[2048];
+		stats_format(counters, sizeof(counters));
+		ret = client_queue(c, "ok %s\n", counters);
+	}
+
+	else {
+		pthread_mutex_lock(&attach_lock);
+
+		if (!attached)
+			ret = client_queue(c, "err not playing\n");
+
+		else if (!strcmp(line, "status"))
+			ret = client_queue(c, "ok %d %s %s\n", (int)getpid(),
+				attached->paused ? "paused" : "playing",
+				attached->filename ? attached->filename : "-");
+
+		// jitter buffer health (any source has the buffer, only network ones pre-roll)
+		else if (!strcmp(line, "buffer")) {
+			Buffer_Health health = audio_buffer_seen(attached->buf);
+			ret = client_queue(c, "ok buffered_ms=%d capacity_ms=%d preroll_ms=%d state=%s rebuffers=%d net_reconnects=%llu\n",
+				health.buffered_ms, health.capacity_ms, health.preroll_ms,
+				health.prerolling ? "prerolling" : "playing", health.rebuffers,
+				(unsigned long long)atomic_load_explicit(&Stats.net_reconnects, memory_order_relaxed));
+		}
+
+		// a CUE sheet plays: "track N" goes to its TRACK N
+		else if (!strncmp(line, "track ", 6)) {
+			int number = atoi(line + 6);
+			if (!attached->cue || cue_track_find(attached->cue, number) < 0)
+				ret = client_queue(c, "err no track %d\n", number);
+			else {
+				playback_track(attached, number);
+				ret = client_queue(c, "ok\n");
+			}
+		}
+
+		// chapters (numbered from 1) and seeks from the start of the file
+		else if (!strncmp(line, "chapter ", 8)) {
+			int number = atoi(line + 8);
+			if (number < 1 || number > attached->chapter_count)
+				ret = client_queue(c, "err no chapter %d\n", number);
+			else {
+				playback_chapter(attached, number);
+				ret = client_queue(c, "ok\n");
+			}
+		}
+
+		else if (!strncmp(line, "goto ", 5)) {
+			double seconds = atof(line + 5);
+			if (seconds < 0)
+				ret = client_queue(c, "err bad position\n");
+			else {
+				playback_goto(attached, seconds);
+				ret = client_queue(c, "ok\n");
+			}
+		}
+
+		else if (control_dispatch(attached, line) == 0)
+			ret = client_queue(c, "ok\n");
+
+		else
+			ret = client_queue(c, "err unknown command '%s'\n", line);
+
+		pthread_mutex_unlock(&attach_lock);
+	}
+
+	// it sends commands faster than it reads the answers
+	if (ret < 0) client_close(c);
+}
+
+static void client_read(Socket_Client *c)
+{
+	int n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len, MSG_DONTWAIT);
+
+	if (n <= 0) {
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			// the last command may come without '\n'
+			if (c->in_len > 0) {
+				c->in[c->in_len] = '\0';
+				handle_command(c, c->in);
+				client_flush(c);
+			}
+			client_close(c);
+		}
+		return;
+	}
+	c->in_len += n;
+	c->in[c->in_len] = '\0';
+
+	// one command per line
+	char *line = c->in, *nl;
+	while (c->fd >= 0 && (nl = strchr(line, '\n')) != NULL) {
+		*nl = '\0';
+		if (nl > line) handle_command(c, line);
+		line = nl + 1;
+	}
+	if (c->fd < 0) return;
+
+	c->in_len -= line - c->in;
+	memmove(c->in, line, c->in_len);
+
+	// a line longer than the buffer is garbage
+	if (c->in_len == sizeof(c->in) - 1) client_close(c);
+}
+
+// events are only queued, a client which can't keep up is dropped,
+// it never slows the player down
+static void fan_out(Socket_Client *clients, int count, const Event *ev)
+{
+	for (int i = 0; i < count; i++) {
+		Socket_Client *c = &clients[i];
+		if (c->fd < 0 || !(c->events & ev->type)) continue;
+
+		int ret;
+		if (ev->type == EVENT_TRACK)
+			ret = client_queue(c, "event track %s\n", ev->text);
+		else if (ev->type == EVENT_CHAPTER)
+			ret = client_queue(c, "event chapter %d %s\n", (int)ev->value, ev->text);
+		else if (ev->type == EVENT_SEEK || ev->type == EVENT_STALL || ev->type == EVENT_STALL_END)
+			ret = client_queue(c, "event %s %.3f\n", event_name(ev->type), ev->value);
+		else
+			ret = client_queue(c, "event %s\n", event_name(ev->type));
+
+		if (ret < 0) client_close(c);
+	}
+}
+
+// position events are made here at each client rate; when the client
+// queue is full the tick is skipped, the next one carries the newer position
+static int position_ticks(Socket_Client *clients, int count)
+{
+	int64_t now = now_ms();
+	int timeout = Options.burst_sec > 0 ? 1000 : 80; // power save: only the clients' rates wake us
+
+	pthread_mutex_lock(&attach_lock);
+	for (int i = 0; i < count; i++) {
+		Socket_Client *c = &clients[i];
+		if (c->fd < 0 || !(c->events & EVENT_POSITION)) continue;
+
+		if (now >= c->next_tick) {
+			if (attached && !attached->paused) {
+				PlayBack_Snapshot snap = playback_snapshot(attached);
+				client_queue(c, "event position %.3f %d\n", snap.position, snap.duration);
+			}
+			c->next_tick = now + c->tick_ms;
+		}
+
+		if (c->next_tick - now < timeout)
+			timeout = c->next_tick - now;
+	}
+	pthread_mutex_unlock(&attach_lock);
+
+	return timeout;
+}
+
 void *run_socket(void *arg)
 {
-	PlayBackState *state = (PlayBackState*)arg;
-	unlink(SOCKET_PATH);
+	(void)arg;
 	signal(SIGTERM, cleanup_socket);
 	signal(SIGINT, cleanup_socket);
 
 	struct sockaddr_un addr = {0}; // why zero mem at runtime????
-    // memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
-    strcpy(addr.sun_path, SOCKET_PATH);
-	
+    strcpy(addr.sun_path, socket_path);
+
 	int sock;
 	if ((sock = socket(AF_UNIX, SOCK_STREAM , 0)) <0 ){
-		warn("Socket","failed: %s", strerror(errno));
+		warn("Socket: failed: %s", strerror(errno));
+		return NULL;
 	}
 
-	if (bind(sock, (struct sockaddr*)&addr , sizeof(addr)) < 0)
-		warn("Bind","failed: %s", strerror(errno));
+	// only a dead instance with our pid could have left this behind
+	unlink(socket_path);
+
+	if (bind(sock, (struct sockaddr*)&addr , sizeof(addr)) < 0) {
+		warn("Bind: failed: %s", strerror(errno));
+		close(sock);
+		return NULL;
+	}
 
 	if (listen(sock, 10) < 0) {
-		warn("Listen","failed: %s", strerror(errno));
+		warn("Listen: failed: %s", strerror(errno));
     }
 
-    struct pollfd pfd = {
-        .fd = sock,
-        .events = POLLIN
-    };
+    // static: ~270KB is too much for a thread stack
+    static Socket_Client clients[MAX_CLIENTS];
+    int count = 0;
+    int timeout = 80;
+
+    // [0] new clients, [1] events, then one per client
+    struct pollfd pfds[MAX_CLIENTS + 2];
 
-    char buf[256]; // less stack movement
     // stop messing indentation!!!!!
-	while (1) {
-        int ret = poll(&pfd, 1, 80);
-        
-        if (!state->running) break;
+	while (atomic_load(&socket_running)) {
+        pfds[0] = (struct pollfd){ .fd = sock, .events = POLLIN };
+        pfds[1] = (struct pollfd){ .fd = events_fd(), .events = POLLIN };
+        for (int i = 0; i < count; i++)
+          pfds[i + 2] = (struct pollfd){
+            .fd = clients[i].fd,
+            .events = POLLIN | (clients[i].out_len ? POLLOUT : 0)
+          };
 
-        if (ret > 0 && (pfd.revents & POLLIN)) {
-          int client = accept(sock, NULL, NULL);
+        int ret = poll(pfds, count + 2, timeout);
+
+        if (ret < 0) {
+          if (errno != EINTR) perror("[F] poll error");
+          continue;
+        }
+
+        if (pfds[1].revents & POLLIN) events_ack();
+
+        for (int i = 0; i < count; i++) {
+          if (pfds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))
+            client_read(&clients[i]);
+        }
+
+        // events go out even without a wake up, the audio callback can't wake us
+        Event ev;
+        while (event_next(&ev))
+          fan_out(clients, count, &ev);
+
+        timeout = position_ticks(clients, count);
+
+        for (int i = 0; i < count; i++)
+          client_flush(&clients[i]);
+
+        // forget closed clients
+        int alive = 0;
+        for (int i = 0; i < count; i++)
+          if (clients[i].fd >= 0) clients[alive++] = clients[i];
+        count = alive;
+
+        if (pfds[0].revents & POLLIN) {
+          int client = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
           if (client < 0) continue;
 
-          int n;
-          while ((n = recv(client, buf, sizeof(buf)-1, 0)) > 0) {
-            buf[n] = '\0';
-            if (!strncmp(buf, "q", 1)) die("");
-            if (!strncmp(buf, " ", 1)) playback_toggle(state);
+          if (count == MAX_CLIENTS) {
+            close(client);
+            continue;
           }
-          close(client);
+          clients[count++] = (Socket_Client){ .fd = client };
         }
-        else if (ret == 0)
-          continue;
-
-        else 
-          perror("[F] poll error");
     }
 
+    for (int i = 0; i < count; i++)
+      client_close(&clients[i]);
 	close(sock);
 
     return NULL;
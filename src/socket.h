@@ -1,7 +1,14 @@
 #ifndef SOCKET_H
 #define SOCKET_H
 
-#define SOCKET_PATH "/tmp/tomu-sock"
+#include "backend.h"
+
+// the socket lives as long as the session (all files of a directory),
+// each playback_run attaches its state while it plays
+void socket_start(void);
+void socket_stop(void);
+void socket_attach(PlayBackState *state);
+void socket_detach(void);
 
 void *run_socket(void *arg);
 #endif
@@ -0,0 +1,65 @@
+#include <libavformat/avformat.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "cue.h"
+#include "source.h"
+
+// seconds ffmpeg keeps trying to reconnect a broken connection
+#define NET_RECONNECT_MAX_SEC "10"
+
+static const char *net_schemes[] = { "http://", "https://", NULL };
+
+int source_kind(const char *path)
+{
+  if (!strcmp(path, "-")) return SOURCE_PIPE;
+
+  for (int i = 0; net_schemes[i]; i++)
+    if (!strncasecmp(path, net_schemes[i], strlen(net_schemes[i])))
+      return SOURCE_NET;
+
+  struct stat st;
+  char outer[PATH_MAX]; // the sheet or the archive the path goes through
+  int number;
+  if (stat(path, &st) < 0) {
+    // a track of a CUE sheet plays the sheet's file
+    if (cue_split(path, outer, sizeof(outer), &number))
+      return stat(outer, &st) == 0 ? SOURCE_FILE : -1;
+    return archive_split(path, outer, sizeof(outer), NULL) ? SOURCE_ARCHIVE : -1;
+  }
+  if (S_ISREG(st.st_mode)) return SOURCE_FILE;
+  if (S_ISFIFO(st.st_mode)) return SOURCE_PIPE;
+  return -1;
+}
+
+const char *source_url(const char *path)
+{
+  return strcmp(path, "-") ? path : "pipe:0";
+}
+
+AVDictionary *source_options(int kind)
+{
+  AVDictionary *opts = NULL;
+  if (kind != SOURCE_NET) return NULL;
+
+  // a dropped connection comes back at the byte it broke at (Range: bytes=N-),
+  // a live stream (no ranges) is opened again and goes on from "now"
+  av_dict_set(&opts, "reconnect", "1", 0);
+  av_dict_set(&opts, "reconnect_streamed", "1", 0);
+  av_dict_set(&opts, "reconnect_on_network_error", "1", 0);
+  av_dict_set(&opts, "reconnect_delay_max", NET_RECONNECT_MAX_SEC, 0);
+
+  // seeks are Range requests on the same connection
+  av_dict_set(&opts, "multiple_requests", "1", 0);
+  av_dict_set(&opts, "seekable", "-1", 0);
+  av_dict_set(&opts, "icy", "1", 0);
+  return opts;
+}
+
+void source_net_init(void)
+{
+  avformat_network_init();
+}
@@ -0,0 +1,30 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <libavutil/dict.h>
+
+// where the audio comes from. only regular files have a size, a mtime
+// and a st_dev: the caches, --preload/--io and the stall history are for
+// them. the rest is read once, front to back, by ffmpeg
+//   SOURCE_PIPE  "-" (stdin) or a FIFO: no seeking, rewinds from the history only
+//   SOURCE_NET   http(s)://, Icecast/SHOUTcast too: a jitter buffer of
+//                --net-buffer seconds is pre-rolled before playing, a broken
+//                connection is resumed with a Range request (ffmpeg's http
+//                protocol does it), seeking works when the server takes ranges
+//   SOURCE_ARCHIVE  an entry of a zip or tar (archive.h), read in place
+// a track of a CUE sheet (cue.h) is the SOURCE_FILE the sheet cuts
+enum { SOURCE_FILE, SOURCE_PIPE, SOURCE_NET, SOURCE_ARCHIVE };
+
+// SOURCE_*, -1 when there is nothing to play there
+int source_kind(const char *path);
+
+// what ffmpeg is given to open it ("-" is "pipe:0")
+const char *source_url(const char *path);
+
+// avformat_open_input options of a source, the caller frees them
+AVDictionary *source_options(int kind);
+
+// once, before the first network source: TLS
+void source_net_init(void);
+
+#endif
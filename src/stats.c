@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "stats.h"
+
+Play_Stats Stats;
+static struct timespec started;
+
+void stats_start(void)
+{
+  clock_gettime(CLOCK_MONOTONIC, &started);
+}
+
+#define LOAD(counter) \
+  (unsigned long long)atomic_load_explicit(&Stats.counter, memory_order_relaxed)
+
+int stats_format(char *out, size_t len)
+{
+  unsigned long long lookups = LOAD(cache_lookups);
+
+  // CPU, faults and switches of the whole process (the audio callback too)
+  struct rusage ru = {0};
+  getrusage(RUSAGE_SELF, &ru);
+
+  // wakeups per second: every voluntary switch is a sleep we came back from
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9;
+  if (elapsed <= 0) elapsed = 1;
+
+  return snprintf(out, len,
+    "seek_keys=%llu seek_ops=%llu seek_previews=%llu rewinds=%llu loop_cache_passes=%llu ab_wraps=%llu"
+    " cache_lookups=%llu cache_hits=%llu cache_ram_hits=%llu cache_hit_rate=%.0f%%"
+    " cpu_saved_ms=%llu cache_bytes_written=%llu"
+    " shm_hits=%llu shm_follows=%llu shm_bytes_shared=%llu"
+    " io_bytes=%llu io_seeks=%llu preload_fills=%llu preload_waits=%llu io_syscalls=%llu"
+    " uring_waits=%llu uring_cancels=%llu stalls=%llu stall_ms=%llu stall_max_ms=%llu"
+    " net_rebuffers=%llu net_reconnects=%llu archive_index_builds=%llu archive_index_hits=%llu cue_jumps=%llu"
+    " chapter_jumps=%llu seek_index_loads=%llu seek_index_saves=%llu format_changes=%llu"
+    " scan_dirs=%llu scan_entries=%llu scan_sniffs=%llu scan_ms=%llu scan_rate=%.0f/s"
+    " library_loads=%llu library_saves=%llu library_dirs_reused=%llu library_load_ms=%llu library_probes=%llu"
+    " decoded_ms=%llu decoder_cpu_ms=%llu decode_speed=%.0fx cpu_user_ms=%ld cpu_sys_ms=%ld"
+    " rt_realtime=%llu rt_nice=%llu rt_locked_bytes=%llu rt_locked_peak=%llu"
+    " decoder_minflt=%llu decoder_majflt=%llu decoder_nvcsw=%llu decoder_nivcsw=%llu"
+    " minflt=%ld majflt=%ld nvcsw=%ld nivcsw=%ld"
+    " decoder_wakeups=%llu elapsed_ms=%.0f wakeups_per_sec=%.1f decoder_wakeups_per_sec=%.1f",
+    LOAD(seek_keys), LOAD(seek_ops), LOAD(seek_previews), LOAD(rewinds),
+    LOAD(loop_cache_passes), LOAD(ab_wraps),
+    lookups, LOAD(cache_hits), LOAD(cache_ram_hits),
+    lookups ? 100.0 * LOAD(cache_hits) / lookups : 0.0,
+    LOAD(cpu_saved_ms), LOAD(cache_bytes_written),
+    LOAD(shm_hits), LOAD(shm_follows), LOAD(shm_bytes_shared),
+    LOAD(io_bytes), LOAD(io_seeks), LOAD(preload_fills), LOAD(preload_waits), LOAD(io_syscalls),
+    LOAD(uring_waits), LOAD(uring_cancels), LOAD(stalls), LOAD(stall_ms), LOAD(stall_max_ms),
+    LOAD(net_rebuffers), LOAD(net_reconnects), LOAD(archive_index_builds), LOAD(archive_index_hits), LOAD(cue_jumps),
+    LOAD(chapter_jumps), LOAD(seek_index_loads), LOAD(seek_index_saves), LOAD(format_changes),
+    LOAD(scan_dirs), LOAD(scan_entries), LOAD(scan_sniffs), LOAD(scan_ms),
+    LOAD(scan_ms) ? LOAD(scan_entries) * 1000.0 / LOAD(scan_ms) : 0.0,
+    LOAD(library_loads), LOAD(library_saves), LOAD(library_dirs_reused), LOAD(library_load_ms), LOAD(library_probes),
+    LOAD(decoded_ms), LOAD(decoder_cpu_ms),
+    LOAD(decoder_cpu_ms) ? (double)LOAD(decoded_ms) / LOAD(decoder_cpu_ms) : 0.0,
+    ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000,
+    ru.ru_stime.tv_sec * 1000 + ru.ru_stime.tv_usec / 1000,
+    LOAD(rt_realtime), LOAD(rt_nice), LOAD(rt_locked_bytes), LOAD(rt_locked_peak),
+    LOAD(decoder_minflt), LOAD(decoder_majflt), LOAD(decoder_nvcsw), LOAD(decoder_nivcsw),
+    ru.ru_minflt, ru.ru_majflt, ru.ru_nvcsw, ru.ru_nivcsw,
+    LOAD(decoder_wakeups), elapsed * 1000, ru.ru_nvcsw / elapsed, LOAD(decoder_wakeups) / elapsed);
+}
+
+void stats_print(void)
+{
+  char line[2048];
+  stats_format(line, sizeof(line));
+
+  // one counter per line, easier to read in a terminal
+  fprintf(stderr, "\n[stats]\n");
+  for (char *p = line; *p; p++)
+    fputc(*p == ' ' ? '\n' : *p, stderr);
+  fputc('\n', stderr);
+}
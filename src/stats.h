@@ -0,0 +1,88 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// counters for the whole session, bumped from any thread.
+// printed at exit with --stats and answered on the socket ("stats")
+typedef struct {
+  atomic_uint_fast64_t seek_keys;      // seek commands received (keys, socket)
+  atomic_uint_fast64_t seek_ops;       // seeks the demuxer really did
+  atomic_uint_fast64_t seek_previews;  // of those, scrub previews
+  atomic_uint_fast64_t rewinds;        // seeks served from the rewind history
+  atomic_uint_fast64_t loop_cache_passes; // loop passes played from memory
+  atomic_uint_fast64_t ab_wraps;       // A-B loop jumps back to A
+  atomic_uint_fast64_t cache_lookups;  // disk PCM cache
+  atomic_uint_fast64_t cache_hits;
+  atomic_uint_fast64_t cache_ram_hits; // of those, still mapped from before
+  atomic_uint_fast64_t cpu_saved_ms;   // decoder CPU time the hits didn't spend
+  atomic_uint_fast64_t cache_bytes_written;
+  atomic_uint_fast64_t shm_hits;       // files another session decoded (or decodes) for us
+  atomic_uint_fast64_t shm_follows;    // of those, still being written when we attached
+  atomic_uint_fast64_t shm_bytes_shared; // entries we decoded for the others
+  atomic_uint_fast64_t io_bytes;       // read from the files played
+  atomic_uint_fast64_t io_seeks;
+  atomic_uint_fast64_t preload_fills;  // --preload: reads of the whole file or of a window
+  atomic_uint_fast64_t preload_waits;  // the demuxer caught up with the window read ahead
+  atomic_uint_fast64_t io_syscalls;    // read/pread/mmap/io_uring_enter of our own AVIO (not with --io ffmpeg)
+  atomic_uint_fast64_t uring_waits;    // --io uring: the demuxer had to wait for a read
+  atomic_uint_fast64_t uring_cancels;  // reads in flight dropped by a seek
+  atomic_uint_fast64_t stalls;         // demuxer reads blocked past their buffer deadline
+  atomic_uint_fast64_t stall_ms;
+  atomic_uint_fast64_t stall_max_ms;
+  atomic_uint_fast64_t net_rebuffers;  // network jitter buffer ran dry, pre-rolled again
+  atomic_uint_fast64_t net_reconnects; // live streams opened again after ffmpeg gave up (decoder_reconnect)
+  atomic_uint_fast64_t archive_index_builds; // zip/tar indexes read from the archive
+  atomic_uint_fast64_t archive_index_hits;   // and found in memory
+  atomic_uint_fast64_t cue_jumps;      // CUE tracks gone to by a seek in the open file
+  atomic_uint_fast64_t chapter_jumps;  // next/prev chapter, "chapter N"
+  atomic_uint_fast64_t seek_index_loads; // long files which had a seek index saved
+  atomic_uint_fast64_t seek_index_saves;
+  atomic_uint_fast64_t scan_dirs;      // folders read for the playlist (subfolders too)
+  atomic_uint_fast64_t scan_entries;   // the entries in them
+  atomic_uint_fast64_t scan_sniffs;    // files opened to tell audio by its first bytes
+  atomic_uint_fast64_t scan_ms;
+  atomic_uint_fast64_t library_loads;  // folders whose library index was there to start from
+  atomic_uint_fast64_t library_saves;
+  atomic_uint_fast64_t library_dirs_reused; // folders not read again, their mtime didn't change
+  atomic_uint_fast64_t library_load_ms;
+  atomic_uint_fast64_t library_probes; // files the background prober opened
+  atomic_uint_fast64_t format_changes; // streams which changed rate/layout/sample format while playing
+  atomic_uint_fast64_t decoded_ms;     // audio the decoders made
+  atomic_uint_fast64_t decoder_cpu_ms; // and the CPU time they took
+  atomic_uint_fast64_t rt_realtime;    // --rt: decoder threads which got SCHED_FIFO/RR
+  atomic_uint_fast64_t rt_nice;        // or only a lower nice value
+  atomic_uint_fast64_t rt_locked_bytes; // locked now (0 at exit when all is freed)
+  atomic_uint_fast64_t rt_locked_peak;  // the most at once
+  atomic_uint_fast64_t decoder_minflt; // page faults and context switches of the decoder threads
+  atomic_uint_fast64_t decoder_majflt;
+  atomic_uint_fast64_t decoder_nvcsw;
+  atomic_uint_fast64_t decoder_nivcsw;
+  atomic_uint_fast64_t decoder_wakeups; // the decoder woke up waiting for room in the buffer
+
+} Play_Stats;
+
+extern Play_Stats Stats;
+
+#define stats_add(counter, n) \
+  atomic_fetch_add_explicit(&Stats.counter, (n), memory_order_relaxed)
+#define stats_sub(counter, n) \
+  atomic_fetch_sub_explicit(&Stats.counter, (n), memory_order_relaxed)
+
+static inline void stats_max_of(atomic_uint_fast64_t *counter, uint64_t n)
+{
+  uint_fast64_t old = atomic_load_explicit(counter, memory_order_relaxed);
+  while (old < n && !atomic_compare_exchange_weak_explicit(counter, &old, n,
+                      memory_order_relaxed, memory_order_relaxed));
+}
+#define stats_max(counter, n) stats_max_of(&Stats.counter, (n))
+
+// "key=value key=value ...", one line without '\n'
+int stats_format(char *out, size_t len);
+// the session starts (wakeups per second are counted from here)
+void stats_start(void);
+void stats_print(void);
+
+#endif
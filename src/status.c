@@ -0,0 +1,121 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "backend_utils.h"
+#include "instance.h"
+#include "status.h"
+#include "utils.h"
+
+static Status_Page *page;
+static char page_path[512];
+
+// writers are the decoder and the control threads, readers are outside
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void unlink_page(void){
+  if (page_path[0]) unlink(page_path);
+}
+
+void status_open(void)
+{
+  if (instance_path(page_path, sizeof(page_path), getpid(), STATUS_SUFFIX) < 0) {
+    page_path[0] = '\0';
+    return;
+  }
+
+  // readers may map it, only we write it
+  int fd = open(page_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    warn("Status: %s:", page_path);
+    page_path[0] = '\0';
+    return;
+  }
+
+  if (ftruncate(fd, sizeof(Status_Page)) < 0) {
+    close(fd);
+    unlink_page();
+    return;
+  }
+
+  page = mmap(NULL, sizeof(Status_Page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (page == MAP_FAILED) {
+    page = NULL;
+    unlink_page();
+    return;
+  }
+
+  atexit(unlink_page);
+
+  page->pid = getpid();
+  page->version = STATUS_VERSION;
+  page->magic = STATUS_MAGIC; // last, readers check it first
+}
+
+void status_close(void)
+{
+  if (!page) return;
+
+  pthread_mutex_lock(&write_lock);
+    munmap(page, sizeof(Status_Page));
+    page = NULL;
+  pthread_mutex_unlock(&write_lock);
+
+  unlink_page();
+  page_path[0] = '\0';
+}
+
+// a text field of the page, written only when it changed
+static void page_text(char *field, size_t len, const char *text)
+{
+  if (!text) text = "";
+  if (strncmp(field, text, len - 1) == 0) return;
+  strncpy(field, text, len - 1);
+  field[len - 1] = '\0';
+}
+
+// copy the state into the page, called where the state changes
+// (decoder progress, controls). A write is a few stores, so a thread
+// waits for the other one instead of skipping: while paused no decoder
+// frame would come to write the state again.
+void status_publish(PlayBackState *state)
+{
+  if (!page) return;
+  pthread_mutex_lock(&write_lock);
+
+  if (page) {
+    PlayBack_Snapshot snap = playback_snapshot(state);
+
+    seqlock_write_begin(&page->seq);
+
+      page->position = snap.position;
+      page->duration = snap.duration;
+      page->speed = state->speed;
+      page->volume = state->volume;
+      page->paused = state->paused;
+      page->looping = state->looping;
+      page->shuffle = DirFiles.shuffle;
+      page->running = state->running;
+
+      const char *file = state->filename ? state->filename : "";
+      if (strncmp(page->file, file, sizeof(page->file) - 1) != 0) {
+        strncpy(page->file, file, sizeof(page->file) - 1);
+        page->file[sizeof(page->file) - 1] = '\0';
+      }
+
+      const Library_Tags *tags = library_tags(state->info);
+      page_text(page->title, sizeof(page->title), tags ? tags->title : NULL);
+      page_text(page->artist, sizeof(page->artist), tags ? tags->artist : NULL);
+      page_text(page->album, sizeof(page->album), tags ? tags->album : NULL);
+
+    seqlock_write_end(&page->seq);
+  }
+
+  pthread_mutex_unlock(&write_lock);
+}
@@ -0,0 +1,64 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+// shared memory status page: $XDG_RUNTIME_DIR/tomu/tomu-<pid>.status
+// status bars mmap it read-only and copy it with status_page_read(),
+// no socket round trip and no syscall per poll.
+// libc only: readers (tomuctl, bars) include this header too.
+
+#include <stdint.h>
+#include <string.h>
+#include "seqlock.h"
+
+#define STATUS_SUFFIX ".status"
+#define STATUS_MAGIC 0x756d6f74 // "tomu"
+#define STATUS_VERSION 2
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  atomic_uint seq;       // seqlock, odd while the player writes
+
+  int32_t pid;
+  double position;       // seconds
+  int32_t duration;      // seconds
+  float speed;
+  float volume;
+  uint8_t paused;
+  uint8_t shuffle;
+  uint8_t looping;
+  uint8_t running;
+  char file[1024];
+  char title[256];       // from the library index of the folder ("" not known)
+  char artist[256];
+  char album[256];
+
+} Status_Page;
+
+// consistent copy of a mapped page, -1 if it isn't a tomu page
+static inline int status_page_read(const Status_Page *page, Status_Page *out)
+{
+  if (page->magic != STATUS_MAGIC || page->version != STATUS_VERSION) return -1;
+
+  unsigned seq;
+  do {
+    seq = seqlock_read_begin(&page->seq);
+    memcpy(out, page, sizeof(*out));
+  } while (seqlock_read_retry(&page->seq, seq));
+
+  out->file[sizeof(out->file) - 1] = '\0';
+  out->title[sizeof(out->title) - 1] = '\0';
+  out->artist[sizeof(out->artist) - 1] = '\0';
+  out->album[sizeof(out->album) - 1] = '\0';
+  return 0;
+}
+
+#ifndef STATUS_READER_ONLY
+#include "backend.h"
+
+void status_open(void);
+void status_close(void);
+void status_publish(PlayBackState *state);
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+#include <pthread.h>
+
+#include "storage.h"
+
+#define STORAGE_MAX        16
+#define PREBUFFER_FIRST_MS 2000  // after the first stall
+#define PREBUFFER_MAX_MS   16000 // doubled at each stall up to this
+
+typedef struct {
+  dev_t dev;
+  int prebuffer_ms;
+  int stalls;
+
+} Storage_Health;
+
+static Storage_Health storages[STORAGE_MAX];
+static int storages_len;
+static pthread_mutex_t storages_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Storage_Health *find(dev_t dev, int add)
+{
+  for (int i = 0; i < storages_len; i++)
+    if (storages[i].dev == dev) return &storages[i];
+
+  if (!add) return NULL;
+
+  // full: forget the device which stalled the least
+  int slot = storages_len;
+  if (slot == STORAGE_MAX) {
+    slot = 0;
+    for (int i = 1; i < STORAGE_MAX; i++)
+      if (storages[i].stalls < storages[slot].stalls) slot = i;
+  }
+  else storages_len++;
+
+  storages[slot] = (Storage_Health){ .dev = dev };
+  return &storages[slot];
+}
+
+int storage_prebuffer_ms(dev_t dev)
+{
+  pthread_mutex_lock(&storages_lock);
+  Storage_Health *s = find(dev, 0);
+  int ms = s ? s->prebuffer_ms : 0;
+  pthread_mutex_unlock(&storages_lock);
+  return ms;
+}
+
+int storage_stalled(dev_t dev, int64_t ms)
+{
+  pthread_mutex_lock(&storages_lock);
+
+  Storage_Health *s = find(dev, 1);
+  s->stalls++;
+  s->prebuffer_ms = s->prebuffer_ms ? s->prebuffer_ms * 2 : PREBUFFER_FIRST_MS;
+  if (s->prebuffer_ms < ms * 2) s->prebuffer_ms = ms * 2; // ride out one like it
+  if (s->prebuffer_ms > PREBUFFER_MAX_MS) s->prebuffer_ms = PREBUFFER_MAX_MS;
+
+  int prebuffer = s->prebuffer_ms;
+  pthread_mutex_unlock(&storages_lock);
+  return prebuffer;
+}
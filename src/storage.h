@@ -0,0 +1,17 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// how the storage devices we play from behaved this session (keyed by
+// st_dev): a device whose reads stalled gets a bigger prebuffer, for the
+// rest of the file and for the next ones on it
+
+// the prebuffer (ms) files of this device start with, 0 the default
+int storage_prebuffer_ms(dev_t dev);
+
+// a read stalled for ms: returns the new prebuffer of the device
+int storage_stalled(dev_t dev, int64_t ms);
+
+#endif
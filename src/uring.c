@@ -0,0 +1,364 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "uring.h"
+
+#define URING_SLOTS     4            // reads in flight ahead of the position
+#define URING_SLOT_SIZE (1 << 20)
+#define URING_ENTRIES   (URING_SLOTS * 2) // the reads and their cancels
+#define URING_CANCEL    ~0ULL        // user_data of the cancel requests
+
+enum { SLOT_FREE, SLOT_INFLIGHT, SLOT_READY, SLOT_CANCELING };
+
+typedef struct {
+  uint8_t *data;
+  struct iovec iov;
+  int64_t off;
+  int want;                    // bytes asked for
+  int len;                     // bytes we got (READY)
+  int err;                     // -errno of a failed read
+  int state;
+
+} Uring_Slot;
+
+struct Uring_Reader {
+  int ring_fd;
+  int fd;
+  int64_t size;
+
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;
+  size_t sq_map_len, cq_map_len, sqes_len;
+  unsigned to_submit;
+
+  Uring_Slot slots[URING_SLOTS];
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+Uring_Reader *uring_open(int fd, int64_t size)
+{
+  Uring_Reader *r = calloc(1, sizeof(Uring_Reader));
+  if (!r) return NULL;
+
+  struct io_uring_params p = {0};
+  r->ring_fd = uring_setup(URING_ENTRIES, &p);
+  stats_add(io_syscalls, 1);
+  if (r->ring_fd < 0) {
+    free(r);
+    return NULL;
+  }
+  r->fd = fd;
+  r->size = size;
+
+  r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  // newer kernels map both rings at once
+  int single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && r->cq_map_len > r->sq_map_len) r->sq_map_len = r->cq_map_len;
+
+  r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->ring_fd, IORING_OFF_SQ_RING);
+  r->cq_map = single ? r->sq_map :
+              mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->ring_fd, IORING_OFF_CQ_RING);
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 r->ring_fd, IORING_OFF_SQES);
+
+  if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+    if (r->sq_map == MAP_FAILED) r->sq_map = NULL;
+    if (r->cq_map == MAP_FAILED) r->cq_map = NULL;
+    if (r->sqes == MAP_FAILED) r->sqes = NULL;
+    uring_close(r);
+    return NULL;
+  }
+
+  uint8_t *sq = r->sq_map, *cq = r->cq_map;
+  r->sq_head = (unsigned*)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned*)(sq + p.sq_off.array);
+  r->sq_entries = p.sq_entries;
+  r->cq_head = (unsigned*)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  for (int i = 0; i < URING_SLOTS; i++) {
+    if (!(r->slots[i].data = malloc(URING_SLOT_SIZE))) {
+      uring_close(r);
+      return NULL;
+    }
+  }
+  return r;
+}
+
+// hand what we queued to the kernel, wait for `wait` completions
+static int ring_submit(Uring_Reader *r, unsigned wait)
+{
+  int ret;
+  do {
+    ret = uring_enter(r->ring_fd, r->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    stats_add(io_syscalls, 1);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret >= 0) r->to_submit = 0;
+  return ret < 0 ? -errno : 0;
+}
+
+static struct io_uring_sqe *ring_sqe(Uring_Reader *r)
+{
+  unsigned tail = *r->sq_tail;
+  if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+    return NULL;
+
+  unsigned index = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[index] = index;
+  return sqe;
+}
+
+static void ring_push(Uring_Reader *r)
+{
+  __atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+  r->to_submit++;
+}
+
+// take the completions, slots become READY (or FREE when they were canceled)
+static void ring_reap(Uring_Reader *r)
+{
+  unsigned head = *r->cq_head;
+
+  while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    head++;
+
+    if (cqe->user_data == URING_CANCEL) continue;
+
+    Uring_Slot *s = &r->slots[cqe->user_data - 1];
+    if (s->state == SLOT_CANCELING) {
+      s->state = SLOT_FREE;
+      continue;
+    }
+
+    s->state = SLOT_READY;
+    s->len = cqe->res > 0 ? cqe->res : 0;
+    s->err = cqe->res < 0 ? cqe->res : 0;
+    if (cqe->res > 0) stats_add(io_bytes, cqe->res);
+  }
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// a READY slot which doesn't have all it asked for: the read failed, or
+// the file ends in it (cut short after we opened it)
+static int slot_short(const Uring_Slot *s)
+{
+  return s->state == SLOT_READY && (s->err || s->len < s->want);
+}
+
+// bytes of the file the slot stands for. a short slot answers for all of
+// what it asked: the error, or the end after what it got
+static int slot_span(const Uring_Slot *s)
+{
+  return s->want;
+}
+
+static Uring_Slot *slot_at(Uring_Reader *r, int64_t pos)
+{
+  for (int i = 0; i < URING_SLOTS; i++) {
+    Uring_Slot *s = &r->slots[i];
+    if ((s->state == SLOT_READY || s->state == SLOT_INFLIGHT) &&
+        pos >= s->off && pos < s->off + slot_span(s))
+      return s;
+  }
+  return NULL;
+}
+
+static void slot_cancel(Uring_Reader *r, Uring_Slot *s)
+{
+  if (s->state == SLOT_READY) {
+    s->state = SLOT_FREE;
+    return;
+  }
+  if (s->state != SLOT_INFLIGHT) return;
+
+  // until its completion comes the kernel may still write into it
+  s->state = SLOT_CANCELING;
+  struct io_uring_sqe *sqe = ring_sqe(r);
+  if (!sqe) return;
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t)(s - r->slots) + 1;
+  sqe->user_data = URING_CANCEL;
+  ring_push(r);
+  stats_add(uring_cancels, 1);
+}
+
+// a free slot, or a READY one we don't need soon: behind the position
+// first (the furthest back), else the furthest ahead of it
+static Uring_Slot *slot_free(Uring_Reader *r, int64_t pos)
+{
+  Uring_Slot *victim = NULL;
+  int64_t victim_score = -1;
+
+  for (int i = 0; i < URING_SLOTS; i++) {
+    Uring_Slot *s = &r->slots[i];
+    if (s->state == SLOT_FREE) return s;
+    if (s->state != SLOT_READY || (pos >= s->off && pos < s->off + slot_span(s))) continue;
+
+    int64_t score = s->off + slot_span(s) <= pos ? r->size + (pos - s->off) : s->off - pos;
+    if (score > victim_score) {
+      victim = s;
+      victim_score = score;
+    }
+  }
+  return victim;
+}
+
+static int slot_read(Uring_Reader *r, Uring_Slot *s, int64_t off)
+{
+  struct io_uring_sqe *sqe = ring_sqe(r);
+  if (!sqe) return -1;
+
+  s->off = off;
+  s->want = r->size - off < URING_SLOT_SIZE ? r->size - off : URING_SLOT_SIZE;
+  s->len = s->err = 0;
+  s->iov = (struct iovec){ .iov_base = s->data, .iov_len = s->want };
+  s->state = SLOT_INFLIGHT;
+
+  // READV: 5.1 kernels have it, READ came later
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = r->fd;
+  sqe->addr = (uint64_t)(uintptr_t)&s->iov;
+  sqe->len = 1;
+  sqe->off = off;
+  sqe->user_data = (uint64_t)(s - r->slots) + 1;
+  ring_push(r);
+  return 0;
+}
+
+// keep the slots busy with what comes after pos
+static void readahead(Uring_Reader *r, int64_t pos)
+{
+  int64_t next = pos;
+
+  for (int i = 0; i < URING_SLOTS && next < r->size; i++) {
+    // nothing to read after a failed read or the end of the file
+    Uring_Slot *s = slot_at(r, next);
+    if (s) {
+      if (slot_short(s)) break;
+      next = s->off + slot_span(s);
+      continue;
+    }
+
+    // only reuse a slot for something closer than what it holds
+    Uring_Slot *free = slot_free(r, pos);
+    if (!free) break;
+    if (free->state == SLOT_READY && free->off > pos && free->off < next) break;
+
+    if (slot_read(r, free, next) < 0) break;
+    next += free->want;
+  }
+}
+
+int uring_read(Uring_Reader *r, uint8_t *buf, int len, int64_t pos)
+{
+  if (pos >= r->size) return 0;
+
+  for (;;) {
+    ring_reap(r);
+
+    Uring_Slot *s = slot_at(r, pos);
+    if (!s) {
+      readahead(r, pos);
+      if (!slot_at(r, pos)) return -EAGAIN; // no room in the ring, read it normally
+      continue;
+    }
+
+    if (s->state == SLOT_INFLIGHT) {
+      // the readahead didn't make it, this is the wait io_uring is here to avoid
+      stats_add(uring_waits, 1);
+      int ret = ring_submit(r, 1);
+      if (ret < 0) return ret;
+      continue;
+    }
+
+    // the slot stays: asked again, the same answer without reading again
+    if (s->err) return s->err;
+    if (pos >= s->off + s->len) return 0;
+
+    int n = s->off + s->len - pos;
+    if (n > len) n = len;
+    memcpy(buf, s->data + (pos - s->off), n);
+
+    // the slot is done: start the next read now, it has until we come back
+    readahead(r, pos + n);
+    if (r->to_submit) ring_submit(r, 0);
+    return n;
+  }
+}
+
+void uring_seek(Uring_Reader *r, int64_t pos)
+{
+  ring_reap(r);
+
+  int64_t horizon = pos + (int64_t)URING_SLOTS * URING_SLOT_SIZE;
+  for (int i = 0; i < URING_SLOTS; i++) {
+    Uring_Slot *s = &r->slots[i];
+    if (s->state != SLOT_INFLIGHT) continue;
+    if (s->off + s->want <= pos || s->off >= horizon) slot_cancel(r, s);
+  }
+
+  readahead(r, pos);
+  if (r->to_submit) ring_submit(r, 0);
+}
+
+void uring_close(Uring_Reader *r)
+{
+  if (!r) return;
+
+  // the kernel must be done with our buffers before they go
+  if (r->sqes) {
+    for (int i = 0; i < URING_SLOTS; i++)
+      slot_cancel(r, &r->slots[i]);
+
+    for (;;) {
+      ring_reap(r);
+      int busy = 0;
+      for (int i = 0; i < URING_SLOTS; i++)
+        busy |= r->slots[i].state == SLOT_CANCELING || r->slots[i].state == SLOT_INFLIGHT;
+      if (!busy || ring_submit(r, 1) < 0) break;
+    }
+  }
+
+  if (r->sqes) munmap(r->sqes, r->sqes_len);
+  if (r->cq_map && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_map_len);
+  if (r->sq_map) munmap(r->sq_map, r->sq_map_len);
+  if (r->ring_fd >= 0) close(r->ring_fd);
+
+  for (int i = 0; i < URING_SLOTS; i++)
+    free(r->slots[i].data);
+  free(r);
+}
@@ -0,0 +1,24 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+
+// asynchronous readahead of one file with io_uring (raw syscalls, no
+// liburing): a few large reads stay in flight ahead of the read position,
+// reads are copies from the ones that completed. used by --io uring
+
+typedef struct Uring_Reader Uring_Reader;
+
+// NULL when io_uring is not there (old kernel, seccomp, sysctl): read normally
+Uring_Reader *uring_open(int fd, int64_t size);
+void uring_close(Uring_Reader *r);
+
+// up to len bytes at pos, 0 at the end, -errno. waits only when the
+// readahead didn't get there yet
+int uring_read(Uring_Reader *r, uint8_t *buf, int len, int64_t pos);
+
+// the reader jumps to pos: cancel the reads that are not ahead of it
+// and start the new ones right away
+void uring_seek(Uring_Reader *r, int64_t pos);
+
+#endif
@@ -1,16 +1,31 @@
 #include <libavformat/avformat.h>
 #include <libavcodec/codec.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 
 #include "backend.h"
+#include "archive.h"
 #include "backend_utils.h"
 #include "control.h"
+#include "cue.h"
+#include "diskcache.h"
+#include "library.h"
+#include "socket.h"
+#include "source.h"
+#include "status.h"
 #include "utils.h"
 
 extern PlayBackState STATE;
-uint KeepPlayingDirectory = 1;
+atomic_uint KeepPlayingDirectory = 1;
+tomuOptions Options = {
+  .rewind_sec = 10,
+  .loop_cache_mb = 64,
+  .cache_ram_mb = 256,
+  .net_buffer_sec = 3,
+};
 
 // defined here because of the extren
 dirFiles DirFiles = {
@@ -20,10 +35,22 @@ dirFiles DirFiles = {
 inline void help()
 {
   printf(
-    "Usage: tomu [COMMAND] [PATH]\n"
+    "Usage: tomu [COMMAND...] [PATH | URL | -]\n"
+    " PATH: a file, a folder, a zip/tar, a CUE sheet (or one of its tracks, album.cue#3)\n"
     " Commands:\n\n"
 
     "   --loop            : loop same sound\n"
+    "   --stats           : print seek/playback counters at exit\n"
+    "   --rewind SECONDS  : played audio kept in memory for rewinds (10, 0 off)\n"
+    "   --loop-cache MB   : loop from memory files decoding to this size (64, 0 off)\n"
+    "   --cache-disk MB   : keep decoded files on disk, replay without decoding (0 off)\n"
+    "   --cache-ram MB    : of the disk cache, keep recent entries mapped (256)\n"
+    "   --shm-cache MB    : share decoded files with other tomu sessions (0 off)\n"
+    "   --rt              : real-time priority and locked buffers for the audio path\n"
+    "   --power-save SEC  : decode SEC seconds ahead in bursts, wake up less (off)\n"
+    "   --preload MB      : read files up to MB into memory first, bigger ones by windows (0 off)\n"
+    "   --io MODE         : how files are read: ffmpeg, read, mmap or uring (ffmpeg)\n"
+    "   --net-buffer SEC  : audio buffered from http(s) before playing and after a dropout (3)\n"
     "   --version         : show version of program\n"
     "   --help            : show help message\n"
 
@@ -39,6 +66,8 @@ inline void help()
     " ([) = audio speed decrease\n"
     " (]) = audio speed increase\n"
     " (</>) = (Pervious/Next) audio\n"
+    " (,/.) = (Previous/Next) chapter\n"
+    " (a/b) = A-B loop start/end here, (c) = clear A-B loop\n"
 
     "\nExample: tomu loop [FILE.mp3]\n"
   );
@@ -53,13 +82,38 @@ void path_handle(const char *path, uint loop)
 {
   struct stat st;
 
-  if (stat(path, &st) < 0 ) goto bad_path;
+  // stdin ("-"), a FIFO, a URL, an archive entry or a CUE track plays
+  // like a file, a zip/tar or a CUE sheet plays like a folder
+  int source = source_kind(path);
+  int folder = source < 0 ? stat(path, &st) == 0 && S_ISDIR(st.st_mode)
+                          : source == SOURCE_FILE && (archive_type(path) != ARCHIVE_NONE || cue_is_sheet(path));
+  if (source < 0 && !folder) goto bad_path;
+  if (source == SOURCE_NET) source_net_init();
+
+  socket_start();
+  status_open();
 
-  if (S_ISDIR(st.st_mode)){
+  if (folder){
     DirFiles.path = (char*)path;
+
+    // the tracks of a sheet are named as the files next to it
+    char parent[PATH_MAX];
+    if (cue_is_sheet(path)) {
+      snprintf(parent, sizeof(parent), "%s", path);
+      char *slash = strrchr(parent, '/');
+      if (slash) *slash = '\0';
+      else strcpy(parent, ".");
+      DirFiles.path = parent;
+    }
+
     DirFiles.files = extractDir(path);
+    if (!DirFiles.files || DirFiles.totalFiles == 0)
+      die("%s: nothing to play", path);
     DirFiles.DirLoopStop = false;
 
+    // duration, format and tags of the files it doesn't know yet
+    library_probe_start(DirFiles.library);
+
     shuffle(); // Set initial file
 
     // Keep playing files until the user quits 
@@ -85,13 +139,17 @@ void path_handle(const char *path, uint loop)
       free(DirFiles.files[i]);
     }
     free(DirFiles.files);
+    library_close(DirFiles.library);
+    DirFiles.library = NULL;
   }
   // FILE HANDLING
-  else if (S_ISREG(st.st_mode)) {
+  else {
     playback_run(path, loop);
   }
-  else goto bad_path;
 
+  diskcache_close();
+  status_close();
+  socket_stop();
   return;
 
 bad_path:
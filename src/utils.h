@@ -3,10 +3,28 @@
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <stdatomic.h>
 
 #define false 0
 #define true 1
-extern uint KeepPlayingDirectory;
+extern atomic_uint KeepPlayingDirectory;
+
+// command line options which are not a mode of their own
+typedef struct {
+  uint stats;         // --stats: print the counters at exit
+  int rewind_sec;     // --rewind: seconds of played audio kept for rewinds
+  int loop_cache_mb;  // --loop-cache: looped files up to this size play from memory
+  int cache_disk_mb;  // --cache-disk: decoded PCM kept on disk (0 off)
+  int cache_ram_mb;   // --cache-ram: of it, recent entries kept mapped
+  int shm_cache_mb;   // --shm-cache: PCM shared with the other sessions (0 off)
+  uint rt;            // --rt: real-time priority and locked memory for the audio path
+  int burst_sec;      // --power-save: seconds decoded ahead in one burst (0 off)
+  int preload_mb;     // --preload: the file (or a window this big) read into memory (0 off)
+  int io_mode;        // --io: who reads the file for the demuxer (IO_* in fileio.h)
+  int net_buffer_sec; // --net-buffer: jitter buffer pre-rolled for network sources (0 off)
+
+} tomuOptions;
+extern tomuOptions Options;
 
 void help();
 void cleanUP(AVFormatContext *fmtCTX, AVCodecContext *codecCTX);
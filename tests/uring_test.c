@@ -0,0 +1,174 @@
+// --io uring reader (src/uring.c) against the files that go wrong: one cut
+// short after it was opened and one whose reads fail. run by `make test`,
+// exits 1 on the first check that fails, 0 (skipped) without io_uring
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "uring.h"
+
+#define FILE_SIZE (3 * 1024 * 1024 + 1234) // a few slots, the last one short
+#define CUT_SIZE  (1536 * 1024)            // inside the second slot
+
+static int failed;
+
+#define CHECK(cond, ...) do {                     \
+    if (!(cond)) {                                \
+      fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+      fprintf(stderr, __VA_ARGS__);               \
+      fputc('\n', stderr);                        \
+      failed = 1;                                 \
+      return;                                     \
+    }                                             \
+  } while (0)
+
+static uint8_t byte_at(int64_t pos) { return (uint8_t)(pos * 2654435761u >> 13); }
+
+static int make_file(const char *path, int64_t size)
+{
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) return -1;
+
+  uint8_t buf[4096];
+  for (int64_t pos = 0; pos < size; pos += sizeof(buf)) {
+    int n = size - pos < (int64_t)sizeof(buf) ? size - pos : (int)sizeof(buf);
+    for (int i = 0; i < n; i++) buf[i] = byte_at(pos + i);
+    if (write(fd, buf, n) != n) {
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+// read from pos like the demuxer does until the reader says stop: bytes
+// read, *last what it said (0 end, -errno)
+static int64_t read_all(Uring_Reader *r, int64_t pos, int *last, int *bad)
+{
+  uint8_t buf[32768];
+  int64_t start = pos;
+  int n;
+
+  *bad = 0;
+  while ((n = uring_read(r, buf, sizeof(buf), pos)) > 0) {
+    for (int i = 0; i < n; i++) *bad |= buf[i] != byte_at(pos + i);
+    pos += n;
+  }
+  *last = n;
+  return pos - start;
+}
+
+static void test_whole(const char *path)
+{
+  int fd = make_file(path, FILE_SIZE);
+  CHECK(fd >= 0, "can't write %s", path);
+
+  Uring_Reader *r = uring_open(fd, FILE_SIZE);
+  CHECK(r, "uring_open");
+  uring_seek(r, 0);
+
+  int last, bad;
+  int64_t got = read_all(r, 0, &last, &bad);
+  CHECK(got == FILE_SIZE && last == 0 && !bad, "whole file: %lld bytes, ended with %d, bad %d",
+        (long long)got, last, bad);
+
+  // a seek back into what was read, then on to the end again
+  uring_seek(r, 4096);
+  got = read_all(r, 4096, &last, &bad);
+  CHECK(got == FILE_SIZE - 4096 && last == 0 && !bad, "after a seek: %lld bytes", (long long)got);
+
+  uring_close(r);
+  close(fd);
+}
+
+// the file got shorter after we opened it (re-tagged, synced): the reads
+// past the new end come back empty, that is the end, not a read to retry
+static void test_truncated(const char *path)
+{
+  int fd = make_file(path, FILE_SIZE);
+  CHECK(fd >= 0, "can't write %s", path);
+
+  Uring_Reader *r = uring_open(fd, FILE_SIZE);
+  CHECK(r, "uring_open");
+  CHECK(ftruncate(fd, CUT_SIZE) == 0, "ftruncate");
+  uring_seek(r, 0);
+
+  int last, bad;
+  int64_t got = read_all(r, 0, &last, &bad);
+  CHECK(got == CUT_SIZE && last == 0 && !bad, "cut file: %lld bytes of %d, ended with %d, bad %d",
+        (long long)got, CUT_SIZE, last, bad);
+
+  // asked again (the demuxer probes around the end): the same answer, no new reads
+  uint64_t syscalls = Stats.io_syscalls;
+  uint8_t buf[4096];
+  CHECK(uring_read(r, buf, sizeof(buf), CUT_SIZE) == 0, "past the cut again");
+  CHECK(uring_read(r, buf, sizeof(buf), CUT_SIZE + 100000) == 0, "further past the cut");
+  CHECK(Stats.io_syscalls == syscalls, "the empty reads were submitted again (%llu syscalls)",
+        (unsigned long long)(Stats.io_syscalls - syscalls));
+
+  uring_close(r);
+  close(fd);
+}
+
+// every read fails (a directory: EISDIR): the error comes back, every
+// time, and nothing is read again for it
+static void test_failing(const char *dir)
+{
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  CHECK(fd >= 0, "can't open %s", dir);
+
+  Uring_Reader *r = uring_open(fd, FILE_SIZE);
+  CHECK(r, "uring_open");
+  uring_seek(r, 0);
+
+  uint8_t buf[4096];
+  int n = uring_read(r, buf, sizeof(buf), 0);
+  CHECK(n == -EISDIR, "failing read: %d, wanted %d", n, -EISDIR);
+
+  uint64_t syscalls = Stats.io_syscalls;
+  n = uring_read(r, buf, sizeof(buf), 100);
+  CHECK(n == -EISDIR, "failing read again: %d", n);
+  CHECK(Stats.io_syscalls == syscalls, "the failed read was submitted again");
+
+  uring_close(r);
+  close(fd);
+}
+
+int main(void)
+{
+  char dir[] = "/tmp/tomu-uring-XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  char path[64];
+  snprintf(path, sizeof(path), "%s/file", dir);
+
+  // a stuck reader is a failure too, not a test run that never ends
+  alarm(20);
+
+  int probe = open(dir, O_RDONLY | O_DIRECTORY);
+  Uring_Reader *r = uring_open(probe, 0);
+  close(probe);
+  if (!r) {
+    printf("uring_test: no io_uring here, skipped\n");
+    rmdir(dir);
+    return 0;
+  }
+  uring_close(r);
+
+  test_whole(path);
+  test_truncated(path);
+  test_failing(dir);
+
+  unlink(path);
+  rmdir(dir);
+
+  printf("uring_test: %s\n", failed ? "FAILED" : "ok");
+  return failed;
+}